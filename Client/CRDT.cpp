@@ -1,15 +1,11 @@
 #include "CRDT.h"
+#include "../Utility/alloc_counter.h"
 #include <QFont>
+#include <QVarLengthArray>
 
 CRDT::CRDT(Client *client) : client(client) {
-  connect(client, &Client::remoteInsert, this, &CRDT::handleRemoteInsert);
-  connect(client, &Client::remotePaste, this, &CRDT::handleRemotePaste);
-  connect(client, &Client::remoteErase, this, &CRDT::handleRemoteErase);
-  connect(client, &Client::remoteChange, this, &CRDT::handleRemoteChange);
-  connect(client, &Client::remoteAlignChange, this,
-          &CRDT::handleRemoteAlignChange);
+  connectClient();
 
-  _symbols.push_back(QVector<Symbol>{});
   // Terminator ('\0') should not be included in the count
   this->size = -1;
 }
@@ -21,46 +17,57 @@ void CRDT::clear() {
   disconnect(client, &Client::remoteChange, this, &CRDT::handleRemoteChange);
   disconnect(client, &Client::remoteAlignChange, this,
              &CRDT::handleRemoteAlignChange);
+  disconnect(client, &Client::remoteEraseIds, this,
+             &CRDT::handleRemoteEraseIds);
+  disconnect(client, &Client::remoteChangeIds, this,
+             &CRDT::handleRemoteChangeIds);
+  disconnect(client, &Client::remoteEraseRange, this,
+             &CRDT::handleRemoteEraseRange);
 
-  for (QVector<Symbol> v : _symbols) {
-    v.clear();
-  }
   _symbols.clear();
-  _symbols.push_back(QVector<Symbol>{});
   this->size = -1;
   _siteId = 0;
   _counter = 0;
   strategyCache.clear();
+  client->collectFormats();
+
+  connectClient();
+}
 
+void CRDT::connectClient() {
   connect(client, &Client::remoteInsert, this, &CRDT::handleRemoteInsert);
   connect(client, &Client::remotePaste, this, &CRDT::handleRemotePaste);
   connect(client, &Client::remoteErase, this, &CRDT::handleRemoteErase);
   connect(client, &Client::remoteChange, this, &CRDT::handleRemoteChange);
   connect(client, &Client::remoteAlignChange, this,
           &CRDT::handleRemoteAlignChange);
+  connect(client, &Client::remoteEraseIds, this, &CRDT::handleRemoteEraseIds);
+  connect(client, &Client::remoteChangeIds, this,
+          &CRDT::handleRemoteChangeIds);
+  connect(client, &Client::remoteEraseRange, this,
+          &CRDT::handleRemoteEraseRange);
 }
 
 int CRDT::getId() { return _siteId; }
 void CRDT::setId(int site) { this->_siteId = site; }
 
 QTextCharFormat CRDT::getSymbolFormat(int line, int index) {
-  return _symbols[line][index].getQTextCharFormat();
+  return _symbols.at(indexOf(line, index)).getQTextCharFormat();
 }
 
-void CRDT::localInsert(int line, int index, ushort value, QFont font,
-                       QColor color, Qt::Alignment align) {
+void CRDT::localInsert(int line, int index, ushort value, const QFont &font,
+                       const QColor &color, Qt::Alignment align) {
+  ALLOC_BUDGET("CRDT::localInsert", 8);
   if (line < 0 || index < 0)
     throw std::runtime_error("Error: index out of bound.\n");
 
   // Calculate position
-  QVector<Identifier> posBefore = findPosBefore(line, index);
-  QVector<Identifier> posAfter = findPosAfter(line, index);
-  QVector<Identifier> newPos;
-  QVector<Identifier> position =
-      generatePositionBetween(posBefore, posAfter, newPos);
+  Position newPos;
+  generatePositionBetween(findPosBefore(line, index),
+                          findPosAfter(line, index), newPos);
 
   // Generate symbol
-  Symbol s(value, newPos, ++_counter, font, color);
+  Symbol s(value, std::move(newPos), ++_counter, font, color);
   if (s.getValue() == '\0' || s.getValue() == '\n') {
     if (align == Qt::AlignLeft) {
       s.setAlignment(SymbolFormat::Alignment::ALIGN_LEFT);
@@ -75,30 +82,26 @@ void CRDT::localInsert(int line, int index, ushort value, QFont font,
   this->size++;
 
   // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = INSERT_SYMBOL;
-  message["symbol"] = s.toJson();
-
-  client->sendJson(message);
+  client->sendOperation(Operation(INSERT_SYMBOL, _siteId, QVector<Symbol>{s}));
 }
 
-void CRDT::localInsertGroup(int &line, int &index, QString partial, QFont font,
-                            QColor color, Qt::Alignment align) {
+void CRDT::localInsertGroup(int &line, int &index, const QString &partial,
+                            const QFont &font, const QColor &color,
+                            Qt::Alignment align) {
   if (line < 0 || index < 0)
     throw std::runtime_error("Error: index out of bound.\n");
+  // Calculate positions, all at once
+  QVector<Position> positions;
+  generatePositionsBetween(findPosBefore(line, index),
+                           findPosAfter(line, index), partial.length(),
+                           positions);
+
   QVector<Symbol> vector;
+  vector.reserve(partial.length());
   for (int i = 0; i < partial.length(); i++) {
-    // Calculate position
-    QVector<Identifier> posBefore = findPosBefore(line, index);
-    QVector<Identifier> posAfter = findPosAfter(line, index);
-    QVector<Identifier> newPos;
-    QVector<Identifier> position =
-        generatePositionBetween(posBefore, posAfter, newPos);
-
     // Generate symbol
-    Symbol s(partial.at(i).unicode(), newPos, ++_counter, font, color);
+    Symbol s(partial.at(i).unicode(), std::move(positions[i]), ++_counter,
+             font, color);
     if (s.getValue() == '\0' || s.getValue() == '\n') {
       if (align == (Qt::AlignLeft | Qt::AlignLeading))
         s.setAlignment(SymbolFormat::Alignment::ALIGN_LEFT);
@@ -109,84 +112,46 @@ void CRDT::localInsertGroup(int &line, int &index, QString partial, QFont font,
     }
 
     vector.push_back(s);
-
-    insertChar(s, line, index);
-    this->size++;
-    if (s.getValue() == '\n') {
-      line += 1;
-      index = 0;
-    } else {
-      index += 1;
-    }
   }
 
-  // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = PASTE;
-  message["tot_symbols"] = vector.length();
+  // Spliced in at once, the insertion point ending after it
+  int first = indexOf(line, index);
+  _symbols.insert(first, vector.constData(), vector.size());
+  this->size += vector.size();
+  lineIndexOf(first + vector.size(), line, index);
 
-  QByteArray toSend = client->createByteArrayFileContent(message, vector);
-  client->sendByteArray(toSend);
+  // Broadcast
+  client->sendOperation(Operation(PASTE, _siteId, std::move(vector)));
 }
 
 void CRDT::localChangeAlignment(int line, SymbolFormat::Alignment align) {
-
-  Symbol s = _symbols[line][_symbols[line].size() - 1];
-
+  Symbol &s = _symbols.at(lastOfLine(line));
   s.setAlignment(align);
-  _symbols[line][_symbols[line].size() - 1] = s;
 
   // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = ALIGN;
-  message["symbol"] = s.toJson();
-
-  client->sendJson(message);
+  client->sendOperation(Operation(ALIGN, _siteId, QVector<Symbol>{s}));
 }
 
 SymbolFormat::Alignment CRDT::getAlignmentLine(int line) {
-  return _symbols[line][_symbols[line].size() - 1].getAlignment();
+  return _symbols.at(lastOfLine(line)).getAlignment();
 }
 
-QVector<Identifier> CRDT::findPosBefore(int line, int index) {
-  int newLine = line;
-  int newIndex = index;
-
-  if (index == 0 && line == 0)
-    return QVector<Identifier>{};
-  else if (index == 0 && line != 0) {
-    newLine = line - 1;
-    newIndex = _symbols[newLine].size();
-  }
-  return _symbols[newLine][newIndex - 1].getPosition();
+// Positions are borrowed from the symbols, the empty one standing for the
+// beginning or the end of the document
+const Position &CRDT::findPosBefore(int line, int index) {
+  static const Position none;
+  int i = indexOf(line, index);
+  return i == 0 ? none : _symbols.at(i - 1).getPositionRef();
 }
 
-QVector<Identifier> CRDT::findPosAfter(int line, int index) {
-  int newLine = line;
-  int newIndex = index;
-
-  int numLines = _symbols.size();
-  int numChars = line < _symbols.size() ? _symbols[line].size() : 0;
-
-  if ((line == numLines - 1) && index == numChars)
-    return QVector<Identifier>{};
-  else if ((line < numLines - 1) && index == numChars) {
-    newLine = line + 1;
-    newIndex = 0;
-  } else if ((line > numLines - 1) && index == 0) {
-    return QVector<Identifier>{};
-  }
-  return _symbols[newLine][newIndex].getPosition();
+const Position &CRDT::findPosAfter(int line, int index) {
+  static const Position none;
+  int i = indexOf(line, index);
+  return i >= _symbols.size() ? none : _symbols.at(i).getPositionRef();
 }
 
-QVector<Identifier>
-CRDT::generatePositionBetween(QVector<Identifier> &pos1,
-                              const QVector<Identifier> &pos2,
-                              QVector<Identifier> &newPos, int level) {
+void CRDT::generatePositionBetween(const Position &pos1, const Position &pos2,
+                                   Position &newPos, int level) {
   Identifier id1 =
       level < pos1.size() ? pos1[level] : Identifier(0, this->_siteId);
   Identifier id2 =
@@ -196,28 +161,87 @@ CRDT::generatePositionBetween(QVector<Identifier> &pos1,
   if (id2.digit - id1.digit > 1) {
     // Case 1: enough space to add in between
     int newDigit = generateIdBetween(id1.digit, id2.digit, level);
-    newPos.push_back(Identifier(newDigit, this->_siteId));
-    return newPos;
+    newPos.append(Identifier(newDigit, this->_siteId));
   } else if (id2.digit - id1.digit == 1) {
     // Case 2: no space in between, use identifier of first position
-    newPos.push_back(id1);
-    return generatePositionBetween(pos1, QVector<Identifier>{}, newPos,
-                                   level + 1);
+    newPos.append(id1);
+    generatePositionBetween(pos1, Position(), newPos, level + 1);
   } else if (id1.digit == id2.digit) {
     // Case 3: same digit, use site id to discriminate
     if (id1.site < id2.site) {
-      newPos.push_back(id1);
-      return generatePositionBetween(pos1, QVector<Identifier>{}, newPos,
-                                     level + 1);
+      newPos.append(id1);
+      generatePositionBetween(pos1, Position(), newPos, level + 1);
     } else if (id1.site == id2.site) {
-      newPos.push_back(id1);
-      return generatePositionBetween(pos1, pos2, newPos, level + 1);
+      newPos.append(id1);
+      generatePositionBetween(pos1, pos2, newPos, level + 1);
     } else {
       throw std::runtime_error("Invalid ordering");
     }
   }
 }
 
+// Positions of count symbols inserted together between pos1 and pos2, in
+// order: instead of placing each one after the previous, which adds a level
+// every few symbols, they are spread evenly over the free digits of the
+// fewest levels that can hold them all, below the prefix found as
+// generatePositionBetween would. Levels after the first one offer the
+// digits from 1 to BASE - 1
+void CRDT::generatePositionsBetween(const Position &pos1, const Position &pos2,
+                                    int count, QVector<Position> &positions) {
+  Position prefix;
+  int lo, hi;
+  findRoomBetween(pos1, pos2, prefix, lo, hi);
+  int levels = 1;
+  quint64 capacity = hi - lo - 1;
+  while (capacity < static_cast<quint64>(count)) {
+    capacity *= BASE - 1;
+    levels++;
+  }
+
+  positions.reserve(count);
+  QVarLengthArray<int, 8> digits(levels);
+  for (int j = 0; j < count; j++) {
+    quint64 slot = (j + 1) * capacity / (count + 1);
+    for (int level = levels - 1; level > 0; level--) {
+      digits[level] = 1 + slot % (BASE - 1);
+      slot /= BASE - 1;
+    }
+    digits[0] = lo + 1 + static_cast<int>(slot);
+
+    Position position = prefix;
+    position.reserve(prefix.size() + levels);
+    for (int digit : digits)
+      position.append(Identifier(digit, this->_siteId));
+    positions.append(std::move(position));
+  }
+}
+
+// Prefix shared by the positions between pos1 and pos2, and the digits free
+// after it, lo < digit < hi
+void CRDT::findRoomBetween(const Position &pos1, const Position &pos2,
+                           Position &prefix, int &lo, int &hi) {
+  bool bounded = true; // By pos2, until a level where pos1 precedes it
+  for (int level = 0;; level++) {
+    Identifier id1 =
+        level < pos1.size() ? pos1[level] : Identifier(0, this->_siteId);
+    Identifier id2 = bounded && level < pos2.size()
+                         ? pos2[level]
+                         : Identifier(BASE, this->_siteId);
+    if (id2.digit - id1.digit > 1) {
+      lo = id1.digit;
+      hi = id2.digit;
+      return;
+    }
+    if (id2.digit - id1.digit == 1 ||
+        (id1.digit == id2.digit && id1.site < id2.site)) {
+      bounded = false;
+    } else if (id1.digit != id2.digit || id1.site != id2.site) {
+      throw std::runtime_error("Invalid ordering");
+    }
+    prefix.append(id1);
+  }
+}
+
 int CRDT::generateIdBetween(int id1, int id2, int level) {
   int interval = id2 - id1;
 
@@ -247,221 +271,135 @@ int CRDT::generateRandomNumBetween(int n1, int n2) {
 }
 
 void CRDT::localErase(int &line, int &index, int lenght) {
-  QVector<Symbol> symbols;
+  ALLOC_BUDGET("CRDT::localErase", 4 + lenght / 8);
+  int i = indexOf(line, index);
+  // Ranges rely on the counters growing with each site, which duplicate ids
+  // or another session of the user on the same site belie, and are not
+  // known to servers using JSON
+  if (lenght > 1 && client->getBinaryOps() && !client->hasSharedSite() &&
+      !_symbols.hasDuplicates()) {
+    eraseRange(i, lenght);
+    return;
+  }
 
-  for (int i = 0; i < lenght; i++) {
-    Symbol s = _symbols[line][index];
-    symbols.push_back(s);
-    bool newLineRemoved = (s.getValue() == '\n');
-    _symbols[line].erase(_symbols[line].begin() + index);
-
-    // Non-empty line after current line
-    if (newLineRemoved && line + 1 < _symbols.size()) {
-      std::copy(_symbols[line + 1].begin(), _symbols[line + 1].end(),
-                std::back_inserter(_symbols[line]));
-      _symbols.erase(_symbols.begin() + line + 1);
-    }
+  QVector<Symbol> symbols;
+  symbols.reserve(lenght);
+
+  // Following symbols, joined lines included, move to the same index
+  bool byId = !client->hasSharedSite();
+  for (int n = 0; n < lenght; n++) {
+    const Symbol &s = _symbols.at(i);
+    byId = byId && _symbols.isUnique(s.opId());
+    symbols.append(s);
+    _symbols.remove(i);
     this->size--;
   }
 
   // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = DELETE_SYMBOL;
+  Operation op(DELETE_SYMBOL, _siteId, std::move(symbols));
+  op.byId = byId;
+  client->sendOperation(op);
+}
+
+// Only the bounds are sent, and the last symbol of each site: the others
+// are copied nowhere
+void CRDT::eraseRange(int i, int length) {
+  QVector<Symbol> bounds{_symbols.at(i), _symbols.at(i + length - 1)};
+  QVector<OpId> seen;
+  int remaining = length;
+  _symbols.forEachFrom(i, [&seen, &remaining](const Symbol &s) {
+    addLastOpId(seen, s.opId());
+    return --remaining > 0;
+  });
+  _symbols.remove(i, length);
+  this->size -= length;
 
-  QByteArray toSend = client->createByteArrayFileContent(message, symbols);
-  client->sendByteArray(toSend);
+  // Broadcast
+  Operation op(DELETE_RANGE, _siteId, std::move(bounds));
+  op.ids = std::move(seen);
+  client->sendOperation(op);
 }
 
-void CRDT::localChange(int line, int index, QFont font, QColor color) {
-  Symbol s = _symbols[line][index];
+void CRDT::localChange(int line, int index, const QFont &font,
+                       const QColor &color) {
+  Symbol &s = _symbols.at(indexOf(line, index));
 
   // Update font and color
   s.setFormat(font, color);
-  _symbols[line][index] = s;
 
   // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = CHANGE;
-  message["symbol"] = s.toJson();
-
-  client->sendJson(message);
+  Operation op(CHANGE, _siteId, QVector<Symbol>{s});
+  op.byId = allUnique(op.symbols);
+  client->sendOperation(op);
 }
 
 void CRDT::localChangeGroup(int startLine, int endLine, int startIndex,
-                            int endIndex, QFont font, QColor color) {
+                            int endIndex, const QFont &font,
+                            const QColor &color) {
   if (startLine < 0 || startIndex < 0 || endLine < 0 || endIndex < 0)
     throw std::runtime_error("Error: index out of bound.\n");
   QVector<Symbol> vector;
-  if (startLine == endLine) {
-    for (int i = startIndex; i <= endIndex; i++) {
-      // UPDATE INDEX & LINE
-      Symbol s = _symbols[startLine][i];
-      // Update font and color
-      s.setFormat(font, color);
-      _symbols[startLine][i] = s;
-      vector.push_back(s);
-    }
-  } else {
-    for (int i = startIndex; i < _symbols[startLine].length(); i++) {
-
-      // UPDATE INDEX & LINE
-      Symbol s = _symbols[startLine][i];
-      // Update font and color
-      s.setFormat(font, color);
-      _symbols[startLine][i] = s;
-      vector.push_back(s);
-    }
-
-    for (int j = startLine + 1; j <= endLine - 1; j++) {
-
-      for (int i = 0; i < _symbols[j].length(); i++) {
-        // UPDATE INDEX & LINE
-        Symbol s = _symbols[j][i];
-
-        // Update font and color
-        s.setFormat(font, color);
-        _symbols[j][i] = s;
-
-        vector.push_back(s);
-      }
-    }
-    for (int i = 0; i <= endIndex; i++) {
-
-      // UPDATE INDEX & LINE
-      Symbol s = _symbols[endLine][i];
-      // Update font and color
-      s.setFormat(font, color);
-      _symbols[endLine][i] = s;
-      vector.push_back(s);
-    }
+  // Update font and color in place, from (startLine, startIndex) to
+  // (endLine, endIndex) included
+  int last = indexOf(endLine, endIndex);
+  for (int i = indexOf(startLine, startIndex); i <= last; i++) {
+    Symbol &s = _symbols.at(i);
+    s.setFormat(font, color);
+    vector.append(s);
   }
   // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = CHANGE;
-  message["tot_symbols"] = vector.size();
-
-  QByteArray toSend = client->createByteArrayFileContent(message, vector);
-  client->sendByteArray(toSend);
+  Operation op(CHANGE, _siteId, std::move(vector));
+  op.byId = allUnique(op.symbols);
+  client->sendOperation(op);
 }
 
 void CRDT::cursorPositionChanged(int line, int index) {
-  Symbol s = _symbols[line][index];
-
   // Broadcast
-  QJsonObject message;
-  message["type"] = QStringLiteral("operation");
-  message["editorId"] = _siteId;
-  message["operation_type"] = CURSOR;
-  message["symbol"] = s.toJson();
-
-  client->sendJson(message);
+  Operation op(CURSOR, _siteId, QVector<Symbol>{getSymbol(line, index)});
+  op.byId = allUnique(op.symbols);
+  client->sendOperation(op);
 }
 
-int CRDT::getSize() { return size; }
-
-bool CRDT::findPosition(Symbol s, int &line, int &index) {
-  int minLine = 0;
-  int totalLines = _symbols.size();
-  int maxLine = totalLines - 1;
-  QVector<Symbol> lastLine = _symbols[maxLine], currentLine, minCurrentLine,
-                  maxCurrentLine;
-  int midLine;
-  Symbol minLastChar, maxLastChar;
-
-  if ((_symbols.size() == 1 && _symbols[0].size() == 0) ||
-      Symbol::compare(s, _symbols[0][0]) < 0)
-    return false;
-
-  Symbol lastChar = lastLine[lastLine.size() - 1];
-
-  if (Symbol::compare(s, lastChar) > 0)
+// Symbols may be sent by OpId only if no other one has the same: ids are
+// resolved by the server and the other editors in their copy. Another
+// session on the same site may hold an id not known here yet
+bool CRDT::allUnique(const QVector<Symbol> &symbols) const {
+  if (client->hasSharedSite())
     return false;
-
-  // Binary search
-  while (minLine + 1 < maxLine) {
-    midLine = minLine + (maxLine - minLine) / 2;
-    currentLine = _symbols[midLine];
-    lastChar = currentLine[currentLine.size() - 1];
-
-    if (Symbol::compare(s, lastChar) == 0) {
-      line = midLine;
-      index = currentLine.size() - 1;
-      return true;
-    } else if (Symbol::compare(s, lastChar) < 0) {
-      maxLine = midLine;
-    } else {
-      minLine = midLine;
-    }
-  }
-
-  minCurrentLine = _symbols[minLine];
-  minLastChar = minCurrentLine[minCurrentLine.size() - 1];
-  maxCurrentLine = _symbols[maxLine];
-  maxLastChar = maxCurrentLine[maxCurrentLine.size() - 1];
-
-  if (Symbol::compare(s, minLastChar) <= 0) {
-    index = findIndexInLine(s, minCurrentLine);
-    line = minLine;
-    return true;
-  } else {
-    index = findIndexInLine(s, maxCurrentLine);
-    line = maxLine;
-    return true;
+  for (const Symbol &s : symbols) {
+    if (!_symbols.isUnique(s.opId()))
+      return false;
   }
+  return true;
 }
 
-int CRDT::findIndexInLine(Symbol s, QVector<Symbol> line) {
-  int left = 0, right = line.size() - 1, mid, compareNum;
-
-  if (line.size() == 0 || Symbol::compare(s, line[left]) < 0) {
-    return left;
-  } else if (Symbol::compare(s, line[right]) > 0) {
-    return _symbols.size();
-  }
-
-  while (left + 1 < right) {
-    mid = left + (right - left) / 2;
-    compareNum = Symbol::compare(s, line[mid]);
-
-    if (compareNum == 0) {
-      return mid;
-    } else if (compareNum > 0) {
-      left = mid;
-    } else {
-      right = mid;
-    }
-  }
+int CRDT::getSize() { return size; }
 
-  if (Symbol::compare(s, line[left]) == 0) {
-    return left;
-  } else if (Symbol::compare(s, line[right]) == 0) {
-    return right;
-  } else {
+// Symbols are borrowed, never copied, and found in O(log n) comparisons
+bool CRDT::findPosition(const Symbol &s, int &line, int &index) {
+  int i = _symbols.lowerBound(s);
+  if (i >= _symbols.size() || Symbol::compare(s, _symbols.at(i)) != 0)
     return false;
-  }
+  lineIndexOf(i, line, index);
+  return true;
 }
 
 QString CRDT::to_string() {
   QString str = "";
-  for (QVector<Symbol> line : _symbols) {
-    bool first = true;
-    for (Symbol s : line) {
-      if (first) {
-        first = false;
-      } else {
-        str += ", ";
-      }
-      str += s.to_string();
+  bool first = true;
+  _symbols.forEach([&str, &first](const Symbol &s) {
+    if (first) {
+      first = false;
+    } else {
+      str += ", ";
     }
-    str += "\n";
-  }
-  return str;
+    str += s.to_string();
+    if (s.getValue() == '\n') {
+      str += "\n";
+      first = true;
+    }
+  });
+  return str + "\n";
 }
 
 void CRDT::handleRemoteAlignChange(const Symbol &s) {
@@ -472,27 +410,74 @@ void CRDT::handleRemoteAlignChange(const Symbol &s) {
     return;
   }
 
-  _symbols[line][_symbols[line].size() - 1].setAlignment(align);
+  _symbols.at(lastOfLine(line)).setAlignment(align);
 
   // Insert in editor
   emit changeAlignment(align, line, index);
 }
 
+// A paste is a run of consecutive symbols of one site: unless another site
+// inserted between them concurrently, it is spliced in the document at once
 void CRDT::handleRemotePaste(const QVector<Symbol> &symbols) {
+  if (symbols.isEmpty())
+    return;
+  int i = _symbols.lowerBound(symbols.first());
+  if (!isContiguousAt(symbols, i)) {
+    insertOneByOne(symbols);
+    return;
+  }
+
+  int firstLine, firstIndex;
+  lineIndexOf(i, firstLine, firstIndex);
+  _symbols.insert(i, symbols.constData(), symbols.size());
+  this->size += symbols.size();
+  for (const Symbol &s : symbols)
+    trackCounter(s);
+
+  QString partial;
+  partial.reserve(symbols.size());
+  for (const Symbol &s : symbols) {
+    if (s.getValue() != '\0')
+      partial.append(s.getValue());
+  }
+  emit insertGroup(firstLine, firstIndex, partial,
+                   symbols.first().getQTextCharFormat());
+
+  // A '\n' or '\0' ends its line, positions follow from the run
+  int line = firstLine, index = firstIndex;
+  for (const Symbol &s : symbols) {
+    if (s.getValue() == '\0' || s.getValue() == '\n')
+      emit changeAlignment(s.getAlignment(), line, index);
+    if (s.getValue() == '\n') {
+      line++;
+      index = 0;
+    } else {
+      index++;
+    }
+  }
+}
+
+// Whether the symbols are in CRDT order and all fit before the symbol at
+// index i, i.e. no symbol in the document falls between them
+bool CRDT::isContiguousAt(const QVector<Symbol> &symbols, int i) const {
+  for (int k = 1; k < symbols.size(); k++) {
+    if (Symbol::compare(symbols.at(k - 1), symbols.at(k)) >= 0)
+      return false;
+  }
+  return i >= _symbols.size() ||
+         Symbol::compare(symbols.last(), _symbols.at(i)) < 0;
+}
+
+void CRDT::insertOneByOne(const QVector<Symbol> &symbols) {
   QString partial;
   int firstLine, firstIndex;
   QTextCharFormat newFormat;
   QVector<Symbol> alignChanges;
 
   for (int i = 0; i < symbols.size(); i++) {
-    Symbol s = symbols[i];
+    const Symbol &s = symbols.at(i);
     int line, index;
-    if (_symbols.size() != 0) {
-      findInsertPosition(s, line, index);
-    } else {
-      line = 0;
-      index = 0;
-    }
+    findInsertPosition(s, line, index);
 
     if (i == 0) {
       firstLine = line;
@@ -521,13 +506,9 @@ void CRDT::handleRemotePaste(const QVector<Symbol> &symbols) {
 }
 
 void CRDT::handleRemoteInsert(const Symbol &s) {
+  ALLOC_BUDGET("CRDT::handleRemoteInsert", 4);
   int line, index;
-  if (_symbols.size() != 0) {
-    findInsertPosition(s, line, index);
-  } else {
-    line = 0;
-    index = 0;
-  }
+  findInsertPosition(s, line, index);
 
   // Insert in crdt structure
   insertChar(s, line, index);
@@ -541,183 +522,167 @@ void CRDT::handleRemoteInsert(const Symbol &s) {
   emit insert(line, index, s);
 }
 
-void CRDT::insertChar(Symbol s, int line, int index) {
-  if (s.getValue() == '\n') { // Split line into two,
-                              // before and after the '\n'
-    QVector<Symbol> lineBefore;
-    std::copy(_symbols[line].begin(), _symbols[line].begin() + index,
-              std::back_inserter(lineBefore));
-    QVector<Symbol> lineAfter;
-    std::copy(_symbols[line].begin() + index, _symbols[line].end(),
-              std::back_inserter(lineAfter));
-
-    lineBefore.push_back(s); // Include '\n' in line before
-    _symbols[line] = lineBefore;
-    _symbols.insert(line + 1, lineAfter);
-  } else {
-    _symbols[line].insert(index, s);
-  }
+// A '\n' splits the line, ending the part before it
+void CRDT::insertChar(const Symbol &s, int line, int index) {
+  _symbols.insert(indexOf(line, index), s);
+  trackCounter(s);
 }
 
-void CRDT::findInsertPosition(Symbol s, int &line, int &index) {
-  int minLine = 0;
-  int totalLines = _symbols.size();
-  int maxLine = totalLines - 1;
+// Symbols of earlier sessions keep the ids of the new ones unique
+void CRDT::trackCounter(const Symbol &s) {
+  if (opIdSite(s.opId()) == _siteId && s.getCounter() > _counter)
+    _counter = s.getCounter();
+}
 
-  QVector<Symbol> lastLine = _symbols[maxLine], currentLine, minCurrentLine,
-                  maxCurrentLine;
-  int midLine;
-  Symbol minLastChar, maxLastChar;
-  if ((_symbols.size() == 1 && _symbols[0].size() == 0) ||
-      Symbol::compare(s, _symbols[0][0]) <= 0) {
-    line = 0;
-    index = 0;
-    return;
-  }
+void CRDT::findInsertPosition(const Symbol &s, int &line, int &index) {
+  lineIndexOf(_symbols.lowerBound(s), line, index);
+}
 
-  Symbol lastChar = lastLine[lastLine.size() - 1];
+int CRDT::indexOf(int line, int index) const {
+  return _symbols.lineStart(line) + index;
+}
 
-  if (Symbol::compare(s, lastChar) > 0) {
-    findEndPosition(lastChar, lastLine, totalLines, line, index);
-    return;
-  }
+void CRDT::lineIndexOf(int i, int &line, int &index) const {
+  line = _symbols.lineOf(i);
+  index = i - _symbols.lineStart(line);
+}
 
-  // Binary search
-  while (minLine + 1 < maxLine) {
-    midLine = minLine + (maxLine - minLine) / 2;
-    currentLine = _symbols[midLine];
-    lastChar = currentLine[currentLine.size() - 1];
+int CRDT::lastOfLine(int line) const {
+  return _symbols.lineStart(line + 1) - 1;
+}
 
-    if (Symbol::compare(s, lastChar) == 0) {
-      line = midLine;
-      index = currentLine.size() - 1;
-      return;
-    } else if (Symbol::compare(s, lastChar) < 0) {
-      maxLine = midLine;
-    } else {
-      minLine = midLine;
+// Symbols already deleted by another editor (i.e. another site) are skipped,
+// the others are erased from the editor once per contiguous run
+void CRDT::handleRemoteErase(const QVector<Symbol> &symbols) {
+  ALLOC_BUDGET("CRDT::handleRemoteErase", 4);
+  int start = -1, count = 0, line = 0, index = 0;
+
+  for (const Symbol &s : symbols) {
+    int i = _symbols.lowerBound(s);
+    if (i >= _symbols.size() || Symbol::compare(s, _symbols.at(i)) != 0)
+      continue;
+    if (i != start) {
+      if (count > 0)
+        emit erase(line, index, count);
+      start = i;
+      count = 0;
+      lineIndexOf(i, line, index);
     }
-  }
 
-  minCurrentLine = _symbols[minLine];
-  minLastChar = minCurrentLine[minCurrentLine.size() - 1];
-  maxCurrentLine = _symbols[maxLine];
-  maxLastChar = maxCurrentLine[maxCurrentLine.size() - 1];
-
-  if (Symbol::compare(s, minLastChar) <= 0) {
-    index = findInsertIndexInLine(s, minCurrentLine);
-    line = minLine;
-  } else {
-    index = findInsertIndexInLine(s, maxCurrentLine);
-    line = maxLine;
+    _symbols.remove(i);
+    this->size--;
+    count++;
   }
+  if (count > 0)
+    emit erase(line, index, count);
 }
 
-int CRDT::findInsertIndexInLine(Symbol s, QVector<Symbol> line) {
-  int left = 0, right = line.size() - 1, mid, compareNum;
-
-  if (line.size() == 0 || Symbol::compare(s, line[left]) < 0) {
-    return left;
-  } else if (Symbol::compare(s, line[right]) > 0) {
-    return _symbols.size();
-  }
+// Batch of hash lookups, without comparing positions. As in
+// handleRemoteErase, missing symbols are skipped and runs erased at once
+void CRDT::handleRemoteEraseIds(const QVector<OpId> &ids) {
+  ALLOC_BUDGET("CRDT::handleRemoteEraseIds", 4);
+  int start = -1, count = 0, line = 0, index = 0;
 
-  while (left + 1 < right) {
-    mid = left + (right - left) / 2;
-    compareNum = Symbol::compare(s, line[mid]);
-
-    if (compareNum == 0) {
-      return mid;
-    } else if (compareNum > 0) {
-      left = mid;
-    } else {
-      right = mid;
+  for (OpId id : ids) {
+    int i = _symbols.indexOf(id);
+    if (i < 0)
+      continue;
+    if (i != start) {
+      if (count > 0)
+        emit erase(line, index, count);
+      start = i;
+      count = 0;
+      lineIndexOf(i, line, index);
     }
-  }
-
-  if (Symbol::compare(s, line[left]) == 0) {
-    return left;
-  } else {
-    return right;
-  }
-}
 
-void CRDT::findEndPosition(Symbol lastChar, QVector<Symbol> lastLine,
-                           int totalLines, int &line, int &index) {
-  if (lastChar.getValue() == '\n') {
-    line = totalLines;
-    index = 0;
-  } else {
-    line = totalLines - 1;
-    index = lastLine.size();
+    _symbols.remove(i);
+    this->size--;
+    count++;
   }
+  if (count > 0)
+    emit erase(line, index, count);
 }
 
-void CRDT::handleRemoteErase(const QVector<Symbol> &symbols) {
-  int startLine, startIndex, endLine, endIndex;
-
-  for (int i = 0; i < symbols.size(); i++) {
-
-    Symbol s = symbols[i];
+// Symbols inserted concurrently in the range are kept, splitting it in runs
+// each erased at once, from the last so that the positions of the others
+// still hold
+void CRDT::handleRemoteEraseRange(const Symbol &first, const Symbol &last,
+                                  const QVector<OpId> &seen) {
+  ALLOC_BUDGET("CRDT::handleRemoteEraseRange", 4);
+  QVector<QPair<int, int>> runs; // Start and length
+  int i = _symbols.lowerBound(first);
+  _symbols.forEachFrom(i, [&](const Symbol &s) {
+    if (Symbol::compare(s, last) > 0)
+      return false;
+    if (isKnownOpId(seen, s.opId())) {
+      if (!runs.isEmpty() && runs.last().first + runs.last().second == i)
+        runs.last().second++;
+      else
+        runs.append(qMakePair(i, 1));
+    }
+    i++;
+    return true;
+  });
 
+  for (int r = runs.size() - 1; r >= 0; r--) {
     int line, index;
-    bool res = findPosition(s, line, index);
-    if (i == 0) {
-      startLine = line;
-      startIndex = index;
-    }
-    endLine = line;
-    endIndex = index;
+    lineIndexOf(runs.at(r).first, line, index);
+    _symbols.remove(runs.at(r).first, runs.at(r).second);
+    this->size -= runs.at(r).second;
+    emit erase(line, index, runs.at(r).second);
+  }
+}
 
-    if (!res) {
-      return;
-    }
+void CRDT::handleRemoteChangeIds(const QVector<OpId> &ids,
+                                 const QVector<Symbol> &formats) {
+  QVector<Symbol> symbols;
+  symbols.reserve(ids.size());
+  for (int n = 0; n < ids.size(); n++) {
+    int i = _symbols.indexOf(ids.at(n));
+    if (i < 0)
+      continue;
 
-    bool newLineRemoved = (s.getValue() == '\n');
-    if (index >= 0 && line >= 0) { // Otherwise already deleted
-                                   // by another editor (i.e. another site)
-
-      // Non-empty line after current line
-      if (newLineRemoved && line + 1 < _symbols.size()) {
-        _symbols[line].erase(_symbols[line].begin() + index);
-        std::copy(_symbols[line + 1].begin(), _symbols[line + 1].end(),
-                  std::back_inserter(_symbols[line]));
-        _symbols.erase(_symbols.begin() + line + 1);
-      } else if (index == 0 && _symbols[line].size() == 1) {
-        _symbols[line].erase(_symbols[line].begin() + index);
-        _symbols.erase(_symbols.begin() + line);
-      } else {
-        _symbols[line].erase(_symbols[line].begin() + index);
-      }
-      this->size--;
-    }
+    // Update symbol, the value and the id don't change
+    Symbol &s = _symbols.at(i);
+    s.setFormatId(formats.at(n).getFormatId());
+    symbols.append(s);
   }
-  emit erase(startLine, startIndex, symbols.size());
+
+  emit change(symbols);
 }
 
 void CRDT::handleRemoteChange(const QVector<Symbol> &symbols) {
-  for (Symbol s : symbols) {
-    int line, index;
-    bool res = findPosition(s, line, index);
-    if (!res)
-      return;
+  QVector<Symbol> changed;
+  changed.reserve(symbols.size());
+  for (const Symbol &s : symbols) {
+    int i = _symbols.lowerBound(s);
+    if (i >= _symbols.size() || Symbol::compare(s, _symbols.at(i)) != 0)
+      continue;
 
     // Update symbol
-    _symbols[line][index] = s;
+    _symbols.replace(i, s);
+    changed.append(s);
   }
 
-  emit change(symbols);
+  emit change(changed);
 }
 
-Symbol CRDT::getSymbol(int line, int index) {
-  Symbol s = _symbols[line][index];
-  return s;
+const Symbol &CRDT::getSymbol(int line, int index) {
+  return _symbols.at(indexOf(line, index));
 }
 
-void CRDT::getPositionFromSymbol(const Symbol &s, int &line, int &index) {
-  findPosition(s, line, index);
+bool CRDT::getPositionFromSymbol(const Symbol &s, int &line, int &index) {
+  return findPosition(s, line, index);
+}
+
+bool CRDT::getPositionFromId(OpId id, int &line, int &index) {
+  int i = _symbols.indexOf(id);
+  if (i < 0)
+    return false;
+  lineIndexOf(i, line, index);
+  return true;
 }
 
 int CRDT::getSiteID() { return _siteId; }
 
-int CRDT::lineSize(int line) { return _symbols[line].size(); }
+int CRDT::lineSize(int line) { return _symbols.lineSize(line); }
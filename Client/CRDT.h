@@ -3,6 +3,7 @@
 
 #include "../Utility/common.h"
 #include "../Utility/symbol.h"
+#include "../Utility/symbol_tree.h"
 #include "client.h"
 #include <QJsonObject>
 #include <map>
@@ -20,32 +21,41 @@ public:
   void clear();
   int getId();
   void setId(int site);
-  void localInsert(int line, int index, ushort value, QFont font, QColor color,
-                   Qt::Alignment align);
-  void localInsertGroup(int &line, int &index, QString partial, QFont font,
-                        QColor color, Qt::Alignment align);
+  void localInsert(int line, int index, ushort value, const QFont &font,
+                   const QColor &color, Qt::Alignment align);
+  void localInsertGroup(int &line, int &index, const QString &partial,
+                        const QFont &font, const QColor &color,
+                        Qt::Alignment align);
   void localErase(int &line, int &index, int length);
 
   int getSiteID();
   void localChangeAlignment(int line, SymbolFormat::Alignment align);
-  void localChange(int line, int index, QFont font, QColor color);
+  void localChange(int line, int index, const QFont &font,
+                   const QColor &color);
   void localChangeGroup(int startLine, int endLine, int startIndex,
-                        int endIndex, QFont font, QColor color);
+                        int endIndex, const QFont &font, const QColor &color);
   int getSize();
   QString to_string();
-  Symbol getSymbol(int line, int index);
+  // Valid until the next change to the document
+  const Symbol &getSymbol(int line, int index);
   void cursorPositionChanged(int line, int index);
-  void getPositionFromSymbol(const Symbol &s, int &line, int &index);
+  bool getPositionFromSymbol(const Symbol &s, int &line, int &index);
+  bool getPositionFromId(OpId id, int &line, int &index);
   SymbolFormat::Alignment getAlignmentLine(int line);
   QTextCharFormat getSymbolFormat(int line, int index);
   int lineSize(int line);
-  bool findPosition(Symbol s, int &line, int &index);
+  bool findPosition(const Symbol &s, int &line, int &index);
 
 private slots:
   void handleRemoteInsert(const Symbol &s);
   void handleRemotePaste(const QVector<Symbol> &s);
   void handleRemoteErase(const QVector<Symbol> &s);
+  void handleRemoteEraseIds(const QVector<OpId> &ids);
+  void handleRemoteEraseRange(const Symbol &first, const Symbol &last,
+                              const QVector<OpId> &seen);
   void handleRemoteChange(const QVector<Symbol> &s);
+  void handleRemoteChangeIds(const QVector<OpId> &ids,
+                             const QVector<Symbol> &formats);
   void handleRemoteAlignChange(const Symbol &s);
 
 signals:
@@ -58,29 +68,37 @@ signals:
 
 private:
   int _siteId;
-  QVector<QVector<Symbol>> _symbols;
-  int _counter = 0;
+  SymbolTree _symbols;
+  int _counter = 0; // Of the last symbol inserted by this site
   std::map<int, bool> strategyCache;
   Client *client;
   int size = 0;
 
-  QVector<Identifier> generatePositionBetween(QVector<Identifier> &pos1,
-                                              const QVector<Identifier> &pos2,
-                                              QVector<Identifier> &newPos,
-                                              int level = 0);
+  void generatePositionBetween(const Position &pos1, const Position &pos2,
+                               Position &newPos, int level = 0);
+  void generatePositionsBetween(const Position &pos1, const Position &pos2,
+                                int count, QVector<Position> &positions);
+  void findRoomBetween(const Position &pos1, const Position &pos2,
+                       Position &prefix, int &lo, int &hi);
   int generateIdBetween(int id1, int id2, int level);
   bool generateRandomBool();
   int generateRandomNumBetween(int n1, int n2);
 
-  int findIndexInLine(Symbol s, QVector<Symbol> line);
-  void findInsertPosition(Symbol s, int &line, int &index);
-  int findInsertIndexInLine(Symbol s, QVector<Symbol> line);
-  void findEndPosition(Symbol lastChar, QVector<Symbol> lastLine,
-                       int totalLines, int &line, int &index);
-  void insertChar(Symbol s, int line, int index);
+  void findInsertPosition(const Symbol &s, int &line, int &index);
+  // Conversions between (line, index) and index in the document
+  int indexOf(int line, int index) const;
+  void lineIndexOf(int i, int &line, int &index) const;
+  int lastOfLine(int line) const;
+  void insertChar(const Symbol &s, int line, int index);
+  void trackCounter(const Symbol &s);
+  bool isContiguousAt(const QVector<Symbol> &symbols, int i) const;
+  void insertOneByOne(const QVector<Symbol> &symbols);
+  void connectClient();
+  void eraseRange(int i, int length);
+  bool allUnique(const QVector<Symbol> &symbols) const;
 
-  QVector<Identifier> findPosBefore(int line, int index);
-  QVector<Identifier> findPosAfter(int line, int index);
+  const Position &findPosBefore(int line, int index);
+  const Position &findPosAfter(int line, int index);
 };
 
 #endif // CRDT_H
@@ -66,3 +66,11 @@ FORMS += \
 
 RESOURCES += \
     client.qrc
+
+# zlib for frame compression: bundled with Qt on Windows
+win32: QT += zlib-private
+else: LIBS += -lz
+
+# Count the heap allocations of the editing paths, reporting the operations
+# over budget (see Utility/alloc_counter.h)
+#DEFINES += ALLOC_COUNTER
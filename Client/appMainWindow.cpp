@@ -66,6 +66,8 @@ AppMainWindow::AppMainWindow(QWidget *parent, Client *c)
   connect(home, &Home::modify, modify, &Modify::upload);
   connect(home, &Home::logOut, this, &AppMainWindow::on_logOut);
   connect(client, &Client::error, this, &AppMainWindow::error);
+  connect(client, &Client::incompatibleServer, this,
+          &AppMainWindow::on_incompatibleServer);
 }
 
 AppMainWindow::~AppMainWindow() { delete ui; }
@@ -176,6 +178,14 @@ void AppMainWindow::error(QAbstractSocket::SocketError socketError) {
   signup->enableAllButtons();
 }
 
+void AppMainWindow::on_incompatibleServer() {
+  QMessageBox::critical(this, tr("Error"),
+                        tr("The server runs an incompatible version, "
+                           "please update the application"));
+  login->enableAllButtons();
+  signup->enableAllButtons();
+}
+
 void AppMainWindow::errorLineEdit(QLineEdit *lineEdit, bool f) {
   lineEdit->setProperty("error", f);
 
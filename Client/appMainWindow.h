@@ -30,6 +30,7 @@ public:
 private slots:
   void on_logOut();
   void error(QAbstractSocket::SocketError socketError);
+  void on_incompatibleServer();
   void on_changeWidget(int widget);
   void on_changeLoginLabel();
 
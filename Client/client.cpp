@@ -16,26 +16,62 @@
 #include <QPixmap>
 #include <QSslConfiguration>
 #include <QTcpSocket>
+#include <QTimer>
 #include <QtEndian>
 
 Client::Client(QObject *parent, QString addr, quint16 port)
-    : QObject(parent), m_clientSocket(new QSslSocket(this)), m_loggedIn(false) {
+    : QObject(parent), m_clientSocket(new QSslSocket(this)), m_loggedIn(false),
+      m_outbox(&m_sentFormats), m_flushTimer(new QTimer(this)),
+      m_pingTimer(new QTimer(this)) {
   this->addr = addr;
   this->port = port;
 
+  m_flushTimer->setSingleShot(true);
+  connect(m_flushTimer, &QTimer::timeout, this, &Client::flushOutbox);
+  connect(m_pingTimer, &QTimer::timeout, this, &Client::sendPing);
+  m_clock.start();
+  m_reader.setCompressionStats(&m_compressionStats);
+
   connect(m_clientSocket, &QSslSocket::connected, this, &Client::connected);
+  connect(m_clientSocket, &QSslSocket::encrypted, this, &Client::onEncrypted);
+  connect(m_clientSocket, &QAbstractSocket::stateChanged, this,
+          [this](QAbstractSocket::SocketState state) -> void {
+            if (state != QAbstractSocket::UnconnectedState)
+              return;
+            // Requests still waiting for a connection or a reply are lost
+            this->m_state = DISCONNECTED;
+            this->m_pendingFrames.clear();
+            this->m_requests.clear();
+          });
+  // Failures of a connection opened in advance are not reported: the user
+  // didn't ask for anything yet
   connect(m_clientSocket,
           static_cast<void (QSslSocket::*)(QAbstractSocket::SocketError)>(
               &QAbstractSocket::error),
-          this, &Client::error);
+          this, [this](QAbstractSocket::SocketError socketError) -> void {
+            if (!this->m_prewarm)
+              emit error(socketError);
+          });
   connect(m_clientSocket, &QSslSocket::disconnected, this, [this]() -> void {
-    this->m_received_data.clear();
-    this->m_exptected_json_size = 0;
+    this->m_reader.clear();
+    this->m_binaryOps = false;
+    this->m_sharedSite = false;
+    this->m_sentFormats.clear();
+    this->m_receivedFormats.clear();
+    this->m_flushTimer->stop();
+    this->m_pingTimer->stop();
+    this->m_outbox.clear();
+    this->m_hasPendingCursor = false;
+    this->m_srttMs = 0;
+    this->m_writer.disableCompression();
+    this->logStats();
   });
   connect(this, &Client::byteArrayReceived, this, &Client::on_byteArrayReceived,
           Qt::QueuedConnection);
   connect(this, &Client::jsonReceived, this, &Client::on_jsonReceived,
           Qt::QueuedConnection);
+  connect(this, &Client::opcodeReceived, this, &Client::on_opcodeReceived,
+          Qt::QueuedConnection);
 
   // Connect readyRead() to the slot
   // that will take care of reading the data in
@@ -48,15 +84,31 @@ Client::Client(QObject *parent, QString addr, quint16 port)
 
   profile = new QPixmap();
   profile->load(":/images/anonymous");
+
+  // Open the TLS session in advance, so that the first request doesn't pay
+  // for the handshake
+  QTimer::singleShot(0, this, [this]() -> void {
+    this->m_prewarm = true;
+    connectToServer(QHostAddress(this->addr), this->port);
+  });
 }
 
 void Client::sendByteArray(const QByteArray &byteArray) {
-  SerializeSize size;
-  quint64 json_size = size(byteArray);
+  sendFrame(FRAME_BULK, byteArray);
+}
 
-  QDataStream socketStream(m_clientSocket);
-  socketStream.setVersion(QDataStream::Qt_5_7);
-  socketStream << json_size << byteArray;
+void Client::sendFrame(FrameType type, const QByteArray &payload) {
+  m_prewarm = false;
+  if (m_state == CONNECTING) {
+    // Sent as soon as the handshake completes
+    m_pendingFrames.append(qMakePair(type, payload));
+    return;
+  }
+  // Batched operations must not be overtaken by later messages
+  if (!m_outbox.isEmpty() || m_hasPendingCursor) {
+    flushOutbox();
+  }
+  m_writer.write(m_clientSocket, type, payload);
 }
 
 void Client::login(const QString &username, const QString &password) {
@@ -66,7 +118,29 @@ void Client::login(const QString &username, const QString &password) {
   message["type"] = QStringLiteral("login");
   message["username"] = username;
   message["password"] = password;
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  message["binary_ops"] = OPCODE_VERSION;
+  message["compression"] = COMPRESSION_VERSION;
+  registerRequest(message,
+                  [this](const QJsonObject &reply, const QByteArray &content) {
+                    handleLoginReply(reply, content);
+                  });
+  sendJson(message);
+}
+
+// Images are shown as small avatars: larger ones are scaled down, so that
+// signups fit in the frames the server accepts before login
+static QByteArray encodeProfileImage(const QPixmap &image) {
+  QPixmap scaled = image;
+  if (image.width() > PROFILE_IMAGE_MAX_SIZE ||
+      image.height() > PROFILE_IMAGE_MAX_SIZE)
+    scaled = image.scaled(PROFILE_IMAGE_MAX_SIZE, PROFILE_IMAGE_MAX_SIZE,
+                          Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+  QByteArray bArray;
+  QBuffer buffer(&bArray);
+  buffer.open(QIODevice::WriteOnly);
+  scaled.save(&buffer, "PNG");
+  return bArray;
 }
 
 void Client::signup(const QString &username, const QString &password,
@@ -77,6 +151,10 @@ void Client::signup(const QString &username, const QString &password,
   message["type"] = QStringLiteral("signup");
   message["username"] = username;
   message["password"] = password;
+  registerRequest(message, [this](const QJsonObject &reply,
+                                  const QByteArray &) {
+    handleSignupReply(reply);
+  });
 
   QByteArray obj = QJsonDocument(message).toJson(QJsonDocument::Compact);
   quint32 size_json = obj.size();
@@ -85,10 +163,7 @@ void Client::signup(const QString &username, const QString &password,
 
   // If profile image uploaded by user
   if (image != nullptr) {
-    QByteArray bArray;
-    QBuffer buffer(&bArray);
-    buffer.open(QIODevice::WriteOnly);
-    image->save(&buffer, "PNG");
+    QByteArray bArray = encodeProfileImage(*image);
     quint32 size_img = bArray.size();
 
     QByteArray p((const char *)&size_img, sizeof(size_img));
@@ -111,8 +186,12 @@ void Client::getFiles(bool shared) {
     message["type"] = QStringLiteral("list_files");
   }
   message["username"] = this->username;
+  registerRequest(message, [this](const QJsonObject &reply,
+                                  const QByteArray &) {
+    handleFilesReply(reply);
+  });
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
 void Client::getFilenameFromLink(const QString &sharedLink) {
@@ -120,7 +199,7 @@ void Client::getFilenameFromLink(const QString &sharedLink) {
   message["type"] = QStringLiteral("filename_from_sharedLink");
   message["sharedLink"] = sharedLink;
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
 void Client::updateNickname(const QString &nickname) {
@@ -129,7 +208,7 @@ void Client::updateNickname(const QString &nickname) {
   message["username"] = this->username;
   message["nickname"] = nickname;
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
   this->nickname = nickname;
 }
 
@@ -141,7 +220,7 @@ void Client::updatePassword(const QString &oldpassword,
   message["oldpass"] = oldpassword;
   message["newpass"] = newpassword;
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
 void Client::checkOldPassword(const QString &old_password) {
@@ -149,7 +228,7 @@ void Client::checkOldPassword(const QString &old_password) {
   message["type"] = QStringLiteral("check_old_password");
   message["username"] = this->username;
   message["old_password"] = old_password;
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
 void Client::checkExistingOrNotUsername(const QString &username) {
@@ -158,13 +237,18 @@ void Client::checkExistingOrNotUsername(const QString &username) {
   QJsonObject message;
   message["type"] = QStringLiteral("check_username");
   message["username"] = username;
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  registerRequest(message, [this](const QJsonObject &reply,
+                                  const QByteArray &) {
+    handleUsernameReply(reply);
+  });
+  sendJson(message);
 }
 
 // Attempts to close the socket.
 // If there is pending data waiting to be written, QAbstractSocket will enter
 // ClosingState and wait until all data has been written.
 void Client::disconnectFromHost() {
+  flushOutbox();
   if (this->m_loggedIn == true) {
     this->username.clear();
     this->nickname.clear();
@@ -181,6 +265,8 @@ void Client::disconnectFromHost() {
 
 void Client::on_jsonReceived(const QJsonObject &docObj) {
   //  qDebug() << docObj;
+  if (dispatchReply(docObj, QByteArray()))
+    return;
 
   // Actions depend on the type of message
   const QJsonValue typeVal = docObj.value(QLatin1String("type"));
@@ -189,21 +275,7 @@ void Client::on_jsonReceived(const QJsonObject &docObj) {
 
   if (typeVal.toString().compare(QLatin1String("signup"),
                                  Qt::CaseInsensitive) == 0) {
-    if (m_loggedIn)
-      return; // If we are already logged in we ignore
-
-    const QJsonValue resultVal = docObj.value(QLatin1String("success"));
-    if (resultVal.isNull() || !resultVal.isBool())
-      return;
-    const bool signupSuccess = resultVal.toBool();
-    if (signupSuccess) {
-      emit signedUp();
-      return;
-    }
-    // The signup attempt failed, we extract the reason of the failure
-    // from the JSON and notify it via the signupError signal
-    const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
-    emit signupError(reasonVal.toString());
+    handleSignupReply(docObj);
   } else if (typeVal.toString().compare(QLatin1String("old_password_checked"),
                                         Qt::CaseInsensitive) == 0) {
     const QJsonValue resultVal = docObj.value(QLatin1String("success"));
@@ -217,18 +289,7 @@ void Client::on_jsonReceived(const QJsonObject &docObj) {
       emit correctOldPassword();
   } else if (typeVal.toString().compare(QLatin1String("check_username"),
                                         Qt::CaseInsensitive) == 0) {
-    const QJsonValue resultVal = docObj.value(QLatin1String("success"));
-    if (resultVal.isNull() || !resultVal.isBool())
-      return;
-    const bool usernameCheckSuccess = resultVal.toBool();
-    const QString reason = docObj.value(QLatin1String("reason")).toString();
-    const QJsonValue username = docObj.value(QLatin1String("username"));
-    if (username.isNull() || !username.isString())
-      return;
-    if (!usernameCheckSuccess)
-      emit existingUsername(username.toString());
-    else
-      emit successUsernameCheck(username.toString());
+    handleUsernameReply(docObj);
   } else if (typeVal.toString().compare(QLatin1String("operation"),
                                         Qt::CaseInsensitive) == 0) {
     int operation_type = docObj["operation_type"].toInt();
@@ -252,33 +313,7 @@ void Client::on_jsonReceived(const QJsonObject &docObj) {
     }
   } else if (typeVal.toString().compare(QLatin1String("list_files"),
                                         Qt::CaseInsensitive) == 0) {
-    const QJsonValue resultVal = docObj.value(QLatin1String("success"));
-    if (resultVal.isNull() || !resultVal.isBool())
-      return;
-    const bool getFile = resultVal.toBool();
-
-    if (getFile) {
-      const QJsonValue array = docObj.value(QLatin1String("files"));
-      if (array.isNull() || !array.isArray())
-        return;
-      const QJsonArray array_files = array.toArray();
-
-      this->files.clear();
-      foreach (const QJsonValue &v, array_files) {
-        this->files.push_back(
-            QPair<QString, QString>(v.toObject().value("name").toString(),
-                                    v.toObject().value("owner").toString()));
-      }
-
-      const QJsonValue sharedJson = docObj.value(QLatin1String("shared"));
-      if (sharedJson.isNull() || !sharedJson.isBool())
-        return;
-      const bool shared = sharedJson.toBool();
-      emit filesReceived(shared);
-    } else {
-      const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
-      emit openFilesError(reasonVal.toString());
-    }
+    handleFilesReply(docObj);
   } else if (typeVal.toString().compare(QLatin1String("new_file"),
                                         Qt::CaseInsensitive) == 0) {
     const QJsonValue resultVal = docObj.value(QLatin1String("success"));
@@ -322,6 +357,28 @@ void Client::on_jsonReceived(const QJsonObject &docObj) {
       const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
       emit wrongSharedLink(reasonVal.toString());
     }
+  } else if (typeVal.toString().compare(QLatin1String("file_to_open"),
+                                        Qt::CaseInsensitive) == 0) {
+    handleFileHeader(docObj);
+  } else if (typeVal.toString().compare(QLatin1String("resync"),
+                                        Qt::CaseInsensitive) == 0) {
+    handleResync(docObj);
+  } else if (typeVal.toString().compare(QLatin1String("shared_site"),
+                                        Qt::CaseInsensitive) == 0) {
+    const QJsonValue file = docObj.value(QLatin1String("filename"));
+    const QJsonValue shared = docObj.value(QLatin1String("shared"));
+    if (!file.isString() || !shared.isBool())
+      return;
+    if (!file.toString().compare(this->openfile))
+      m_sharedSite = shared.toBool();
+  } else if (typeVal.toString().compare(QLatin1String("pong"),
+                                        Qt::CaseInsensitive) == 0) {
+    const QJsonValue ts = docObj.value(QLatin1String("ts"));
+    if (!ts.isDouble())
+      return;
+    qint64 sample = m_clock.elapsed() - static_cast<qint64>(ts.toDouble());
+    // Exponentially weighted moving average, as in TCP
+    m_srttMs = m_srttMs == 0 ? sample : (7 * m_srttMs + sample) / 8;
   } else if (typeVal.toString().compare(QLatin1String("password"),
                                         Qt::CaseInsensitive) == 0) {
     const QJsonValue resultVal = docObj.value(QLatin1String("success"));
@@ -338,34 +395,285 @@ void Client::on_jsonReceived(const QJsonObject &docObj) {
   }
 }
 
+// Replies carrying the id of a pending request go to its handler
+bool Client::dispatchReply(const QJsonObject &docObj,
+                           const QByteArray &content) {
+  const QJsonValue id = docObj.value(QLatin1String("req_id"));
+  if (!id.isDouble())
+    return false;
+  ReplyHandler handler = m_requests.take(static_cast<quint32>(id.toDouble()));
+  if (!handler)
+    return false;
+  handler(docObj, content);
+  return true;
+}
+
+// Adds a new id to message: the reply carrying it is passed to handler
+void Client::registerRequest(QJsonObject &message,
+                             const ReplyHandler &handler) {
+  quint32 id = ++m_lastRequestId;
+  message["req_id"] = static_cast<double>(id);
+  m_requests.insert(id, handler);
+}
+
+void Client::handleLoginReply(const QJsonObject &docObj,
+                              const QByteArray &content_image_array) {
+  if (m_loggedIn)
+    return;
+  const QJsonValue resultVal = docObj.value(QLatin1String("success"));
+  if (resultVal.isNull() || !resultVal.isBool())
+    return;
+  const bool loginSuccess = resultVal.toBool();
+  if (loginSuccess) {
+    const QJsonValue user = docObj.value(QLatin1String("username"));
+    if (user.isNull() || !user.isString())
+      return;
+    const QString username = user.toString().simplified();
+    if (username.isEmpty())
+      return;
+
+    const QJsonValue nick = docObj.value(QLatin1String("nickname"));
+    if (nick.isNull() || !nick.isString())
+      return;
+    const QString nickname = nick.toString().simplified();
+    if (nickname.isEmpty())
+      return;
+
+    this->username = username;
+    this->nickname = nickname;
+    this->m_binaryOps =
+        docObj.value(QLatin1String("binary_ops")).toInt() == OPCODE_VERSION;
+    if (docObj.value(QLatin1String("compression")).toInt() ==
+        COMPRESSION_VERSION) {
+      m_writer.enableCompression(&m_compressionStats);
+    }
+    // Servers supporting binary operations also answer pings
+    if (m_binaryOps) {
+      sendPing();
+      m_pingTimer->start(1000 * PING_INTERVAL_SEC);
+    }
+
+    quint32 img_size = qFromLittleEndian<qint32>(
+        reinterpret_cast<const uchar *>(content_image_array.left(4).data()));
+
+    if (img_size != 0) {
+      QByteArray img = content_image_array.mid(4);
+      profile->loadFromData(img);
+    }
+
+    m_loggedIn = true;
+    emit loggedIn();
+    return;
+  }
+  const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
+  emit loginError(reasonVal.toString());
+}
+
+void Client::handleSignupReply(const QJsonObject &docObj) {
+  if (m_loggedIn)
+    return; // If we are already logged in we ignore
+
+  const QJsonValue resultVal = docObj.value(QLatin1String("success"));
+  if (resultVal.isNull() || !resultVal.isBool())
+    return;
+  const bool signupSuccess = resultVal.toBool();
+  if (signupSuccess) {
+    emit signedUp();
+    return;
+  }
+  // The signup attempt failed, we extract the reason of the failure
+  // from the JSON and notify it via the signupError signal
+  const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
+  emit signupError(reasonVal.toString());
+}
+
+void Client::handleUsernameReply(const QJsonObject &docObj) {
+  const QJsonValue resultVal = docObj.value(QLatin1String("success"));
+  if (resultVal.isNull() || !resultVal.isBool())
+    return;
+  const bool usernameCheckSuccess = resultVal.toBool();
+  const QJsonValue username = docObj.value(QLatin1String("username"));
+  if (username.isNull() || !username.isString())
+    return;
+  if (!usernameCheckSuccess)
+    emit existingUsername(username.toString());
+  else
+    emit successUsernameCheck(username.toString());
+}
+
+void Client::handleFilesReply(const QJsonObject &docObj) {
+  const QJsonValue resultVal = docObj.value(QLatin1String("success"));
+  if (resultVal.isNull() || !resultVal.isBool())
+    return;
+  const bool getFile = resultVal.toBool();
+
+  if (getFile) {
+    const QJsonValue array = docObj.value(QLatin1String("files"));
+    if (array.isNull() || !array.isArray())
+      return;
+    const QJsonArray array_files = array.toArray();
+
+    this->files.clear();
+    foreach (const QJsonValue &v, array_files) {
+      this->files.push_back(
+          QPair<QString, QString>(v.toObject().value("name").toString(),
+                                  v.toObject().value("owner").toString()));
+    }
+
+    const QJsonValue sharedJson = docObj.value(QLatin1String("shared"));
+    if (sharedJson.isNull() || !sharedJson.isBool())
+      return;
+    const bool shared = sharedJson.toBool();
+    emit filesReceived(shared);
+  } else {
+    const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
+    emit openFilesError(reasonVal.toString());
+  }
+}
+
+// Header of a file sent in chunks: the editor is shown right away and
+// filled as the symbols arrive
+void Client::handleFileHeader(const QJsonObject &docObj) {
+  const QJsonValue resultVal = docObj.value(QLatin1String("success"));
+  if (resultVal.isNull() || !resultVal.isBool())
+    return;
+  if (!resultVal.toBool()) {
+    this->openfile.clear();
+    const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
+    emit wrongListFiles(reasonVal.toString());
+    return;
+  }
+
+  const QJsonValue name = docObj.value(QLatin1String("filename"));
+  if (name.isNull() || !name.isString())
+    return;
+  this->openfile = name.toString();
+  this->sharedLink = docObj.value(QLatin1String("shared_link")).toString();
+
+  showProgress(docObj.value(QLatin1String("tot_symbols")).toInt());
+  emit correctOpenedFile();
+}
+
+// The server dropped updates that this connection couldn't receive fast
+// enough: the document is emptied and filled again by the chunks that follow
+void Client::handleResync(const QJsonObject &docObj) {
+  if (docObj.value(QLatin1String("filename")).toString() != this->openfile)
+    return;
+
+  m_openTimer.restart();
+  emit resyncStarted();
+  showProgress(docObj.value(QLatin1String("tot_symbols")).toInt());
+}
+
+// The same dialog is shown again for every file opened or resynchronized
+void Client::showProgress(int tot_symbols) {
+  if (progress.isNull()) {
+    progress.reset(new QProgressDialog(nullptr));
+    progress->setWindowTitle("Loading...");
+    progress->setModal(true);
+    progress->setMinimumDuration(0);
+    progress->setWindowFlags(Qt::Window | Qt::WindowTitleHint |
+                             Qt::CustomizeWindowHint);
+    progress->setCancelButton(nullptr);
+  }
+  progress_counter = 0;
+  progress->reset();
+  progress->setRange(0, qMax(tot_symbols - 1, 0));
+  progress->setValue(0);
+}
+
+void Client::handleFileChunk(const QJsonObject &docObj,
+                             const QByteArray &content) {
+  if (docObj.value(QLatin1String("filename")).toString() != this->openfile)
+    return;
+
+  // The rest of the document can't be trusted either: it is closed, and
+  // the chunks still on their way are ignored
+  QVector<Symbol> vec;
+  if (!decodeSymbols(content, vec)) {
+    progress->hide();
+    progress->cancel();
+    emit fileLoadFailed(QStringLiteral("The document received is corrupted"));
+    this->openfile.clear();
+    return;
+  }
+
+  // Add in editor and CRDT the symbols received, in document order
+  for (const Symbol &s : vec) {
+    emit remoteInsert(s);
+    if (s.getValue() == '\n' || s.getValue() == '\0')
+      emit remoteAlignChange(s);
+  }
+  if (progress_counter == 0 && !vec.isEmpty())
+    m_loadStats.firstChunkMsecs += m_openTimer.elapsed();
+  progress_counter += vec.size();
+  progress->setValue(progress_counter);
+
+  if (docObj.value(QLatin1String("last")).toBool()) {
+    m_loadStats.files++;
+    m_loadStats.loadMsecs += m_openTimer.elapsed();
+    progress->hide();
+    progress->cancel();
+    emit fileLoaded();
+  }
+}
+
 void Client::createNewFile(QString filename) {
   QJsonObject message;
   message["type"] = QStringLiteral("new_file");
   message["filename"] = filename;
   message["author"] = this->username;
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
+// Starts the TCP connection and the TLS handshake without blocking: messages
+// sent in the meantime are queued until the socket is encrypted
 void Client::connectToServer(const QHostAddress &address, quint16 port) {
-  if (m_clientSocket->state() != QAbstractSocket::UnconnectedState)
+  if (m_state != DISCONNECTED ||
+      m_clientSocket->state() != QAbstractSocket::UnconnectedState)
     return;
 
-  m_clientSocket->connectToHost(address, port);
-  if (m_clientSocket->waitForConnected()) {
-    // Start handshake
-    m_clientSocket->startClientEncryption();
-  }
+  // Resume the previous TLS session, if the server allows it
+  QSslConfiguration config = m_clientSocket->sslConfiguration();
+  config.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+  if (!m_sessionTicket.isEmpty())
+    config.setSessionTicket(m_sessionTicket);
+  m_clientSocket->setSslConfiguration(config);
+
+  m_state = CONNECTING;
+  m_clientSocket->connectToHostEncrypted(address.toString(), port);
+}
 
-  // Wait up to 1 minute
-  if (!m_clientSocket->waitForEncrypted(60000)) {
-    qDebug("Unable to connect to server");
+void Client::onEncrypted() {
+  m_state = CONNECTED;
+  m_sessionTicket = m_clientSocket->sslConfiguration().sessionTicket();
+
+  writeFramePreamble(m_clientSocket);
+  QVector<QPair<FrameType, QByteArray>> frames;
+  frames.swap(m_pendingFrames);
+  for (const QPair<FrameType, QByteArray> &frame : frames) {
+    m_writer.write(m_clientSocket, frame.first, frame.second);
   }
 }
 
+// A corrupted stream can't be resumed: handled as a lost connection
 void Client::onReadyRead() {
-  onReadyRead_helper(m_clientSocket, m_received_data, m_exptected_json_size,
-                     m_buffer, *this);
+  if (!m_reader.read(m_clientSocket, *this) &&
+      m_clientSocket->state() == QAbstractSocket::ConnectedState) {
+    qDebug() << m_reader.errorString();
+    dropConnection(m_reader.isIncompatible());
+  }
+}
+
+void Client::dropConnection(bool incompatible) {
+  m_clientSocket->abort();
+  if (m_prewarm)
+    return;
+  if (incompatible)
+    emit incompatibleServer();
+  else
+    emit error(QAbstractSocket::RemoteHostClosedError);
 }
 
 void Client::on_byteArrayReceived(const QByteArray &doc) {
@@ -379,12 +687,17 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
   if (parseError.error == QJsonParseError::NoError) {
     if (jsonDoc.isObject()) {
       QJsonObject docObj = jsonDoc.object();
+      if (dispatchReply(docObj, content_image_array))
+        return;
       const QJsonValue typeVal = docObj.value(QLatin1String("type"));
       if (typeVal.isNull() || !typeVal.isString())
         return;
 
-      if (typeVal.toString().compare(QLatin1String("file_to_open"),
+      if (typeVal.toString().compare(QLatin1String("file_chunk"),
                                      Qt::CaseInsensitive) == 0) {
+        handleFileChunk(docObj, content_image_array);
+      } else if (typeVal.toString().compare(QLatin1String("file_to_open"),
+                                            Qt::CaseInsensitive) == 0) {
         const QJsonValue resultVal = docObj.value(QLatin1String("success"));
         if (resultVal.isNull() || !resultVal.isBool())
           return;
@@ -397,34 +710,30 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
             return;
           int tot_symbols = tot_symbolsVal.toInt();
 
-          progress = new QProgressDialog(nullptr);
-          progress_counter = 0;
-          progress->setWindowTitle("Loading...");
-          progress->setRange(0, tot_symbols - 1);
-          progress->setModal(true);
-          progress->setValue(0);
-          progress->setMinimumDuration(0);
-          progress->setWindowFlags(Qt::Window | Qt::WindowTitleHint |
-                                   Qt::CustomizeWindowHint);
-          progress->setCancelButton(nullptr);
+          showProgress(tot_symbols);
 
           quint32 content_size =
               qFromLittleEndian<qint32>(reinterpret_cast<const uchar *>(
                   content_image_array.left(4).data()));
 
+          // Closed as a corrupted chunk would be, on the server too
           QVector<Symbol> vec;
-          if (content_size != 0) {
-            QByteArray content = content_image_array.mid(4, content_size);
-            QDataStream out(&content, QIODevice::ReadOnly);
-            out >> vec;
-          } else {
-            throw std::runtime_error("Empty content received.");
+          if (content_size == 0 ||
+              !decodeSymbols(content_image_array.mid(4, content_size), vec)) {
+            progress->hide();
+            progress->cancel();
+            this->openfile =
+                docObj.value(QLatin1String("filename")).toString();
+            emit fileLoadFailed(
+                QStringLiteral("The document received is corrupted"));
+            this->openfile.clear();
+            return;
           }
           content_image_array = content_image_array.mid(content_size + 4);
 
           // Add in editor and CRDT all the symbols received from server
           for (int i = vec.size() - 1; i >= 0; i--) {
-            Symbol s = vec[i];
+            const Symbol &s = vec.at(i);
             emit remoteInsert(s);
             if (s.getValue() == '\n' || s.getValue() == '\0')
               emit remoteAlignChange(s);
@@ -432,6 +741,10 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
             progress_counter++;
             progress->setValue(progress_counter);
           }
+          // Shown all at once
+          m_loadStats.files++;
+          m_loadStats.firstChunkMsecs += m_openTimer.elapsed();
+          m_loadStats.loadMsecs += m_openTimer.elapsed();
 
           progress->hide();
           progress->cancel();
@@ -481,6 +794,7 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
 
           emit usersConnectedReceived(connected);
           emit correctOpenedFile();
+          emit fileLoaded();
         } else {
           this->openfile.clear();
           const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
@@ -524,45 +838,7 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
 
       } else if (typeVal.toString().compare(QLatin1String("login"),
                                             Qt::CaseInsensitive) == 0) {
-        if (m_loggedIn)
-          return;
-        const QJsonValue resultVal = docObj.value(QLatin1String("success"));
-        if (resultVal.isNull() || !resultVal.isBool())
-          return;
-        const bool loginSuccess = resultVal.toBool();
-        if (loginSuccess) {
-          const QJsonValue user = docObj.value(QLatin1String("username"));
-          if (user.isNull() || !user.isString())
-            return;
-          const QString username = user.toString().simplified();
-          if (username.isEmpty())
-            return;
-
-          const QJsonValue nick = docObj.value(QLatin1String("nickname"));
-          if (nick.isNull() || !nick.isString())
-            return;
-          const QString nickname = nick.toString().simplified();
-          if (nickname.isEmpty())
-            return;
-
-          this->username = username;
-          this->nickname = nickname;
-
-          quint32 img_size =
-              qFromLittleEndian<qint32>(reinterpret_cast<const uchar *>(
-                  content_image_array.left(4).data()));
-
-          if (img_size != 0) {
-            QByteArray img = content_image_array.mid(4);
-            profile->loadFromData(img);
-          }
-
-          m_loggedIn = true;
-          emit loggedIn();
-          return;
-        }
-        const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
-        emit loginError(reasonVal.toString());
+        handleLoginReply(docObj, content_image_array);
 
         // Operation (insertion, deletion, modification) received
       } else if (typeVal.toString().compare(QLatin1String("operation"),
@@ -580,25 +856,18 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
 
           return;
 
-        const QJsonValue tot_symbolsVal =
-            docObj.value(QLatin1String("tot_symbols"));
-        if (tot_symbolsVal.isNull()) {
+        if (docObj.value(QLatin1String("tot_symbols")).isNull()) {
           return;
         }
-        int tot_symbols = tot_symbolsVal.toInt();
-
-        quint32 content_size =
-            qFromLittleEndian<qint32>(reinterpret_cast<const uchar *>(
-                content_image_array.left(4).data()));
-
-        // Retrieve symbols
-        QVector<Symbol> vec(tot_symbols);
-        if (content_size != 0) {
-          QByteArray content = content_image_array.mid(4, content_size);
-          QDataStream out(&content, QIODevice::ReadOnly);
-          out >> vec;
-        } else {
-          throw std::runtime_error("Empty content received.");
+
+        // Retrieve symbols: they take the rest of the frame. The document
+        // can't be kept in sync without them
+        QVector<Symbol> vec;
+        if (content_image_array.isEmpty() ||
+            !decodeSymbols(content_image_array, vec)) {
+          qDebug() << "Malformed operation received";
+          dropConnection(false);
+          return;
         }
 
         if (operation_type == PASTE)
@@ -610,7 +879,8 @@ void Client::on_byteArrayReceived(const QByteArray &doc) {
       }
     }
   } else {
-    throw std::runtime_error("Invalid json received.");
+    qDebug() << "Malformed message received";
+    dropConnection(false);
   }
 }
 
@@ -632,10 +902,7 @@ void Client::sendProfileImage() {
   QByteArray ba((const char *)&size_json, sizeof(size_json));
   ba.append(obj);
 
-  QByteArray bArray;
-  QBuffer buffer(&bArray);
-  buffer.open(QIODevice::WriteOnly);
-  profile->save(&buffer, "PNG");
+  QByteArray bArray = encodeProfileImage(*profile);
   quint32 size_img = bArray.size();
 
   QByteArray p((const char *)&size_img, sizeof(size_img));
@@ -652,15 +919,181 @@ void Client::overrideProfileImage(const QPixmap &pixmap) {
 QList<QPair<QString, QString>> Client::getActiveFiles() { return files; }
 
 void Client::sendJson(const QJsonObject &message) {
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendFrame(FRAME_JSON, QJsonDocument(message).toJson(QJsonDocument::Compact));
+}
+
+void Client::sendOperation(const Operation &op) {
+  if (m_binaryOps) {
+    if (op.type == CURSOR) {
+      m_pendingCursor = op;
+      m_hasPendingCursor = true;
+    } else {
+      m_outbox.append(op);
+    }
+
+    if (m_outbox.size() >= m_maxOutboxBytes) {
+      flushOutbox();
+    } else if (!m_flushTimer->isActive()) {
+      // The first operation after an idle period is sent right away
+      qint64 elapsed = m_lastFlush.isValid() ? m_lastFlush.elapsed() : -1;
+      if (elapsed < 0 || elapsed >= flushWindow()) {
+        flushOutbox();
+      } else {
+        m_flushTimer->start(static_cast<int>(flushWindow() - elapsed));
+      }
+    }
+    return;
+  }
+
+  // Servers without binary operations expect JSON for single-symbol
+  // operations and a JSON header followed by the symbols for bulk ones
+  QJsonObject message;
+  message["type"] = QStringLiteral("operation");
+  message["editorId"] = op.editorId;
+  message["operation_type"] = op.type;
+  if (Operation::isBulk(op.type)) {
+    message["tot_symbols"] = op.symbols.size();
+    sendByteArray(createByteArrayFileContent(message, op.symbols));
+  } else {
+    Symbol s = op.symbols.first();
+    message["symbol"] = s.toJson();
+    sendJson(message);
+  }
+}
+
+// Sends all the batched operations in a single frame, the last cursor move
+// after the edits it may refer to
+void Client::flushOutbox() {
+  m_flushTimer->stop();
+  if (m_hasPendingCursor) {
+    m_outbox.append(m_pendingCursor);
+    m_hasPendingCursor = false;
+  }
+  if (m_outbox.isEmpty())
+    return;
+
+  int ops = m_outbox.operations();
+  m_writer.write(m_clientSocket, FRAME_OPCODE, m_outbox.data());
+  m_outbox.clear();
+  m_lastFlush.start();
+
+  int bucket = 0;
+  while ((ops >> (bucket + 1)) != 0 && bucket < OUTBOX_HISTOGRAM_BUCKETS - 1)
+    bucket++;
+  m_outboxStats.frames++;
+  m_outboxStats.ops += ops;
+  m_outboxStats.histogram[bucket]++;
+}
+
+// Evicts the formats no symbol uses any more: only called once the document
+// is emptied, since the client's symbols hold no reference to theirs
+void Client::collectFormats() {
+  for (quint32 id : FormatTable::instance().collect())
+    m_sentFormats.remove(id);
+}
+
+void Client::setOutboxLimits(int minWindowMs, int maxWindowMs, int maxBytes) {
+  m_minWindowMs = minWindowMs;
+  m_maxWindowMs = qMax(minWindowMs, maxWindowMs);
+  m_maxOutboxBytes = maxBytes;
+}
+
+const OutboxStats &Client::getOutboxStats() { return m_outboxStats; }
+
+const LoadStats &Client::getLoadStats() { return m_loadStats; }
+
+// A quarter of the round-trip time: batching stays well below the latency
+// the network adds anyway
+int Client::flushWindow() {
+  return static_cast<int>(qBound<qint64>(m_minWindowMs, m_srttMs / 4,
+                                         m_maxWindowMs));
+}
+
+void Client::logStats() {
+  const OutboxStats &st = m_outboxStats;
+  if (st.frames != 0) {
+    QDebug dbg = qDebug().nospace();
+    dbg << "outbox: " << st.ops << " ops in " << st.frames << " frames ("
+        << double(st.ops) / st.frames << " ops/frame), histogram";
+    for (int i = 0; i < OUTBOX_HISTOGRAM_BUCKETS; i++) {
+      dbg << " " << st.histogram[i];
+    }
+  }
+
+  const CompressionStats &cs = m_compressionStats;
+  qint64 frames = cs.frames.load();
+  if (frames != 0) {
+    qDebug().nospace() << "compression: " << frames << " frames, ratio "
+                       << double(cs.bytesIn.load()) / cs.bytesOut.load()
+                       << ", " << cs.deflateNsecs.load() / frames
+                       << " ns/frame";
+  }
+
+  const LoadStats &ls = m_loadStats;
+  if (ls.files != 0) {
+    qDebug().nospace() << "file load: " << ls.files
+                       << " files, first chunk shown after "
+                       << ls.firstChunkMsecs / qint64(ls.files)
+                       << " ms, complete after "
+                       << ls.loadMsecs / qint64(ls.files) << " ms";
+  }
+}
+
+void Client::sendPing() {
+  QJsonObject message;
+  message["type"] = QStringLiteral("ping");
+  message["ts"] = static_cast<double>(m_clock.elapsed());
+  sendJson(message);
+}
+
+void Client::on_opcodeReceived(const QByteArray &ops) {
+  // A frame is applied only once all of it is read, none of it if corrupted
+  OpReader reader(ops, &m_receivedFormats);
+  QVector<Operation> received;
+  Operation next;
+  while (reader.next(next))
+    received.append(next);
+  if (reader.hasError()) {
+    qDebug() << "Malformed operation frame";
+    dropConnection(false);
+    return;
+  }
+
+  for (const Operation &op : received) {
+    if (op.byId) {
+      if (op.type == CURSOR) {
+        emit remoteCursorId(op.editorId, op.ids.first());
+      } else if (op.type == CHANGE) {
+        emit remoteChangeIds(op.ids, op.symbols);
+      } else if (op.type == DELETE_SYMBOL) {
+        emit remoteEraseIds(op.ids);
+      }
+    } else if (op.type == DELETE_RANGE) {
+      emit remoteEraseRange(op.symbols.first(), op.symbols.last(), op.ids);
+    } else if (op.type == INSERT_SYMBOL) {
+      emit remoteInsert(op.symbols.first());
+    } else if (op.type == ALIGN) {
+      emit remoteAlignChange(op.symbols.first());
+    } else if (op.type == CURSOR) {
+      emit remoteCursor(op.editorId, op.symbols.first());
+    } else if (op.type == PASTE) {
+      emit remotePaste(op.symbols);
+    } else if (op.type == CHANGE) {
+      emit remoteChange(op.symbols);
+    } else if (op.type == DELETE_SYMBOL) {
+      emit remoteErase(op.symbols);
+    }
+  }
 }
 
 void Client::openFile(const QString &filename) {
   QJsonObject message;
   message["type"] = QStringLiteral("file_to_open");
   message["filename"] = filename;
+  message["chunked"] = true;
+  m_openTimer.start();
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
 void Client::closeFile() {
@@ -669,8 +1102,9 @@ void Client::closeFile() {
   message["filename"] = this->openfile;
   message["username"] = this->username;
   message["nickname"] = this->nickname;
+  m_sharedSite = false;
 
-  sendByteArray(QJsonDocument(message).toJson(QJsonDocument::Compact));
+  sendJson(message);
 }
 
 QString Client::getSharedLink() { return this->sharedLink; }
@@ -679,21 +1113,11 @@ QString Client::getOpenedFile() { return this->openfile; }
 
 void Client::setOpenedFile(const QString &name) { this->openfile = name; }
 
-QByteArray Client::createByteArrayFileContent(QJsonObject message,
-                                              QVector<Symbol> c) {
-  QByteArray byte_array_msg = QJsonDocument(message).toJson();
-  quint32 size_json = byte_array_msg.size();
-
+QByteArray Client::createByteArrayFileContent(const QJsonObject &message,
+                                              const QVector<Symbol> &c) {
   QByteArray byte_array_content;
   QDataStream in(&byte_array_content, QIODevice::WriteOnly);
   in << c;
-  quint32 size_content = byte_array_content.size();
-
-  QByteArray ba((const char *)&size_json, sizeof(size_json));
-  ba.append(byte_array_msg);
-  QByteArray ba_c((const char *)&size_content, sizeof(size_content));
-  ba_c.append(byte_array_content);
-  ba.append(ba_c);
 
-  return ba;
+  return createBulkPayload(message, byte_array_content);
 }
@@ -2,17 +2,60 @@
 #define CLIENT_H
 
 #include "../Utility/byte_reader.h"
-#include "../Utility/serializesize.h"
+#include "../Utility/frame.h"
+#include "../Utility/opcodes.h"
 #include "../Utility/symbol.h"
 #include "remotecursor.h"
 #include <QBuffer>
+#include <QElapsedTimer>
+#include <QJsonObject>
 #include <QObject>
 #include <QProgressDialog>
+#include <QScopedPointer>
 #include <QSslSocket>
 #include <QTcpSocket>
+#include <functional>
 
 class QHostAddress;
 class QJsonDocument;
+class QTimer;
+
+typedef enum {
+  DISCONNECTED,
+  CONNECTING, // TCP connection or TLS handshake in progress
+  CONNECTED
+} ConnectionState;
+
+// Handler of the reply to a request: content is the binary data that follows
+// the JSON header, if any
+typedef std::function<void(const QJsonObject &reply, const QByteArray &content)>
+    ReplyHandler;
+
+// Local operations are batched in a single frame for at most a flush window,
+// which follows the measured round-trip time within these bounds
+#define OUTBOX_MIN_WINDOW_MS 5
+#define OUTBOX_MAX_WINDOW_MS 40
+// Batches reaching this size are flushed immediately
+#define OUTBOX_MAX_BYTES (8 * 1024)
+#define PING_INTERVAL_SEC 5
+// Operations per frame: 1, 2-3, 4-7, 8-15, 16-31, 32+
+#define OUTBOX_HISTOGRAM_BUCKETS 6
+// Profile images are sent at most this wide and high
+#define PROFILE_IMAGE_MAX_SIZE 256
+
+struct OutboxStats {
+  quint64 frames = 0;
+  quint64 ops = 0;
+  quint64 histogram[OUTBOX_HISTOGRAM_BUCKETS] = {};
+};
+
+// Time from asking for a file to its first and last symbols shown, summed
+// over the files loaded
+struct LoadStats {
+  quint64 files = 0;
+  qint64 firstChunkMsecs = 0;
+  qint64 loadMsecs = 0;
+};
 
 class Client : public QObject, ByteReader {
   Q_OBJECT
@@ -31,12 +74,21 @@ public:
   void getFiles(bool shared);
   void getFilenameFromLink(const QString &sharedLink);
   QList<QPair<QString, QString>> getActiveFiles();
+  bool getBinaryOps() const { return m_binaryOps; }
+  bool hasSharedSite() const { return m_sharedSite; }
   void sendJson(const QJsonObject &message);
-  QByteArray createByteArrayFileContent(QJsonObject message,
-                                        QVector<Symbol> vector);
+  void sendOperation(const Operation &op);
+  void flushOutbox();
+  void collectFormats();
+  void setOutboxLimits(int minWindowMs, int maxWindowMs, int maxBytes);
+  const OutboxStats &getOutboxStats();
+  const LoadStats &getLoadStats();
+  QByteArray createByteArrayFileContent(const QJsonObject &message,
+                                        const QVector<Symbol> &vector);
   void createNewFile(QString filename);
   void closeFile();
   void sendByteArray(const QByteArray &byteArray);
+  void sendFrame(FrameType type, const QByteArray &payload);
   QString getSharedLink();
   QString getOpenedFile();
   void setOpenedFile(const QString &name);
@@ -58,6 +110,9 @@ private slots:
   void onReadyRead();
   void on_byteArrayReceived(const QByteArray &doc);
   void on_jsonReceived(const QJsonObject &doc);
+  void on_opcodeReceived(const QByteArray &ops);
+  void sendPing();
+  void onEncrypted();
 
 signals:
   void connected();
@@ -67,6 +122,8 @@ signals:
   void loginError(const QString &reason);
   void disconnected();
   void error(QAbstractSocket::SocketError socketError);
+  // The server speaks another version of the protocol
+  void incompatibleServer();
 
   void wrongOldPassword(const QString &reason);
   void correctOldPassword();
@@ -76,13 +133,25 @@ signals:
   void filesReceived(bool shared);
   void openFilesError(const QString &reason);
 
-  void remoteInsert(Symbol s);
-  void remotePaste(QVector<Symbol> s);
-  void remoteErase(QVector<Symbol> s);
-  void remoteChange(QVector<Symbol> s);
-  void remoteAlignChange(Symbol s);
+  void remoteInsert(const Symbol &s);
+  void remotePaste(const QVector<Symbol> &s);
+  void remoteErase(const QVector<Symbol> &s);
+  void remoteChange(const QVector<Symbol> &s);
+  void remoteAlignChange(const Symbol &s);
+  // Operations referencing the symbols by OpId, formats only for changes
+  void remoteEraseIds(const QVector<OpId> &ids);
+  void remoteChangeIds(const QVector<OpId> &ids,
+                       const QVector<Symbol> &formats);
+  // Symbols from first to last, those in seen only (see isKnownOpId)
+  void remoteEraseRange(const Symbol &first, const Symbol &last,
+                        const QVector<OpId> &seen);
   void correctNewFile();
   void correctOpenedFile();
+  void fileLoaded();
+  // The open file couldn't be loaded: the editor has to close it
+  void fileLoadFailed(const QString &reason);
+  // The open file is sent again from scratch: the document must be emptied
+  void resyncStarted();
   void wrongNewFile(const QString &reason);
   void wrongListFiles(const QString &reason);
   void usersConnectedReceived(QList<QPair<QPair<QString, QString>, QPixmap>>);
@@ -90,12 +159,14 @@ signals:
   void userDisconnected(const QString &username, const QString &nickname);
   void wrongSharedLink(const QString &filename);
   void addCRDTterminator();
-  void remoteCursor(int editor_id, Symbol s);
+  void remoteCursor(int editor_id, const Symbol &s);
+  void remoteCursorId(int editor_id, OpId id);
   void existingUsername(const QString &username);
   void successUsernameCheck(const QString &username);
 
   void byteArrayReceived(const QByteArray &doc);
   void jsonReceived(const QJsonObject &doc);
+  void opcodeReceived(const QByteArray &ops);
 
   void openedFile();
 
@@ -104,17 +175,62 @@ private:
   quint16 port;
   QSslSocket *m_clientSocket;
   bool m_loggedIn;
+  ConnectionState m_state = DISCONNECTED;
+  bool m_prewarm = false; // Connection opened at startup, not used yet
+  QByteArray m_sessionTicket;
+  QVector<QPair<FrameType, QByteArray>> m_pendingFrames;
+  // Requests waiting for a reply, by id
+  QHash<quint32, ReplyHandler> m_requests;
+  quint32 m_lastRequestId = 0;
+  bool m_binaryOps = false;
+  // Another session of the user edits the open file, with the same site
+  bool m_sharedSite = false;
+  // Formats defined on the connection, in each direction
+  QSet<quint32> m_sentFormats;
+  QHash<quint32, SymbolFormat> m_receivedFormats;
+  // Operations not sent yet: only the last cursor move is kept
+  OpWriter m_outbox;
+  Operation m_pendingCursor;
+  bool m_hasPendingCursor = false;
+  QTimer *m_flushTimer;
+  QElapsedTimer m_lastFlush;
+  int m_minWindowMs = OUTBOX_MIN_WINDOW_MS;
+  int m_maxWindowMs = OUTBOX_MAX_WINDOW_MS;
+  int m_maxOutboxBytes = OUTBOX_MAX_BYTES;
+  OutboxStats m_outboxStats;
+  LoadStats m_loadStats;
+  QElapsedTimer m_openTimer; // Time to load the file being opened
+  CompressionStats m_compressionStats;
+  // Smoothed round-trip time, measured with ping messages
+  QTimer *m_pingTimer;
+  QElapsedTimer m_clock;
+  qint64 m_srttMs = 0;
   QString username;
   QString nickname;
   QPixmap *profile;
   QList<QPair<QString, QString>> files;
   QString openfile;
   QString sharedLink;
-  quint64 m_exptected_json_size = 0;
-  QByteArray m_received_data;
-  QBuffer m_buffer;
-  QProgressDialog *progress;
+  FrameReader m_reader;
+  FrameWriter m_writer;
+  QScopedPointer<QProgressDialog> progress;
   int progress_counter = 0;
+
+  int flushWindow();
+  // Aborts a connection whose stream can't be resumed
+  void dropConnection(bool incompatible);
+  void logStats();
+  void registerRequest(QJsonObject &message, const ReplyHandler &handler);
+  bool dispatchReply(const QJsonObject &docObj, const QByteArray &content);
+  void handleLoginReply(const QJsonObject &docObj,
+                        const QByteArray &content_image_array);
+  void handleSignupReply(const QJsonObject &docObj);
+  void handleUsernameReply(const QJsonObject &docObj);
+  void handleFilesReply(const QJsonObject &docObj);
+  void handleFileHeader(const QJsonObject &docObj);
+  void handleResync(const QJsonObject &docObj);
+  void showProgress(int tot_symbols);
+  void handleFileChunk(const QJsonObject &docObj, const QByteArray &content);
 };
 
 #endif // CLIENT_H
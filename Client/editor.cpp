@@ -67,9 +67,11 @@ Editor::Editor(QWidget *parent, Client *client)
   connect(client, &Client::userDisconnected, this, &Editor::removeUser);
   connect(client, &Client::addCRDTterminator, this,
           &Editor::on_addCRDTterminator);
-  connect(client, &Client::correctOpenedFile, this,
-          &Editor::clearUndoRedoStack);
+  connect(client, &Client::fileLoaded, this, &Editor::clearUndoRedoStack);
+  connect(client, &Client::resyncStarted, this, &Editor::on_resync);
+  connect(client, &Client::fileLoadFailed, this, &Editor::on_fileLoadFailed);
   connect(client, &Client::remoteCursor, this, &Editor::on_remoteCursor);
+  connect(client, &Client::remoteCursorId, this, &Editor::on_remoteCursorId);
   connect(client, &Client::loggedIn, this, [this] {
     int site_id = fromStringToIntegerHash(this->client->getUsername());
     this->crdt->setId(site_id);
@@ -725,12 +727,10 @@ void Editor::on_insertGroup(int line, int index, const QString &s,
 void Editor::on_erase(int line, int index, int lenght) {
   QTextCursor cursor = ui->textEdit->textCursor();
   QTextBlock block = ui->textEdit->document()->findBlockByNumber(line);
+  // A single selection, the end of each block counting as one character
   cursor.setPosition(block.position() + index);
-
-  for (int i = 0; i < lenght; i++) {
-    cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
-  }
-
+  cursor.setPosition(block.position() + index + lenght,
+                     QTextCursor::KeepAnchor);
   cursor.removeSelectedText();
 }
 
@@ -741,10 +741,12 @@ void Editor::on_change(const QVector<Symbol> &symbols) {
   QTextCharFormat newFormat;
   QTextBlock block;
 
-  for (Symbol s : symbols) {
+  for (const Symbol &s : symbols) {
     int line, index;
 
-    this->crdt->findPosition(s, line, index);
+    // Positions compared only for ids held by more than one symbol
+    if (!this->crdt->getPositionFromId(s.opId(), line, index))
+      this->crdt->findPosition(s, line, index);
     block = ui->textEdit->document()->findBlockByNumber(line);
 
     if (first) {
@@ -809,6 +811,8 @@ void Editor::clear(bool serverDisconnected) {
   disconnect(ui->textEdit->document(), &QTextDocument::contentsChange, this,
              &Editor::on_contentsChange);
   disconnect(client, &Client::remoteCursor, this, &Editor::on_remoteCursor);
+  disconnect(client, &Client::remoteCursorId, this,
+             &Editor::on_remoteCursorId);
   disconnect(ui->textEdit, &QTextEdit::cursorPositionChanged, this,
              &Editor::saveCursorPosition);
 
@@ -826,6 +830,7 @@ void Editor::clear(bool serverDisconnected) {
   connect(ui->textEdit->document(), &QTextDocument::contentsChange, this,
           &Editor::on_contentsChange);
   connect(client, &Client::remoteCursor, this, &Editor::on_remoteCursor);
+  connect(client, &Client::remoteCursorId, this, &Editor::on_remoteCursorId);
   connect(ui->textEdit, &QTextEdit::cursorPositionChanged, this,
           &Editor::saveCursorPosition);
 
@@ -833,6 +838,30 @@ void Editor::clear(bool serverDisconnected) {
   ui->textEdit->remote_cursors.clear();
 }
 
+// Empty the document, keeping the users and the site id, before the server
+// sends it again
+void Editor::on_resync() {
+  int site_id = crdt->getSiteID();
+  disconnect(ui->textEdit->document(), &QTextDocument::contentsChange, this,
+             &Editor::on_contentsChange);
+  disconnect(ui->textEdit, &QTextEdit::cursorPositionChanged, this,
+             &Editor::saveCursorPosition);
+
+  crdt->clear();
+  crdt->setId(site_id);
+  ui->textEdit->clear();
+
+  connect(ui->textEdit->document(), &QTextDocument::contentsChange, this,
+          &Editor::on_contentsChange);
+  connect(ui->textEdit, &QTextEdit::cursorPositionChanged, this,
+          &Editor::saveCursorPosition);
+}
+
+void Editor::on_fileLoadFailed(const QString &reason) {
+  QMessageBox::critical(this, tr("Error"), reason, QMessageBox::Close);
+  exit();
+}
+
 void Editor::removeUser(const QString &username, const QString &nickname) {
   QList<QListWidgetItem *> items =
       this->ui->listWidget->findItems(nickname, Qt::MatchFixedString);
@@ -1034,10 +1063,27 @@ void Editor::on_addCRDTterminator() {
   this->crdt->localInsert(0, 0, '\0', font, color, Qt::AlignLeft);
 }
 
-void Editor::on_remoteCursor(int editor_id, Symbol s) {
+void Editor::on_remoteCursor(int editor_id, const Symbol &s) {
+  // Own cursor, echoed together with the other ones
+  if (editor_id == crdt->getSiteID())
+    return;
+
+  // The symbol may have been deleted in the meantime
   int line, index;
-  crdt->getPositionFromSymbol(s, line, index);
+  if (crdt->getPositionFromSymbol(s, line, index))
+    moveRemoteCursor(editor_id, line, index);
+}
+
+void Editor::on_remoteCursorId(int editor_id, OpId id) {
+  if (editor_id == crdt->getSiteID())
+    return;
+
+  int line, index;
+  if (crdt->getPositionFromId(id, line, index))
+    moveRemoteCursor(editor_id, line, index);
+}
 
+void Editor::moveRemoteCursor(int editor_id, int line, int index) {
   QTextBlock block = ui->textEdit->document()->findBlockByNumber(line);
   if (!ui->textEdit->remote_cursors.contains(editor_id)) {
     // Add new cursor
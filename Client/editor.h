@@ -65,7 +65,10 @@ private slots:
   void textSize(const QString &p);
   void moveCursorToEnd();
   void on_addCRDTterminator();
-  void on_remoteCursor(int editor_id, Symbol s);
+  void on_remoteCursor(int editor_id, const Symbol &s);
+  void on_remoteCursorId(int editor_id, OpId id);
+  void on_resync();
+  void on_fileLoadFailed(const QString &reason);
   bool checkAlignment(int position);
 
 private:
@@ -97,6 +100,7 @@ private:
   void on_showAssigned();
   void closeEvent(QCloseEvent *event);
   void handleLocalInsertion(int position, int num_chars);
+  void moveRemoteCursor(int editor_id, int line, int index);
 };
 
 #endif // EDITOR_H
@@ -26,7 +26,7 @@ void Highlighter::highlightBlock(const QString &text) {
 
   for (int index = 0; index < text.length(); index++) {
     // Retrieve symbol at line, index;
-    Symbol s = this->crdt->getSymbol(line, index);
+    const Symbol &s = this->crdt->getSymbol(line, index);
     int editor_id = s.getUsername();
     QTextCharFormat format = s.getQTextCharFormat();
 
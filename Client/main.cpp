@@ -1,3 +1,5 @@
+#define ALLOC_COUNTER_IMPLEMENTATION
+#include "../Utility/alloc_counter.h"
 #include "appMainWindow.h"
 #include "client.h"
 #include <QApplication>
@@ -68,8 +68,15 @@ DEPENDPATH += $$PWD/../3rdparty/libsodium/1.0.18/include
 
 INCLUDEPATH += $$PWD/../3rdparty
 
+# zlib for frame compression: bundled with Qt on Windows
+win32: QT += zlib-private
+else: LIBS += -lz
+
 RESOURCES += \
     server.qrc
 
 LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH
 
+# Count the heap allocations of the editing paths, reporting the operations
+# over budget (see Utility/alloc_counter.h)
+#DEFINES += ALLOC_COUNTER
@@ -1,4 +1,5 @@
 #include "mongo.h"
+#include "../Utility/symbol_codec.h"
 #include <QDataStream>
 #include <QDebug>
 #include <QRandomGenerator>
@@ -573,7 +574,7 @@ bool Mongo::insertNewFile(const QString &filename) {
   return true;
 }
 
-bool Mongo::saveFile(const QString filename, QByteArray symbols) {
+bool Mongo::saveFile(const QString &filename, const QByteArray &symbols) {
   bool found;
   auto oid = getObjectID(filename, found);
   if (!found)
@@ -584,8 +585,8 @@ bool Mongo::saveFile(const QString filename, QByteArray symbols) {
   // Change chunk size, default 255 kB
   //	opts.chunk_size_bytes(50);
 
-  char *raw = symbols.data();
-  auto data = (uint8_t *)raw;
+  const char *raw = symbols.constData();
+  auto data = (const uint8_t *)raw;
   size_t len = symbols.size();
   auto up = bucket.open_upload_stream(filename.toStdString(), opts);
   up.write(data, len);
@@ -594,7 +595,7 @@ bool Mongo::saveFile(const QString filename, QByteArray symbols) {
   return true;
 }
 
-bool Mongo::retrieveFile(const QString filename, QVector<Symbol> &symbols) {
+bool Mongo::retrieveFile(const QString &filename, QVector<Symbol> &symbols) {
   bool found;
   auto oid = getObjectID(filename, found);
   if (!found)
@@ -606,11 +607,8 @@ bool Mongo::retrieveFile(const QString filename, QVector<Symbol> &symbols) {
   downloadStream.read(buffer, size);
   QByteArray bArray((const char *)buffer, size);
 
-  // Convert from QByteArray to QVector
-  // (to reverse the saving process, in which QVector is stored as binary)
-  QDataStream in(qUncompress(bArray));
-  in >> symbols;
-  return true;
+  // Decode the symbols, also from files saved with QDataStream
+  return decodeSymbols(qUncompress(bArray), symbols);
 }
 
 void Mongo::cleanBucket() {
@@ -34,8 +34,8 @@ public:
   bool checkConnection();
 
   bool insertNewFile(const QString &filename);
-  bool saveFile(const QString filename, QByteArray symbols);
-  bool retrieveFile(const QString filename, QVector<Symbol> &symbols);
+  bool saveFile(const QString &filename, const QByteArray &symbols);
+  bool retrieveFile(const QString &filename, QVector<Symbol> &symbols);
   void cleanBucket();
 
   void upsertImage(QString email, const QByteArray &image);
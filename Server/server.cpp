@@ -1,6 +1,8 @@
 #include "server.h"
+#include "../Utility/alloc_counter.h"
 #include "serverworker.h"
 #include <QDir>
+#include <QElapsedTimer>
 #include <QImage>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -11,6 +13,7 @@
 #include <QTimer>
 #include <QVector>
 #include <QtEndian>
+#include <algorithm>
 #include <functional>
 
 Server::Server(QObject *parent)
@@ -40,6 +43,21 @@ Server::Server(QObject *parent)
   QTimer *timer = new QTimer(this);
   connect(timer, &QTimer::timeout, this, &Server::saveFile);
   timer->start(1000 * SAVE_INTERVAL_SEC);
+
+  // Timer to periodically log the protocol statistics
+  QTimer *statsTimer = new QTimer(this);
+  connect(statsTimer, &QTimer::timeout, this, &Server::logStats);
+  statsTimer->start(1000 * STATS_INTERVAL_SEC);
+
+  // Timer to periodically evict the formats no document uses
+  QTimer *formatsTimer = new QTimer(this);
+  connect(formatsTimer, &QTimer::timeout, this, &Server::collectFormats);
+  formatsTimer->start(1000 * FORMATS_INTERVAL_SEC);
+
+  // Timer to send the cursor positions collected since the last tick
+  QTimer *presenceTimer = new QTimer(this);
+  connect(presenceTimer, &QTimer::timeout, this, &Server::flushPresence);
+  presenceTimer->start(PRESENCE_TICK_MSEC);
 }
 
 Server::~Server() {
@@ -53,6 +71,9 @@ Server::~Server() {
 // This gets executed every time a client attempts a connection with the server
 void Server::incomingConnection(qintptr socketDescriptor) {
   ServerWorker *worker = new ServerWorker;
+  worker->setCompressionStats(&m_compressionStats);
+  worker->setFrameStats(&m_frameStats);
+  worker->setWatermarks(m_lowWatermark, m_highWatermark, m_resyncLimit);
   // Sets the socket descriptor this server should use when listening
   // for incoming connections to socketDescriptor.
   // Returns true if the socket is set successfully; otherwise returns false.
@@ -89,8 +110,13 @@ void Server::incomingConnection(qintptr socketDescriptor) {
   connect(worker, &ServerWorker::byteArrayReceived, this,
           std::bind(&Server::handle_signup_updateImage_bulkOperation, this,
                     worker, std::placeholders::_1));
+  connect(
+      worker, &ServerWorker::opcodeReceived, this,
+      std::bind(&Server::opcodeReceived, this, worker, std::placeholders::_1));
   connect(this, &Server::stopAllClients, worker,
           &ServerWorker::disconnectFromClient);
+  connect(worker, &ServerWorker::resyncReady, this,
+          std::bind(&Server::resyncClient, this, worker));
 
   m_clients.append(worker);
 }
@@ -152,36 +178,71 @@ QByteArray Server::createByteArrayFileContentImage(QJsonObject &message,
   return ba;
 }
 
+// Replies are sent only to the sender of the request being handled
+void Server::tagReply(QJsonObject &message) {
+  if (!m_requestId.isUndefined())
+    message["req_id"] = m_requestId;
+}
+
 void Server::sendJson(ServerWorker *destination, const QJsonObject &message) {
-  Q_ASSERT(destination);
-  QTimer::singleShot(0, destination,
-                     std::bind(&ServerWorker::sendJson, destination, message));
+  QJsonObject reply = message;
+  tagReply(reply);
+  sendFrame(destination, FRAME_JSON,
+            QJsonDocument(reply).toJson(QJsonDocument::Compact));
 }
 
-void Server::sendByteArray(ServerWorker *destination,
-                           const QByteArray &toSend) {
+void Server::sendByteArray(ServerWorker *destination, const QByteArray &toSend,
+                           OutboundKind kind) {
+  sendFrame(destination, FRAME_BULK, toSend, kind);
+}
+
+void Server::sendFrame(ServerWorker *destination, FrameType type,
+                       const QByteArray &payload, OutboundKind kind) {
   Q_ASSERT(destination);
-  QTimer::singleShot(
-      0, destination,
-      std::bind(&ServerWorker::sendByteArray, destination, toSend));
+  destination->enqueueFrame(type, payload, kind);
 }
 
 bool Server::tryConnectionToMongo() { return db.checkConnection(); }
 
+// Limits of the outbound queues of the connections accepted from now on
+void Server::setOutboundLimits(qint64 low, qint64 high, qint64 resyncLimit) {
+  m_lowWatermark = low;
+  m_highWatermark = high;
+  m_resyncLimit = resyncLimit;
+}
+
 void Server::broadcast(const QJsonObject &message, ServerWorker *exclude) {
-  QString filename = exclude->getFilename();
-  QList<ServerWorker *> *active_clients = mapFileWorkers->value(filename);
+  QElapsedTimer timer;
+  timer.start();
+  QByteArray payload = QJsonDocument(message).toJson(QJsonDocument::Compact);
+  fanOut(exclude, FRAME_JSON, payload, timer.nsecsElapsed());
+}
+
+// Queue the same payload, encoded only once, on every other editor of the
+// file: workers receive a shared reference, not a copy
+void Server::fanOut(ServerWorker *exclude, FrameType type,
+                    const QByteArray &payload, qint64 encodeNsecs) {
+  QElapsedTimer timer;
+  timer.start();
+  QList<ServerWorker *> *active_clients =
+      mapFileWorkers->value(exclude->getFilename());
+  if (active_clients == nullptr)
+    return;
+
   for (ServerWorker *worker : *active_clients) {
     Q_ASSERT(worker);
     if (worker == exclude)
       continue;
-    sendJson(worker, message);
+    sendFrame(worker, type, payload);
+    m_broadcastStats.recipients++;
   }
+  m_broadcastStats.broadcasts++;
+  m_broadcastStats.encodeNsecs += encodeNsecs;
+  m_broadcastStats.fanoutNsecs += timer.nsecsElapsed();
 }
 
-void Server::broadcastByteArray(const QJsonObject &message,
-                                const QByteArray &bArray,
-                                ServerWorker *exclude) {
+QByteArray Server::createByteArrayJsonContent(const QJsonObject &message,
+                                              const QByteArray &content) {
   QByteArray byte_array = QJsonDocument(message).toJson();
   quint32 size_json = byte_array.size();
 
@@ -189,29 +250,558 @@ void Server::broadcastByteArray(const QJsonObject &message,
   QByteArray ba((const char *)&size_json, sizeof(size_json));
   ba.append(byte_array);
 
-  if (bArray.size() != 0) {
-    quint32 size_img = bArray.size();
+  if (content.size() != 0) {
+    quint32 size_img = content.size();
     QByteArray p((const char *)&size_img, sizeof(size_img));
-    p.append(bArray);
+    p.append(content);
     ba.append(p);
   } else {
     quint32 size_img = 0;
     QByteArray p((const char *)&size_img, sizeof(size_img));
     ba.append(p);
   }
+  return ba;
+}
 
-  QString filename = exclude->getFilename();
-  QList<ServerWorker *> *active_clients = mapFileWorkers->value(filename);
+void Server::broadcastByteArray(const QJsonObject &message,
+                                const QByteArray &bArray,
+                                ServerWorker *exclude) {
+  QElapsedTimer timer;
+  timer.start();
+  QByteArray ba = createByteArrayJsonContent(message, bArray);
+  fanOut(exclude, FRAME_BULK, ba, timer.nsecsElapsed());
+}
+
+// Encode the operations at most once per encoding: binary, in a single frame,
+// for the editors that negotiated it at login, one JSON message per operation
+// for the others. The binary payload carries no format definitions, which are
+// sent before it only to the connections that don't know them yet
+void Server::broadcastOperations(const QVector<Operation> &ops,
+                                 ServerWorker *exclude) {
+  QList<ServerWorker *> *active_clients =
+      mapFileWorkers->value(exclude->getFilename());
+  if (active_clients == nullptr || ops.isEmpty())
+    return;
+  // Encodings and stats, then the queue entries of each recipient
+  ALLOC_BUDGET("Server::broadcastOperations", 8 + 2 * active_clients->size());
+
+  bool anyBinary = false, anyLegacy = false;
+  for (ServerWorker *worker : *active_clients) {
+    if (worker == exclude)
+      continue;
+    if (worker->getBinaryOps())
+      anyBinary = true;
+    else
+      anyLegacy = true;
+  }
+  if (!anyBinary && !anyLegacy)
+    return;
+
+  QElapsedTimer timer;
+  timer.start();
+  QByteArray binary;
+  QVector<QByteArray> legacy;
+  QHash<quint32, SymbolFormat> formats;
+  if (anyBinary) {
+    OpWriter writer(nullptr);
+    for (const Operation &op : ops) {
+      writer.append(op);
+      formats.unite(op.formats());
+    }
+    binary = writer.data();
+    m_binaryStats.sent++;
+    m_binaryStats.sentBytes += binary.size();
+    m_binaryStats.encodeNsecs += timer.nsecsElapsed();
+  }
+  if (anyLegacy) {
+    qint64 start = timer.nsecsElapsed();
+    legacy.reserve(ops.size());
+    for (const Operation &op : ops) {
+      legacy.append(legacyEncoding(op));
+      m_jsonStats.sentBytes += legacy.last().size();
+    }
+    m_jsonStats.sent += legacy.size();
+    m_jsonStats.encodeNsecs += timer.nsecsElapsed() - start;
+  }
+  m_broadcastStats.encodeNsecs += timer.nsecsElapsed();
+
+  timer.restart();
   for (ServerWorker *worker : *active_clients) {
     Q_ASSERT(worker);
     if (worker == exclude)
       continue;
-    sendByteArray(worker, ba);
+
+    if (worker->getBinaryOps()) {
+      OpWriter definitions(&worker->sentFormats());
+      for (auto it = formats.cbegin(); it != formats.cend(); ++it) {
+        definitions.define(it.key(), it.value());
+      }
+      if (!definitions.isEmpty()) {
+        sendFrame(worker, FRAME_OPCODE, definitions.data(), OUTBOUND_EDIT);
+      }
+      sendFrame(worker, FRAME_OPCODE, binary, OUTBOUND_EDIT);
+    } else {
+      for (int i = 0; i < legacy.size(); i++) {
+        sendFrame(worker, legacyFrameType(ops.at(i)), legacy.at(i),
+                  OUTBOUND_EDIT);
+      }
+    }
+    m_broadcastStats.recipients++;
+  }
+  m_broadcastStats.broadcasts++;
+  m_broadcastStats.fanoutNsecs += timer.nsecsElapsed();
+}
+
+// Cursor positions don't change the document: only the latest one of each
+// editor is kept and sent at the next tick, after all the edits
+void Server::updatePresence(ServerWorker *sender, const Operation &op) {
+  if (op.symbols.size() != 1)
+    return;
+  // Kept across events: it must not hold a format that could be evicted
+  Operation cursor = op;
+  cursor.symbols[0].setFormatId(0);
+  m_presence[sender->getFilename()].insert(op.editorId,
+                                           PendingCursor{sender, cursor});
+  m_presenceStats.updates++;
+}
+
+// Send the pending cursors of each file to its editors: a single frame,
+// encoded once, to the ones using binary operations (which ignore their own
+// cursor), one JSON message per cursor of the other editors to the others.
+// Congested connections get only the latest cursors once they have drained
+void Server::flushPresence() {
+  if (m_presence.isEmpty() && m_deferredCursors.isEmpty())
+    return;
+
+  for (auto it = m_presence.cbegin(); it != m_presence.cend(); ++it) {
+    QList<ServerWorker *> *active_clients = mapFileWorkers->value(it.key());
+    if (active_clients == nullptr)
+      continue;
+
+    const QHash<int, PendingCursor> &cursors = it.value();
+    QByteArray binary;
+    QHash<int, QByteArray> legacy;
+    for (ServerWorker *worker : *active_clients) {
+      Q_ASSERT(worker);
+      bool others = false;
+      for (const PendingCursor &cursor : cursors) {
+        if (cursor.sender != worker) {
+          others = true;
+          break;
+        }
+      }
+      if (!others)
+        continue;
+
+      if (m_deferredCursors.contains(worker) || worker->isCongested()) {
+        deferCursors(worker, cursors);
+      } else if (worker->getBinaryOps()) {
+        if (binary.isNull()) {
+          OpWriter writer(nullptr);
+          for (const PendingCursor &cursor : cursors) {
+            writer.append(cursor.op);
+          }
+          binary = writer.data();
+        }
+        sendFrame(worker, FRAME_OPCODE, binary, OUTBOUND_CURSOR);
+        m_presenceStats.flushed += cursors.size();
+      } else {
+        for (auto c = cursors.cbegin(); c != cursors.cend(); ++c) {
+          if (c.value().sender == worker)
+            continue;
+          if (!legacy.contains(c.key())) {
+            legacy.insert(c.key(), legacyEncoding(c.value().op));
+          }
+          sendFrame(worker, FRAME_JSON, legacy.value(c.key()),
+                    OUTBOUND_CURSOR);
+          m_presenceStats.flushed++;
+        }
+      }
+    }
+  }
+  m_presence.clear();
+  m_presenceStats.ticks++;
+
+  for (auto it = m_deferredCursors.begin(); it != m_deferredCursors.end();) {
+    if (it.key()->isCongested()) {
+      ++it;
+      continue;
+    }
+    if (!it.value().isEmpty())
+      sendCursors(it.key(), it.value());
+    it = m_deferredCursors.erase(it);
+  }
+}
+
+// Keep only the latest cursor of each other editor for destination
+void Server::deferCursors(ServerWorker *destination,
+                          const QHash<int, PendingCursor> &cursors) {
+  QHash<int, PendingCursor> &deferred = m_deferredCursors[destination];
+  for (auto c = cursors.cbegin(); c != cursors.cend(); ++c) {
+    if (c.value().sender == destination)
+      continue;
+    if (deferred.contains(c.key()))
+      m_presenceStats.coalesced++;
+    deferred.insert(c.key(), c.value());
+  }
+}
+
+void Server::sendCursors(ServerWorker *destination,
+                         const QHash<int, PendingCursor> &cursors) {
+  if (destination->getBinaryOps()) {
+    OpWriter writer(nullptr);
+    for (const PendingCursor &cursor : cursors) {
+      writer.append(cursor.op);
+    }
+    sendFrame(destination, FRAME_OPCODE, writer.data(), OUTBOUND_CURSOR);
+  } else {
+    for (const PendingCursor &cursor : cursors) {
+      sendFrame(destination, FRAME_JSON, legacyEncoding(cursor.op),
+                OUTBOUND_CURSOR);
+    }
+  }
+  m_presenceStats.flushed += cursors.size();
+}
+
+// The connection dropped the updates it couldn't send and has now drained:
+// the client receives the whole document again, in chunks, followed by the
+// updates applied from now on. Clients that don't know the resync message
+// are disconnected instead
+void Server::resyncClient(ServerWorker *worker) {
+  if (!m_clients.contains(worker))
+    return;
+  worker->endResync();
+  m_deferredCursors.remove(worker);
+
+  QString filename = worker->getFilename();
+  SymbolStore *symbols = symbols_list.value(filename);
+  if (symbols == nullptr)
+    return; // File closed in the meantime
+
+  if (!worker->getBinaryOps()) {
+    m_slowDisconnects++;
+    QMetaObject::invokeMethod(worker, "disconnectFromClient",
+                              Qt::QueuedConnection);
+    return;
+  }
+
+  // Format definitions may have been dropped too
+  worker->sentFormats().clear();
+  m_requestId = QJsonValue(QJsonValue::Undefined);
+  QJsonObject message;
+  message["type"] = QStringLiteral("resync");
+  message["filename"] = filename;
+  message["tot_symbols"] = symbols->size();
+  sendJson(worker, message);
+  sendFileChunks(worker, filename, symbols->toVector());
+}
+
+// Operation as sent by clients that don't support binary operations
+QByteArray Server::legacyEncoding(const Operation &op) {
+  QJsonObject message;
+  message["type"] = QStringLiteral("operation");
+  message["editorId"] = op.editorId;
+  message["operation_type"] = op.type;
+
+  if (!Operation::isBulk(op.type)) {
+    Symbol s = op.symbols.first();
+    message["symbol"] = s.toJson();
+    return QJsonDocument(message).toJson(QJsonDocument::Compact);
+  }
+
+  message["tot_symbols"] = op.symbols.size();
+  QByteArray content;
+  QDataStream in(&content, QIODevice::WriteOnly);
+  in << op.symbols;
+  return createBulkPayload(message, content);
+}
+
+// Type of the frames carrying legacyEncoding(op)
+FrameType Server::legacyFrameType(const Operation &op) {
+  return Operation::isBulk(op.type) ? FRAME_BULK : FRAME_JSON;
+}
+
+// Update symbols in server memory
+void Server::applyOperation(ServerWorker *sender, const Operation &op) {
+  SymbolStore *symbols = symbols_list.value(sender->getFilename());
+  if (symbols == nullptr || op.type == CURSOR)
+    return;
+
+  if (op.type == DELETE_RANGE) {
+    symbols->removeRange(op.symbols.first().getPositionRef(),
+                         op.symbols.last().getPositionRef(), op.ids, nullptr);
+    changed.insert(sender->getFilename(), true);
+    return;
+  }
+  for (const Symbol &s : op.symbols) {
+    if (op.type == DELETE_SYMBOL) {
+      symbols->remove(s.getPositionRef());
+    } else {
+      symbols->insert(s);
+    }
+  }
+  changed.insert(sender->getFilename(), true);
+}
+
+// Apply a DELETE_RANGE turning it into the DELETE_SYMBOL of the symbols
+// actually removed, for files also open in editors using JSON
+void Server::applyRangeExpanded(ServerWorker *sender, Operation &op) {
+  SymbolStore *symbols = symbols_list.value(sender->getFilename());
+  QVector<Symbol> removed;
+  symbols->removeRange(op.symbols.first().getPositionRef(),
+                       op.symbols.last().getPositionRef(), op.ids, &removed);
+  op = Operation(DELETE_SYMBOL, op.editorId, std::move(removed));
+  changed.insert(sender->getFilename(), true);
+}
+
+bool Server::hasLegacyEditors(const QString &filename) {
+  QList<ServerWorker *> *active_clients = mapFileWorkers->value(filename);
+  if (active_clients == nullptr)
+    return false;
+  for (ServerWorker *worker : *active_clients) {
+    if (!worker->getBinaryOps())
+      return true;
+  }
+  return false;
+}
+
+// Whether another session of the sender's user edits its file: both use the
+// same site, so a range sent by one may hold symbols of that site the other
+// inserted concurrently. Its ranges are expanded, for every editor to remove
+// the same symbols, until the editor knows to send no more (see
+// notifySharedSite)
+bool Server::hasSharedSite(ServerWorker *sender) {
+  QList<ServerWorker *> *active_clients =
+      mapFileWorkers->value(sender->getFilename());
+  if (active_clients == nullptr)
+    return false;
+  for (ServerWorker *worker : *active_clients) {
+    if (worker != sender && worker->getUsername() == sender->getUsername())
+      return true;
+  }
+  return false;
+}
+
+// Tell the sessions of a user on a file whether there are several of them,
+// in which case they delete ranges symbol by symbol
+void Server::notifySharedSite(const QString &filename,
+                              const QString &username) {
+  QList<ServerWorker *> *active_clients = mapFileWorkers->value(filename);
+  if (active_clients == nullptr)
+    return;
+  QList<ServerWorker *> sessions;
+  for (ServerWorker *worker : *active_clients) {
+    if (worker->getUsername() == username)
+      sessions.append(worker);
+  }
+  QJsonObject message;
+  message["type"] = QStringLiteral("shared_site");
+  message["filename"] = filename;
+  message["shared"] = sessions.size() > 1;
+  for (ServerWorker *worker : sessions) {
+    if (worker->getBinaryOps())
+      this->sendJson(worker, message);
+  }
+}
+
+// Replace the symbols referenced by OpId with the stored ones, the format
+// excepted for changes. Ids not found are dropped: the symbol was deleted
+// in the meantime. An id held by more than one symbol, by another session
+// on the same site the sender didn't know of yet, can't be applied as the
+// sender did: the operation is rejected and the sender is sent the
+// document again. The operation is relayed by id, the ids left being
+// unique here too, and with full symbols to the legacy clients
+bool Server::resolveIds(ServerWorker *sender, Operation &op) {
+  SymbolStore *symbols = symbols_list.value(sender->getFilename());
+  QVector<Symbol> resolved;
+  resolved.reserve(op.ids.size());
+  for (int n = 0; n < op.ids.size(); n++) {
+    Symbol s;
+    if (!symbols->findById(op.ids.at(n), s)) {
+      if (op.type != CURSOR && symbols->isAmbiguous(op.ids.at(n))) {
+        m_opIdStats.rejected++;
+        QMetaObject::invokeMethod(sender, "startResync",
+                                  Qt::QueuedConnection);
+        return false;
+      }
+      m_opIdStats.dropped++;
+      continue;
+    }
+    if (op.type == CHANGE)
+      s.setFormatId(op.symbols.at(n).getFormatId());
+    resolved.append(s);
+  }
+  m_opIdStats.resolved += resolved.size();
+  op.symbols.swap(resolved);
+  op.ids.clear();
+  return !op.symbols.isEmpty();
+}
+
+void Server::opcodeReceived(ServerWorker *sender, const QByteArray &ops) {
+  m_requestId = QJsonValue(QJsonValue::Undefined);
+  if (sender->getNickname().isEmpty() ||
+      !symbols_list.contains(sender->getFilename()))
+    return;
+
+  collectFormatsOverThreshold();
+  // Operations batched by the client are relayed in a single frame
+  QElapsedTimer timer;
+  timer.start();
+  OpReader reader(ops, &sender->receivedFormats());
+  QVector<Operation> frame;
+  Operation next;
+  while (reader.next(next))
+    frame.append(next);
+  // As a corrupted stream, none of the frame is applied
+  if (reader.hasError()) {
+    qDebug() << "Malformed operation frame, disconnecting"
+             << sender->getUsername();
+    QMetaObject::invokeMethod(sender, "disconnectFromClient",
+                              Qt::QueuedConnection);
+    return;
+  }
+
+  QVector<Operation> received;
+  for (Operation &op : frame) {
+    if (op.byId && !resolveIds(sender, op))
+      continue;
+    if (op.type == CURSOR) {
+      updatePresence(sender, op);
+      continue;
+    }
+    if (op.type == DELETE_RANGE &&
+        (hasLegacyEditors(sender->getFilename()) || hasSharedSite(sender)))
+      applyRangeExpanded(sender, op);
+    else
+      applyOperation(sender, op);
+    received.append(op);
+  }
+  m_binaryStats.received += received.size();
+  m_binaryStats.handleNsecs += timer.nsecsElapsed();
+
+  broadcastOperations(received, sender);
+}
+
+// Evict the formats no open document uses. Between two events no symbol
+// outside the documents refers to them, and the clients are sent the
+// definition again if one is used later under the same id
+void Server::collectFormats() {
+  QVector<quint32> evicted = FormatTable::instance().collect();
+  if (!evicted.isEmpty()) {
+    for (ServerWorker *worker : m_clients) {
+      for (quint32 id : evicted)
+        worker->sentFormats().remove(id);
+    }
+  }
+  m_evictedFormats += evicted.size();
+}
+
+// Before reading formats sent by a client: once the table is full, frames
+// defining new ones are rejected
+void Server::collectFormatsOverThreshold() {
+  if (FormatTable::instance().size() > FORMATS_COLLECT_THRESHOLD)
+    collectFormats();
+}
+
+void Server::logStats() {
+  const EncodingStats *stats[] = {&m_jsonStats, &m_binaryStats};
+  const char *names[] = {"json", "binary"};
+  for (int i = 0; i < 2; i++) {
+    const EncodingStats &st = *stats[i];
+    if (st.received == 0 && st.sent == 0)
+      continue;
+    qDebug().nospace()
+        << names[i] << ": received " << st.received << " ops ("
+        << (st.received ? st.handleNsecs / qint64(st.received) : 0)
+        << " ns/op), sent " << st.sent << " messages ("
+        << (st.sent ? st.sentBytes / st.sent : 0) << " bytes/msg, "
+        << (st.sent ? st.encodeNsecs / qint64(st.sent) : 0) << " ns/msg)";
+  }
+
+  const OpIdStats &is = m_opIdStats;
+  if (is.resolved != 0 || is.dropped != 0 || is.rejected != 0) {
+    qDebug().nospace() << "op ids: " << is.resolved << " symbols resolved, "
+                       << is.dropped << " dropped, " << is.rejected
+                       << " operations rejected";
+  }
+
+  const PresenceStats &ps = m_presenceStats;
+  if (ps.updates != 0) {
+    qDebug().nospace() << "presence: " << ps.updates
+                       << " cursor updates received, " << ps.flushed
+                       << " sent in " << ps.ticks << " ticks, "
+                       << ps.coalesced << " coalesced for slow connections";
+  }
+
+  for (ServerWorker *worker : m_clients) {
+    OutboundStats os = worker->outboundStats();
+    if (os.peakBytes < OUTBOUND_LOW_WATERMARK && os.dropped == 0)
+      continue;
+    qDebug().nospace() << "outbound " << worker->getUsername() << ": "
+                       << os.queuedFrames << " frames (" << os.queuedBytes
+                       << " bytes) queued, " << os.socketBytes
+                       << " bytes in the socket, peak " << os.peakBytes
+                       << " bytes, " << os.dropped << " dropped, "
+                       << os.resyncs << " resyncs";
+  }
+
+  if (m_slowDisconnects != 0) {
+    qDebug().nospace() << "outbound: " << m_slowDisconnects
+                       << " clients without resync disconnected";
+  }
+
+  const FrameStats &fs = m_frameStats;
+  if (fs.unparsedBytes.load() != 0) {
+    qDebug().nospace() << "frames: " << fs.unparsedBytes.load()
+                       << " binary bytes dispatched without parsing";
+  }
+
+  const CompressionStats &cs = m_compressionStats;
+  qint64 frames = cs.frames.load(), inflated = cs.inflated.load();
+  if (frames != 0) {
+    qDebug().nospace() << "compression: " << frames << " frames, "
+                       << cs.bytesIn.load() << " -> " << cs.bytesOut.load()
+                       << " bytes (ratio "
+                       << double(cs.bytesIn.load()) / cs.bytesOut.load()
+                       << ", " << cs.deflateNsecs.load() / frames
+                       << " ns/frame)";
+  }
+  if (inflated != 0) {
+    qDebug().nospace() << "decompression: " << inflated << " frames ("
+                       << cs.inflateNsecs.load() / inflated << " ns/frame)";
+  }
+
+  qDebug().nospace() << "formats: " << FormatTable::instance().size()
+                     << " interned, " << m_evictedFormats << " evicted";
+
+  if (!symbols_list.isEmpty()) {
+    qint64 symbols = 0, bytes = 0;
+    int shared = 0;
+    for (const SymbolStore *store : symbols_list) {
+      symbols += store->size();
+      bytes += store->memoryUsage();
+      if (store->sharedPrefixes())
+        shared++;
+    }
+    qDebug().nospace() << "documents: " << symbols_list.size() << " open ("
+                       << shared << " with shared prefixes), "
+                       << symbols << " symbols in " << bytes << " bytes ("
+                       << (symbols ? bytes / symbols : 0) << " bytes/symbol)";
+  }
+
+  const BroadcastStats &bs = m_broadcastStats;
+  if (bs.broadcasts != 0) {
+    qint64 n = bs.broadcasts;
+    qDebug().nospace() << "broadcast: " << bs.broadcasts << " messages to "
+                       << bs.recipients << " recipients (encode "
+                       << bs.encodeNsecs / n << " ns/msg, fan-out "
+                       << bs.fanoutNsecs / n << " ns/msg)";
   }
 }
 
 void Server::jsonReceived(ServerWorker *sender, const QJsonObject &json) {
   //  qDebug() << json;
+  m_requestId = json.value(QLatin1String("req_id"));
   if (sender->getNickname().isEmpty()) {
     return jsonFromLoggedOut(sender, json);
   } else {
@@ -223,6 +813,7 @@ void Server::jsonReceived(ServerWorker *sender, const QJsonObject &json) {
 void Server::userDisconnected(ServerWorker *sender, int threadIdx) {
   --m_threadsLoad[threadIdx];
   m_clients.removeAll(sender);
+  m_deferredCursors.remove(sender);
 
   if (!sender->getFilename().isNull() && !sender->getFilename().isEmpty())
     udpateSymbolListAndCommunicateDisconnection(sender->getFilename(), sender);
@@ -250,6 +841,7 @@ void Server::jsonFromLoggedOut(ServerWorker *sender,
       if (found)
         tmp.push_back(image);
     }
+    tagReply(message);
     this->sendByteArray(sender, createByteArrayJsonImage(message, tmp));
 
     // Used to check uniqueness of username during signup
@@ -297,6 +889,7 @@ QJsonObject Server::checkAlreadyExistingUsername(const QJsonObject &doc) {
 void Server::handle_signup_updateImage_bulkOperation(
     ServerWorker *sender, const QByteArray &json_data) {
   QJsonObject message;
+  m_requestId = QJsonValue(QJsonValue::Undefined);
   quint32 size = qFromLittleEndian<qint32>(
       reinterpret_cast<const uchar *>(json_data.left(4).data()));
   QByteArray json = json_data.mid(4, size);
@@ -310,6 +903,7 @@ void Server::handle_signup_updateImage_bulkOperation(
   if (parseError.error == QJsonParseError::NoError && jsonDoc.isObject()) {
     // Actions depend on the type of message
     QJsonObject docObj = jsonDoc.object();
+    m_requestId = docObj.value(QLatin1String("req_id"));
     const QJsonValue typeVal = docObj.value(QLatin1String("type"));
     if (typeVal.isNull() || !typeVal.isString()) {
       message["success"] = false;
@@ -406,37 +1000,28 @@ void Server::handle_signup_updateImage_bulkOperation(
       if (operation_type == PASTE || operation_type == CHANGE ||
           operation_type == DELETE_SYMBOL) {
 
-        QByteArray content_array = json_data.mid(4 + size, -1);
-        quint32 content_size = qFromLittleEndian<qint32>(
-            reinterpret_cast<const uchar *>(content_array.left(4).data()));
+        // Symbols take the rest of the frame
+        QByteArray content = json_data.mid(4 + size, -1);
+        collectFormatsOverThreshold();
 
         QVector<Symbol> vec;
-        QByteArray content;
-        if (content_size != 0) {
-          content = content_array.mid(4, content_size);
-          QDataStream out(&content, QIODevice::ReadOnly);
-          out >> vec;
-        } else {
-          throw std::runtime_error("Vector shouldn't be empty.");
+        if (content.isEmpty() || !decodeSymbols(content, vec) ||
+            vec.isEmpty()) {
+          message["success"] = false;
+          message["reason"] = QStringLiteral("Wrong format");
+          this->sendJson(sender, message);
+          return;
         }
 
-        // comment only to change commit
-        if (operation_type == DELETE_SYMBOL) {
-          // Remove symbols from memory
-          for (Symbol s : vec) {
-            QString position = s.positionString();
-            symbols_list.value(sender->getFilename())->remove(position);
-          }
-        } else {
-          // Save inserted/modified symbols in memory
-          for (Symbol s : vec) {
-            QString position = s.positionString();
-            symbols_list.value(sender->getFilename())->insert(position, s);
-          }
-        }
+        QElapsedTimer timer;
+        timer.start();
+        Operation op(static_cast<OperationType>(operation_type),
+                     docObj["editorId"].toInt(), vec);
+        applyOperation(sender, op);
+        m_jsonStats.received++;
+        m_jsonStats.handleNsecs += timer.nsecsElapsed();
 
-        changed.insert(sender->getFilename(), true);
-        broadcastByteArray(docObj, content, sender);
+        broadcastOperations(QVector<Operation>{op}, sender);
       } else {
         message["success"] = false;
         message["reason"] = QStringLiteral("Wrong format");
@@ -500,6 +1085,19 @@ QJsonObject Server::checkCredentials(ServerWorker *sender,
     message["nickname"] = nickname;
     sender->setUsername(username);
     sender->setNickname(nickname);
+    sender->acceptLargeFrames();
+
+    // Binary operations are used only if the client supports them
+    if (doc.value(QLatin1String("binary_ops")).toInt() == OPCODE_VERSION) {
+      message["binary_ops"] = OPCODE_VERSION;
+      sender->setBinaryOps(true);
+    }
+    // Large frames are compressed only if the client can decompress them
+    if (doc.value(QLatin1String("compression")).toInt() ==
+        COMPRESSION_VERSION) {
+      message["compression"] = COMPRESSION_VERSION;
+      sender->enableCompression();
+    }
     return message;
   } else if (r == NON_EXISTING_USER) {
     message["success"] = false;
@@ -547,24 +1145,27 @@ void Server::jsonFromLoggedIn(ServerWorker *sender, const QJsonObject &docObj) {
   } else if (typeVal.toString().compare(QLatin1String("operation"),
                                         Qt::CaseInsensitive) == 0) {
     int operation_type = docObj["operation_type"].toInt();
+    if (operation_type != INSERT_SYMBOL && operation_type != ALIGN &&
+        operation_type != CURSOR)
+      return;
 
     // Update symbols in server memory
     // and broadcast operation to other editors
-    if (operation_type == INSERT_SYMBOL) {
-      QJsonObject symbol = docObj["symbol"].toObject();
-      Symbol s = Symbol::fromJson(symbol);
-      QString position = s.positionString();
-      symbols_list.value(sender->getFilename())->insert(position, s);
-    } else if (operation_type == ALIGN) {
-      QJsonObject symbol = docObj["symbol"].toObject();
-      Symbol s = Symbol::fromJson(symbol);
-      QString position = s.positionString();
-      symbols_list.value(sender->getFilename())
-          ->insert(position, Symbol::fromJson(symbol));
+    QElapsedTimer timer;
+    timer.start();
+    QVector<Symbol> symbols;
+    symbols.append(Symbol::fromJson(docObj["symbol"].toObject()));
+    Operation op(static_cast<OperationType>(operation_type),
+                 docObj["editorId"].toInt(), symbols);
+    m_jsonStats.received++;
+    if (op.type == CURSOR) {
+      updatePresence(sender, op);
+      return;
     }
+    applyOperation(sender, op);
+    m_jsonStats.handleNsecs += timer.nsecsElapsed();
 
-    changed.insert(sender->getFilename(), true);
-    broadcast(docObj, sender);
+    broadcastOperations(QVector<Operation>{op}, sender);
   } else if (typeVal.toString().compare(QLatin1String("new_file"),
                                         Qt::CaseInsensitive) == 0) {
     QJsonObject message = this->createNewFile(docObj, sender);
@@ -584,6 +1185,13 @@ void Server::jsonFromLoggedIn(ServerWorker *sender, const QJsonObject &docObj) {
     QJsonObject message =
         this->getFilenameFromSharedLink(docObj, sender->getUsername());
     this->sendJson(sender, message);
+  } else if (typeVal.toString().compare(QLatin1String("ping"),
+                                        Qt::CaseInsensitive) == 0) {
+    // Echo the timestamp so that the client can measure the round-trip time
+    QJsonObject message;
+    message["type"] = QStringLiteral("pong");
+    message["ts"] = docObj.value(QLatin1String("ts"));
+    this->sendJson(sender, message);
   }
 }
 
@@ -889,7 +1497,7 @@ QJsonObject Server::createNewFile(const QJsonObject &doc,
   mapFileWorkers->insert(filename + "," + username, list);
 
   if (!symbols_list.contains(sender->getFilename())) {
-    symbols_list.insert(sender->getFilename(), new QMap<QString, Symbol>());
+    symbols_list.insert(sender->getFilename(), new SymbolStore());
     changed.insert(sender->getFilename(), true);
   }
 
@@ -898,16 +1506,40 @@ QJsonObject Server::createNewFile(const QJsonObject &doc,
   return message;
 }
 
-void Server::storeSymbolsServerMemory(QString filename, QVector<Symbol> array) {
+void Server::storeSymbolsServerMemory(const QString &filename,
+                                      const QVector<Symbol> &array) {
   if (!symbols_list.contains(filename)) {
-    symbols_list.insert(filename, new QMap<QString, Symbol>());
-  }
-
-  // Store symbols in server memory
-  foreach (const Symbol &symbol, array) {
-    Symbol s = symbol;
-    QString position = s.positionString();
-    symbols_list.value(filename)->insert(position, s);
+    // Deeply nested documents share the common prefixes of their positions
+    qint64 levels = 0;
+    for (const Symbol &s : array) {
+      levels += s.getPositionRef().size();
+    }
+    bool shared = !array.isEmpty() &&
+                  levels >= SHARED_PREFIXES_MIN_DEPTH * qint64(array.size());
+    symbols_list.insert(filename, new SymbolStore(shared));
+  }
+
+  // Store symbols in server memory: sorted by key, each one is appended
+  // after the previous one (the last one wins if a position is repeated)
+  QVector<QPair<QByteArray, int>> keys;
+  keys.reserve(array.size());
+  for (int i = 0; i < array.size(); i++) {
+    keys.append(qMakePair(array.at(i).positionKey(), i));
+  }
+  if (!std::is_sorted(keys.cbegin(), keys.cend()))
+    std::sort(keys.begin(), keys.end());
+
+  SymbolStore *symbols = symbols_list.value(filename);
+  if (symbols->isEmpty()) {
+    for (int i = 0; i < keys.size(); i++) {
+      if (i + 1 < keys.size() && keys.at(i + 1).first == keys.at(i).first)
+        continue;
+      symbols->append(array.at(keys.at(i).second));
+    }
+  } else {
+    for (const auto &key : keys) {
+      symbols->insert(array.at(key.second));
+    }
   }
 
   changed.insert(filename, false);
@@ -982,10 +1614,8 @@ QJsonObject Server::sendFile(const QJsonObject &doc, ServerWorker *sender,
   bool store_in_memory = false;
   QVector<Symbol> l;
   if (symbols_list.contains(filename)) {
-    // Read from memory
-    for (Symbol s : symbols_list.value(filename)->values().toVector()) {
-      l.append(s);
-    }
+    // Read from memory, in document order
+    l = symbols_list.value(filename)->toVector();
   } else {
     // Reading from database
     success = db.retrieveFile(filename, l);
@@ -999,20 +1629,39 @@ QJsonObject Server::sendFile(const QJsonObject &doc, ServerWorker *sender,
   db.getSharedLink(author, file, sharedLink);
 
   int tot_symbols = l.size();
+  bool chunked = doc.value(QLatin1String("chunked")).toBool();
   if (success == true) {
     message["success"] = true;
     message["filename"] = filename;
     message["tot_symbols"] = tot_symbols;
-    message["users"] = array_users;
     message["shared_link"] = sharedLink;
+    if (chunked) {
+      message["chunked"] = true;
+    } else {
+      message["users"] = array_users;
+    }
   } else {
     message["success"] = false;
     message["reason"] = QStringLiteral("File content "
                                        "different form json array");
   }
 
-  QByteArray toSend = this->createByteArrayFileContentImage(message, l, v);
-  this->sendByteArray(sender, toSend);
+  if (success && chunked) {
+    // Small header, then the symbols in document order, then the other
+    // editors with their avatars: the client shows the beginning of the
+    // document while the rest is still arriving
+    this->sendJson(sender, message);
+    this->sendFileChunks(sender, filename, l);
+    for (int i = 0; i < array_users.size(); i++) {
+      QJsonObject user = array_users.at(i).toObject();
+      user["type"] = QStringLiteral("connection");
+      user["filename"] = filename;
+      this->sendByteArray(sender, createByteArrayJsonContent(user, v.at(i)));
+    }
+  } else {
+    QByteArray toSend = this->createByteArrayFileContentImage(message, l, v);
+    this->sendByteArray(sender, toSend);
+  }
 
   // Inform all the connected clients of the new connection
   QJsonObject message_broadcast;
@@ -1030,6 +1679,7 @@ QJsonObject Server::sendFile(const QJsonObject &doc, ServerWorker *sender,
   }
 
   this->broadcastByteArray(message_broadcast, bArray, sender);
+  notifySharedSite(filename, sender->getUsername());
   if (store_in_memory) {
     storeSymbolsServerMemory(sender->getFilename(), l);
   }
@@ -1037,8 +1687,36 @@ QJsonObject Server::sendFile(const QJsonObject &doc, ServerWorker *sender,
   return message;
 }
 
-bool Server::udpateSymbolListAndCommunicateDisconnection(QString filename,
-                                                         ServerWorker *sender) {
+// Symbols are sorted in document order, except for the last one (the
+// terminator) which comes first: every other symbol is then inserted before
+// it, never past the end of the client CRDT
+void Server::sendFileChunks(ServerWorker *destination, const QString &filename,
+                            QVector<Symbol> symbols) {
+  auto less = [](const Symbol &s1, const Symbol &s2) {
+    return Symbol::compare(s1, s2) < 0;
+  };
+  // Already sorted when read from memory
+  if (!std::is_sorted(symbols.cbegin(), symbols.cend(), less))
+    std::sort(symbols.begin(), symbols.end(), less);
+  if (!symbols.isEmpty())
+    std::rotate(symbols.begin(), symbols.end() - 1, symbols.end());
+
+  int chunks = qMax(1, (symbols.size() + FILE_CHUNK_SYMBOLS - 1) /
+                           FILE_CHUNK_SYMBOLS);
+  for (int i = 0; i < chunks; i++) {
+    QJsonObject message;
+    message["type"] = QStringLiteral("file_chunk");
+    message["filename"] = filename;
+    message["last"] = i == chunks - 1;
+
+    QByteArray content =
+        encodeSymbols(symbols.mid(i * FILE_CHUNK_SYMBOLS, FILE_CHUNK_SYMBOLS));
+    sendByteArray(destination, createBulkPayload(message, content));
+  }
+}
+
+bool Server::udpateSymbolListAndCommunicateDisconnection(
+    const QString &filename, ServerWorker *sender) {
   // Remove client from list of clients using current file
   if (mapFileWorkers->contains(filename)) {
     if (!mapFileWorkers->value(filename)->removeOne(sender))
@@ -1047,6 +1725,26 @@ bool Server::udpateSymbolListAndCommunicateDisconnection(QString filename,
     return false;
   }
 
+  // Drop the cursors not sent yet, from and to the editor leaving
+  if (m_presence.contains(filename)) {
+    QHash<int, PendingCursor> &cursors = m_presence[filename];
+    for (auto it = cursors.begin(); it != cursors.end();) {
+      if (it.value().sender == sender)
+        it = cursors.erase(it);
+      else
+        ++it;
+    }
+  }
+  m_deferredCursors.remove(sender);
+  for (QHash<int, PendingCursor> &cursors : m_deferredCursors) {
+    for (auto it = cursors.begin(); it != cursors.end();) {
+      if (it.value().sender == sender)
+        it = cursors.erase(it);
+      else
+        ++it;
+    }
+  }
+
   // If the only client using the document is the one disconnecting
   if (mapFileWorkers->value(filename)->isEmpty()) {
     // Remove file from memory
@@ -1057,7 +1755,7 @@ bool Server::udpateSymbolListAndCommunicateDisconnection(QString filename,
     this->saveFile();
 
     // Empty symbol list
-    symbols_list.remove(sender->getFilename());
+    delete symbols_list.take(sender->getFilename());
     changed.remove(sender->getFilename());
   } else {
     QJsonObject message_broadcast;
@@ -1066,6 +1764,7 @@ bool Server::udpateSymbolListAndCommunicateDisconnection(QString filename,
     message_broadcast["user"] = sender->getUsername();
     message_broadcast["nickname"] = sender->getNickname();
     this->broadcast(message_broadcast, sender);
+    notifySharedSite(filename, sender->getUsername());
   }
 
   return true;
@@ -1128,18 +1827,13 @@ QJsonObject Server::closeFile(const QJsonObject &doc, ServerWorker *sender) {
 
 // To periodically save all open files
 void Server::saveFile() {
-  for (QString filename : symbols_list.keys()) {
-    if (changed.value(filename) == true) {
-
-      // Convert QVector to QByteArray
-      QByteArray data;
-      QDataStream stream(&data, QIODevice::WriteOnly);
-      stream << symbols_list.value(filename)->values();
+  for (auto it = symbols_list.cbegin(); it != symbols_list.cend(); ++it) {
+    if (changed.value(it.key()) == true) {
 
-      // Save binary file into db
-      db.saveFile(filename, qCompress(data));
+      // Encode the symbols, in document order, and save them into db
+      db.saveFile(it.key(), qCompress(it.value()->encode()));
     }
     // Reset value to false
-    changed.insert(filename, false);
+    changed.insert(it.key(), false);
   }
 }
@@ -2,8 +2,14 @@
 #define SERVER_H
 
 #include "../Utility/common.h"
+#include "../Utility/compression.h"
+#include "../Utility/frame.h"
+#include "../Utility/opcodes.h"
 #include "../Utility/symbol.h"
+#include "../Utility/symbol_store.h"
 #include "mongo.h"
+#include "serverworker.h"
+#include <QJsonValue>
 #include <QMap>
 #include <QSslCertificate>
 #include <QSslKey>
@@ -11,11 +17,58 @@
 #include <QVector>
 
 class QThread;
-class ServerWorker;
 class QJsonObject;
 
 #define IMAGES_PATH "/profile_images"
-#define SAVE_INTERVAL_SEC 5 // saving interval in seconds
+#define SAVE_INTERVAL_SEC 5   // saving interval in seconds
+#define STATS_INTERVAL_SEC 60 // statistics logging interval in seconds
+#define FORMATS_INTERVAL_SEC 10 // unused formats eviction interval
+// Formats interned past which they are evicted before reading more, as a
+// client may send many between two evictions
+#define FORMATS_COLLECT_THRESHOLD (FORMAT_TABLE_CHUNK * FORMAT_TABLE_CHUNKS / 2)
+#define PRESENCE_TICK_MSEC 50 // cursor positions flushing interval
+#define FILE_CHUNK_SYMBOLS 2048 // symbols per frame when opening a file
+// Documents loaded with positions at least this deep on average keep them
+// in a prefix-sharing trie (see SymbolStore)
+#define SHARED_PREFIXES_MIN_DEPTH 6
+
+// Counters of the operations handled with one encoding (JSON or binary)
+struct EncodingStats {
+  quint64 received = 0;
+  qint64 handleNsecs = 0; // Decoding and applying received operations
+  quint64 sent = 0;       // Messages encoded, each shared by all recipients
+  quint64 sentBytes = 0;
+  qint64 encodeNsecs = 0;
+};
+
+// Counters of the messages sent to all the other editors of a file
+struct BroadcastStats {
+  quint64 broadcasts = 0;
+  quint64 recipients = 0;
+  qint64 encodeNsecs = 0; // Encoding the message once
+  qint64 fanoutNsecs = 0; // Queueing it on every connection
+};
+
+// Counters of the symbols referenced by OpId in received operations
+struct OpIdStats {
+  quint64 resolved = 0;
+  quint64 dropped = 0; // Not found, or cursors on an ambiguous id
+  quint64 rejected = 0; // Operations on an ambiguous id
+};
+
+// Latest cursor position of an editor, not sent to the others yet
+struct PendingCursor {
+  ServerWorker *sender;
+  Operation op;
+};
+
+// Counters of the cursor positions received and actually sent
+struct PresenceStats {
+  quint64 updates = 0;
+  quint64 flushed = 0;
+  quint64 ticks = 0;
+  quint64 coalesced = 0; // Replaced while waiting for a congested connection
+};
 
 class Server : public QTcpServer {
   Q_OBJECT
@@ -25,6 +78,7 @@ public:
   Server(QObject *parent = nullptr);
   ~Server() override;
   bool tryConnectionToMongo();
+  void setOutboundLimits(qint64 low, qint64 high, qint64 resyncLimit);
 
 protected:
   void incomingConnection(qintptr socketDescriptor) override;
@@ -34,6 +88,7 @@ private slots:
   void broadcastByteArray(const QJsonObject &message_broadcast,
                           const QByteArray &bArray, ServerWorker *sender);
   void jsonReceived(ServerWorker *sender, const QJsonObject &doc);
+  void opcodeReceived(ServerWorker *sender, const QByteArray &ops);
   void userDisconnected(ServerWorker *sender, int threadIdx);
 
 public slots:
@@ -53,10 +108,29 @@ private:
   Mongo db;
   // <filename, list_of_workers>
   QMap<QString, QList<ServerWorker *> *> *mapFileWorkers;
-  // <filename, map_of_symbols>
-  QMap<QString, QMap<QString, Symbol> *> symbols_list;
+  // <filename, symbols in document order>
+  QMap<QString, SymbolStore *> symbols_list;
   // <filename, changed>
   QMap<QString, bool> changed;
+  EncodingStats m_jsonStats;
+  EncodingStats m_binaryStats;
+  BroadcastStats m_broadcastStats;
+  // <filename, <editorId, cursor>>
+  QMap<QString, QHash<int, PendingCursor>> m_presence;
+  // Cursors waiting for a congested connection to drain, by recipient
+  QHash<ServerWorker *, QHash<int, PendingCursor>> m_deferredCursors;
+  PresenceStats m_presenceStats;
+  OpIdStats m_opIdStats;
+  CompressionStats m_compressionStats;
+  FrameStats m_frameStats;
+  qint64 m_lowWatermark = OUTBOUND_LOW_WATERMARK;
+  qint64 m_highWatermark = OUTBOUND_HIGH_WATERMARK;
+  qint64 m_resyncLimit = OUTBOUND_RESYNC_LIMIT;
+  // Clients that couldn't keep up and didn't support resync
+  quint64 m_slowDisconnects = 0;
+  quint64 m_evictedFormats = 0;
+  // Id of the request being handled, echoed in the replies to the sender
+  QJsonValue m_requestId{QJsonValue::Undefined};
 
   void jsonFromLoggedOut(ServerWorker *sender, const QJsonObject &doc);
   void handle_signup_updateImage_bulkOperation(ServerWorker *sender,
@@ -75,17 +149,49 @@ private:
   QJsonObject closeFile(const QJsonObject &doc, ServerWorker *sender);
   QByteArray createByteArrayJsonImage(QJsonObject &message,
                                       QVector<QByteArray> &v);
+  QByteArray createByteArrayJsonContent(const QJsonObject &message,
+                                        const QByteArray &content);
   QByteArray createByteArrayFileContentImage(QJsonObject &message,
                                              QVector<Symbol> &c,
                                              QVector<QByteArray> &v);
-  void storeSymbolsServerMemory(QString filename, QVector<Symbol> array);
-  bool udpateSymbolListAndCommunicateDisconnection(QString filename,
+  void sendFileChunks(ServerWorker *destination, const QString &filename,
+                      QVector<Symbol> symbols);
+  void storeSymbolsServerMemory(const QString &filename,
+                                const QVector<Symbol> &array);
+  bool udpateSymbolListAndCommunicateDisconnection(const QString &filename,
                                                    ServerWorker *sender);
   static QString fromVectorIdentifiertoString(const QVector<Identifier> &data);
   void jsonFromLoggedIn(ServerWorker *sender, const QJsonObject &doc);
+  void tagReply(QJsonObject &message);
   void sendJson(ServerWorker *destination, const QJsonObject &message);
-  void sendByteArray(ServerWorker *sender, const QByteArray &toSend);
+  void sendByteArray(ServerWorker *sender, const QByteArray &toSend,
+                     OutboundKind kind = OUTBOUND_CONTROL);
+  void sendFrame(ServerWorker *destination, FrameType type,
+                 const QByteArray &payload,
+                 OutboundKind kind = OUTBOUND_CONTROL);
   void saveFile();
+  void applyOperation(ServerWorker *sender, const Operation &op);
+  bool resolveIds(ServerWorker *sender, Operation &op);
+  void applyRangeExpanded(ServerWorker *sender, Operation &op);
+  bool hasLegacyEditors(const QString &filename);
+  bool hasSharedSite(ServerWorker *sender);
+  void notifySharedSite(const QString &filename, const QString &username);
+  void fanOut(ServerWorker *exclude, FrameType type, const QByteArray &payload,
+              qint64 encodeNsecs);
+  void broadcastOperations(const QVector<Operation> &ops,
+                           ServerWorker *exclude);
+  QByteArray legacyEncoding(const Operation &op);
+  static FrameType legacyFrameType(const Operation &op);
+  void updatePresence(ServerWorker *sender, const Operation &op);
+  void flushPresence();
+  void deferCursors(ServerWorker *destination,
+                    const QHash<int, PendingCursor> &cursors);
+  void sendCursors(ServerWorker *destination,
+                   const QHash<int, PendingCursor> &cursors);
+  void resyncClient(ServerWorker *worker);
+  void collectFormats();
+  void collectFormatsOverThreshold();
+  void logStats();
 };
 
 #endif // SERVER_H
@@ -4,21 +4,31 @@
 #include "server.h"
 #include <QBuffer>
 #include <QDataStream>
+#include <QDebug>
 #include <QDir>
 #include <QFile>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonParseError>
 #include <QThread>
+#include <QTimer>
 #include <QWidget>
 #include <QtEndian>
 
 ServerWorker::ServerWorker(QObject *parent)
     : QObject(parent), m_serverSocket(new QSslSocket(this)) {
+  // Anyone can connect: only small frames until the client has logged in
+  m_reader.setMaxFrameSize(FRAME_MAX_LOGIN_SIZE);
   connect(m_serverSocket, &QSslSocket::readyRead, this,
           &ServerWorker::onReadyRead);
   connect(m_serverSocket, &QSslSocket::disconnected, this,
           &ServerWorker::disconnectedFromClient);
+  // Our preamble precedes the replies to the client
+  connect(m_serverSocket, &QSslSocket::encrypted, this,
+          [this]() -> void { writeFramePreamble(m_serverSocket); });
+  // Resume writing as the socket drains
+  connect(m_serverSocket, &QSslSocket::encryptedBytesWritten, this,
+          &ServerWorker::flushOutbound);
 }
 
 bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor, QSslKey key,
@@ -38,18 +48,139 @@ bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor, QSslKey key,
   }
 }
 
-void ServerWorker::sendByteArray(const QByteArray &byteArray) {
-  SerializeSize size;
-  quint64 json_size = size(byteArray);
+void ServerWorker::enqueueFrame(FrameType type, const QByteArray &payload,
+                                OutboundKind kind) {
+  bool wasEmpty;
+  {
+    QMutexLocker locker(&m_outboundMutex);
+    if (m_resync && kind != OUTBOUND_CONTROL) {
+      m_outboundStats.dropped++;
+      return;
+    }
+
+    wasEmpty = m_outbound.isEmpty();
+    m_outbound.enqueue(OutboundFrame{type, payload, kind});
+    OutboundStats &st = m_outboundStats;
+    st.queuedFrames++;
+    st.queuedBytes += payload.size();
+    qint64 pending = st.queuedBytes + st.socketBytes;
+    st.peakBytes = qMax(st.peakBytes, pending);
+    if (pending > m_highWatermark) {
+      m_congested = true;
+    }
+    if (kind != OUTBOUND_CONTROL) {
+      m_updateBytes += payload.size();
+    }
+
+    // The client can't keep up: drop the document updates, it will receive
+    // the whole document again once the connection has drained
+    if (m_updateBytes > m_resyncLimit) {
+      dropUpdates();
+    }
+  }
+  // A flush is already pending otherwise
+  if (wasEmpty) {
+    QMetaObject::invokeMethod(this, "flushOutbound", Qt::QueuedConnection);
+  }
+}
+
+// With the outbound mutex held
+void ServerWorker::dropUpdates() {
+  OutboundStats &st = m_outboundStats;
+  QQueue<OutboundFrame> kept;
+  for (const OutboundFrame &frame : m_outbound) {
+    if (frame.kind == OUTBOUND_CONTROL) {
+      kept.enqueue(frame);
+    } else {
+      st.queuedFrames--;
+      st.queuedBytes -= frame.payload.size();
+      st.dropped++;
+    }
+  }
+  m_outbound.swap(kept);
+  m_updateBytes = 0;
+  m_resync = true;
+  st.resyncs++;
+}
 
-  QDataStream socketStream(m_serverSocket);
-  socketStream.setVersion(QDataStream::Qt_5_7);
-  socketStream << json_size << byteArray;
+void ServerWorker::startResync() {
+  {
+    QMutexLocker locker(&m_outboundMutex);
+    if (m_resync)
+      return;
+    dropUpdates();
+  }
+  updateBacklog();
 }
 
-void ServerWorker::sendJson(const QJsonObject &json) {
-  const QByteArray jsonData = QJsonDocument(json).toJson();
-  sendByteArray(jsonData);
+// Writes queued frames as long as the socket buffers stay below the high
+// watermark, the rest waits for the socket to drain
+void ServerWorker::flushOutbound() {
+  for (;;) {
+    OutboundFrame frame;
+    {
+      QMutexLocker locker(&m_outboundMutex);
+      if (m_outbound.isEmpty() ||
+          m_serverSocket->bytesToWrite() +
+                  m_serverSocket->encryptedBytesToWrite() >=
+              m_highWatermark)
+        break;
+      frame = m_outbound.dequeue();
+      m_outboundStats.queuedFrames--;
+      m_outboundStats.queuedBytes -= frame.payload.size();
+      if (frame.kind != OUTBOUND_CONTROL)
+        m_updateBytes -= frame.payload.size();
+    }
+    m_writer.write(m_serverSocket, frame.type, frame.payload);
+  }
+  updateBacklog();
+}
+
+void ServerWorker::updateBacklog() {
+  bool notify = false;
+  {
+    QMutexLocker locker(&m_outboundMutex);
+    OutboundStats &st = m_outboundStats;
+    st.socketBytes = m_serverSocket->bytesToWrite() +
+                     m_serverSocket->encryptedBytesToWrite();
+    qint64 pending = st.queuedBytes + st.socketBytes;
+    if (pending > m_highWatermark) {
+      m_congested = true;
+    } else if (pending <= m_lowWatermark) {
+      m_congested = false;
+      if (m_resync && !m_resyncNotified && m_outbound.isEmpty()) {
+        m_resyncNotified = true;
+        notify = true;
+      }
+    }
+  }
+  if (notify) {
+    emit resyncReady();
+  }
+}
+
+void ServerWorker::setWatermarks(qint64 low, qint64 high, qint64 resyncLimit) {
+  QMutexLocker locker(&m_outboundMutex);
+  m_lowWatermark = low;
+  m_highWatermark = qMax(low, high);
+  m_resyncLimit = qMax(m_highWatermark, resyncLimit);
+}
+
+bool ServerWorker::isCongested() {
+  QMutexLocker locker(&m_outboundMutex);
+  return m_congested;
+}
+
+// Document updates are accepted again, the snapshot follows
+void ServerWorker::endResync() {
+  QMutexLocker locker(&m_outboundMutex);
+  m_resync = false;
+  m_resyncNotified = false;
+}
+
+OutboundStats ServerWorker::outboundStats() {
+  QMutexLocker locker(&m_outboundMutex);
+  return m_outboundStats;
 }
 
 QString ServerWorker::getNickname() { return nickname; }
@@ -70,9 +201,13 @@ void ServerWorker::disconnectFromClient() {
   m_serverSocket->disconnectFromHost();
 }
 
+// A corrupted stream costs only the connection of the client that sent it
 void ServerWorker::onReadyRead() {
-  onReadyRead_helper(m_serverSocket, m_received_data, m_exptected_json_size,
-                     m_buffer, *this);
+  if (!m_reader.read(m_serverSocket, *this) &&
+      m_serverSocket->state() == QAbstractSocket::ConnectedState) {
+    qDebug() << m_reader.errorString() << "Disconnecting" << username;
+    disconnectFromClient();
+  }
 }
 
 QString ServerWorker::getFilename() { return filename; }
@@ -82,3 +217,36 @@ void ServerWorker::setFilename(const QString &filename) {
 }
 
 void ServerWorker::closeFile() { this->filename.clear(); }
+
+bool ServerWorker::getBinaryOps() { return binaryOps; }
+
+void ServerWorker::setBinaryOps(bool binaryOps) { this->binaryOps = binaryOps; }
+
+void ServerWorker::setCompressionStats(CompressionStats *stats) {
+  m_compressionStats = stats;
+  m_reader.setCompressionStats(stats);
+}
+
+void ServerWorker::setFrameStats(FrameStats *stats) {
+  m_reader.setFrameStats(stats);
+}
+
+// The writer is used only by the worker thread
+void ServerWorker::enableCompression() {
+  QTimer::singleShot(0, this, [this]() -> void {
+    m_writer.enableCompression(m_compressionStats);
+  });
+}
+
+// The reader is used only by the worker thread
+void ServerWorker::acceptLargeFrames() {
+  QTimer::singleShot(0, this, [this]() -> void {
+    m_reader.setMaxFrameSize(FRAME_MAX_SIZE);
+  });
+}
+
+QSet<quint32> &ServerWorker::sentFormats() { return m_sentFormats; }
+
+QHash<quint32, SymbolFormat> &ServerWorker::receivedFormats() {
+  return m_receivedFormats;
+}
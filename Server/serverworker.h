@@ -2,12 +2,48 @@
 #define SERVERWORKER_H
 
 #include "../Utility/byte_reader.h"
-#include "../Utility/serializesize.h"
+#include "../Utility/frame.h"
+#include "../Utility/symbol.h"
+#include <QHash>
+#include <QMutex>
 #include <QObject>
+#include <QQueue>
 #include <QReadWriteLock>
 #include <QSslSocket>
 
 class QJsonObject;
+
+// Bytes waiting to be sent on a connection (queued frames and socket buffers)
+// above which it is congested, and below which it is not anymore
+#define OUTBOUND_HIGH_WATERMARK (1024 * 1024)
+#define OUTBOUND_LOW_WATERMARK (256 * 1024)
+// Document updates queued above which they are dropped and the client is
+// resynchronized
+#define OUTBOUND_RESYNC_LIMIT (16 * 1024 * 1024)
+
+typedef enum {
+  OUTBOUND_CONTROL, // Replies, file content, users: never dropped
+  OUTBOUND_EDIT,    // Operations on the open document
+  OUTBOUND_CURSOR   // Cursor positions
+} OutboundKind;
+
+// Frame waiting to be written on a connection: the payload is implicitly
+// shared with the other recipients of the same broadcast
+struct OutboundFrame {
+  FrameType type;
+  QByteArray payload;
+  OutboundKind kind;
+};
+
+struct OutboundStats {
+  int queuedFrames = 0;
+  qint64 queuedBytes = 0;
+  qint64 socketBytes = 0; // Written to the socket, not sent yet
+  qint64 peakBytes = 0;
+  quint64 dropped = 0;
+  quint64 resyncs = 0;
+};
+
 class ServerWorker : public QObject, ByteReader {
   Q_OBJECT
   Q_DISABLE_COPY(ServerWorker)
@@ -15,8 +51,13 @@ public:
   explicit ServerWorker(QObject *parent = nullptr);
   virtual bool setSocketDescriptor(qintptr socketDescriptor, QSslKey key,
                                    QSslCertificate cert);
-  void sendJson(const QJsonObject &json);
-  void sendByteArray(const QByteArray &byteArray);
+  // Thread-safe: frames are written in order by the worker thread
+  void enqueueFrame(FrameType type, const QByteArray &payload,
+                    OutboundKind kind = OUTBOUND_CONTROL);
+  void setWatermarks(qint64 low, qint64 high, qint64 resyncLimit);
+  bool isCongested();
+  void endResync();
+  OutboundStats outboundStats();
   QString getNickname();
   QString getUsername();
   void setNickname(const QString &nickname);
@@ -25,29 +66,62 @@ public:
   QString getFilename();
   void setFilename(const QString &filename);
   void closeFile();
+  bool getBinaryOps();
+  void setBinaryOps(bool binaryOps);
+  void setCompressionStats(CompressionStats *stats);
+  void setFrameStats(FrameStats *stats);
+  void enableCompression();
+  // From login on, frames up to FRAME_MAX_SIZE are accepted
+  void acceptLargeFrames();
+  QSet<quint32> &sentFormats();
+  QHash<quint32, SymbolFormat> &receivedFormats();
 
 public slots:
   void disconnectFromClient();
+  // The document is sent again from scratch, as to a client that can't
+  // keep up
+  void startResync();
   void onReadyRead();
   //  bool parseJson();
 
+private slots:
+  void flushOutbound();
+
 signals:
   void jsonReceived(const QJsonObject &jsonDoc);
   void disconnectedFromClient();
   void error();
   void logMessage(const QString &msg);
   void byteArrayReceived(const QByteArray &jsonDoc);
+  void opcodeReceived(const QByteArray &ops);
+  // Document updates were dropped and the connection has drained
+  void resyncReady();
 
 private:
   QSslSocket *m_serverSocket;
   QString username;
   QString nickname;
   QString filename;
-  quint64 m_exptected_json_size = 0;
-  QByteArray m_received_data;
-  QBuffer m_buffer;
+  bool binaryOps = false;
+  // Formats defined on this connection, in each direction
+  QSet<quint32> m_sentFormats;
+  QHash<quint32, SymbolFormat> m_receivedFormats;
+  FrameReader m_reader;
+  FrameWriter m_writer;
+  CompressionStats *m_compressionStats = nullptr;
+  QMutex m_outboundMutex;
+  QQueue<OutboundFrame> m_outbound;
+  OutboundStats m_outboundStats;
+  qint64 m_updateBytes = 0; // Queued frames of kind other than control
+  qint64 m_lowWatermark = OUTBOUND_LOW_WATERMARK;
+  qint64 m_highWatermark = OUTBOUND_HIGH_WATERMARK;
+  qint64 m_resyncLimit = OUTBOUND_RESYNC_LIMIT;
+  bool m_congested = false;
+  bool m_resync = false;
+  bool m_resyncNotified = false;
 
-  //  void extract_content_size();
+  void updateBacklog();
+  void dropUpdates();
 };
 
 #endif // SERVERWORKER_H
@@ -0,0 +1,70 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+/*
+ * Heap allocation accounting for the editing hot paths, compiled in only
+ * with DEFINES += ALLOC_COUNTER. The translation unit of main() defines
+ * ALLOC_COUNTER_IMPLEMENTATION before including this header, replacing the
+ * global operator new and delete with versions counting the allocations of
+ * each thread. ALLOC_BUDGET(name, n) then checks that the rest of the
+ * enclosing scope allocates at most n times, and logs and counts the
+ * operations going over budget, for tests/allocations to fail on them;
+ * without ALLOC_COUNTER it expands to nothing.
+ */
+#ifdef ALLOC_COUNTER
+
+#include <QAtomicInt>
+#include <QDebug>
+#include <cstdlib>
+#include <new>
+
+// Allocations performed so far by the calling thread
+inline quint64 &allocationCount() {
+  static thread_local quint64 count = 0;
+  return count;
+}
+
+// Operations over budget so far, in every thread
+inline QAtomicInt &allocationOverruns() {
+  static QAtomicInt count;
+  return count;
+}
+
+class AllocationBudget {
+public:
+  AllocationBudget(const char *name, quint64 budget)
+      : m_name(name), m_budget(budget), m_start(allocationCount()) {}
+  ~AllocationBudget() {
+    quint64 used = allocationCount() - m_start;
+    if (used > m_budget) {
+      allocationOverruns().ref();
+      qWarning() << m_name << "allocated" << used << "times, budget"
+                 << m_budget;
+    }
+  }
+
+private:
+  Q_DISABLE_COPY(AllocationBudget)
+  const char *m_name;
+  quint64 m_budget;
+  quint64 m_start;
+};
+
+#define ALLOC_BUDGET(name, n) AllocationBudget allocationBudget(name, n)
+
+#ifdef ALLOC_COUNTER_IMPLEMENTATION
+// The array and sized forms default to these
+void *operator new(std::size_t size) {
+  allocationCount()++;
+  if (void *p = std::malloc(size != 0 ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+#endif
+
+#else
+#define ALLOC_BUDGET(name, n)
+#endif
+
+#endif // ALLOC_COUNTER_H
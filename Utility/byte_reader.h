@@ -2,101 +2,203 @@
 #define BYTEREADER_H
 
 //#include "byteReader.h"
-#include <QBuffer>
+#include "frame.h"
+#include "opcodes.h"
+#include <QByteArray>
 #include <QDataStream>
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonParseError>
-#include <QSslSocket>
+#include <QString>
+#include <QtEndian>
+#include <cstring>
 
 class ByteReader {
 public:
   virtual void jsonReceived(const QJsonObject &jsonDoc) = 0;
   virtual void byteArrayReceived(const QByteArray &jsonDoc) = 0;
+  virtual void opcodeReceived(const QByteArray &ops) = 0;
 };
 
-static void extract_content_size(QSslSocket *socket, QByteArray &received_data,
-                                 quint64 &expected_json_size) {
-  received_data.append(socket->readAll());
-
-  QDataStream in;
-  QBuffer in_buffer;
-  in_buffer.setBuffer(&received_data);
-  in_buffer.open(QIODevice::ReadOnly);
-  in.setDevice(&in_buffer);
-  in.setVersion(QDataStream::Qt_5_7);
-
-  quint64 size = 0;
-  in >> size;
-  expected_json_size = size;
-  in_buffer.close();
-}
-
-static bool parseJson(QByteArray &received_data, QBuffer &buffer,
-                      ByteReader &obj) {
-  QByteArray json_data;
-  QDataStream in;
-  buffer.setBuffer(&received_data);
-  if (!buffer.open(QIODevice::ReadOnly)) {
-    return false;
-  }
+// Counters shared by the connections, possibly on different threads
+struct FrameStats {
+  // Payloads of bulk frames, handed over without a JSON scan
+  QAtomicInteger<qint64> unparsedBytes;
+};
 
-  in.setDevice(&buffer);
-  in.setVersion(QDataStream::Qt_5_7);
-  in.startTransaction();
-  quint64 json_size;
-  in >> json_size >> json_data;
-  json_data.truncate(json_size);
+// Initial capacity of the receive buffer, kept across frames
+#define FRAME_READER_CAPACITY (64 * 1024)
+// Frames larger than this, compressed or not, are considered corrupted. The
+// largest ones are binary pastes, about 12 bytes per character
+#define FRAME_MAX_SIZE (32 * 1024 * 1024)
+// Limit for connections not logged in yet: requests and the profile image
+// of a signup (see PROFILE_IMAGE_MAX_SIZE)
+#define FRAME_MAX_LOGIN_SIZE (1024 * 1024)
 
-  if (!in.commitTransaction()) {
-    buffer.close();
-    return false;
-  }
-  buffer.close();
-
-  QJsonParseError parseError;
-  QJsonDocument jsonDoc = QJsonDocument::fromJson(json_data, &parseError);
-
-  // If not able to parse the json, it means that a QByteArray
-  // containing images or symbols has been received
-  if (parseError.error == QJsonParseError::NoError) {
-    if (jsonDoc.isObject()) {
-      emit obj.jsonReceived(jsonDoc.object());
-    } else {
-      throw std::runtime_error("Invalid json received.");
+/*
+ * Iterative decoder of the frames received on a socket (see frame.h).
+ * Bytes are appended to a reusable buffer and consumed by advancing a read
+ * cursor; the unread tail is moved to the front at most once per read, so a
+ * burst of small frames costs linear time regardless of how many frames it
+ * contains.
+ */
+class FrameReader {
+public:
+  FrameReader() { m_buffer.reserve(FRAME_READER_CAPACITY); }
+
+  // Frames with a larger payload corrupt the stream
+  void setMaxFrameSize(int size) { m_maxSize = size; }
+
+  // Counters of the compressed frames received
+  void setCompressionStats(CompressionStats *stats) { m_stats = stats; }
+  // Counters of the JSON parsing performed, or avoided, on received frames
+  void setFrameStats(FrameStats *stats) { m_frameStats = stats; }
+
+  // Reads everything available on device and dispatches each complete frame.
+  // Returns false once the stream is corrupted: frame boundaries are lost, so
+  // the rest is discarded and the connection has to be closed
+  bool read(QIODevice *device, ByteReader &obj) {
+    if (!m_error.isEmpty()) {
+      device->readAll();
+      return false;
+    }
+    if (device->bytesAvailable() > 0) {
+      m_buffer.append(device->readAll());
+    }
+
+    // The peer's preamble comes first, before any frame
+    if (!m_preambleRead) {
+      if (m_buffer.size() - m_cursor < FRAME_PREAMBLE_SIZE) {
+        return true;
+      }
+      if (!isFramePreamble(m_buffer.constData() + m_cursor)) {
+        m_incompatible = true;
+        return fail("Incompatible protocol version.");
+      }
+      m_cursor += FRAME_PREAMBLE_SIZE;
+      m_preambleRead = true;
+    }
+
+    while (m_buffer.size() - m_cursor >= FRAME_HEADER_SIZE) {
+      const char *header = m_buffer.constData() + m_cursor;
+      quint32 payload_size =
+          qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(header));
+      if (payload_size > static_cast<quint32>(m_maxSize)) {
+        return fail("Invalid frame received.");
+      }
+      if (m_buffer.size() - m_cursor <
+          FRAME_HEADER_SIZE + static_cast<int>(payload_size)) {
+        break; // Frame not completely received yet
+      }
+
+      FrameType type = static_cast<FrameType>(header[4]);
+      quint8 flags = static_cast<quint8>(header[5]);
+      const char *payload = header + FRAME_HEADER_SIZE;
+      int size = static_cast<int>(payload_size);
+      m_cursor += FRAME_HEADER_SIZE + size;
+
+      // Compressed frames are always accepted: only sending is negotiated.
+      // The inflated payload is bound by the same limit as the frames, a
+      // few kilobytes of deflate stream can expand a thousandfold
+      if (flags & FLAG_COMPRESSED) {
+        QElapsedTimer timer;
+        timer.start();
+        if (!m_inflater.decompress(payload, size, m_inflated, m_maxSize))
+          return fail("Invalid compressed frame received.");
+        if (m_stats != nullptr) {
+          m_stats->inflated.fetchAndAddRelaxed(1);
+          m_stats->inflateNsecs.fetchAndAddRelaxed(timer.nsecsElapsed());
+        }
+        payload = m_inflated.constData();
+        size = m_inflated.size();
+      }
+      if (!dispatch(type, payload, size, obj))
+        return false;
+      // Only buffers of ordinary frames are kept for the next ones
+      if (m_inflated.capacity() > FRAME_READER_CAPACITY) {
+        m_inflated = QByteArray();
+      }
     }
-  } else {
-    emit obj.byteArrayReceived(json_data);
+
+    compact();
+    return true;
   }
-  received_data.remove(0, 8 + json_size);
-  return true;
-}
-
-static void onReadyRead_helper(QSslSocket *socket, QByteArray &received_data,
-                               quint64 &expected_json_size, QBuffer &buffer,
-                               ByteReader &obj) {
-  if (socket->bytesAvailable() > 0) {
-    received_data.append(socket->readAll());
+
+  // Why the last read() failed
+  const QString &errorString() const { return m_error; }
+  // Whether it failed because the peer speaks another version of the protocol
+  bool isIncompatible() const { return m_incompatible; }
+
+  void clear() {
+    m_buffer.resize(0);
+    m_cursor = 0;
+    m_inflater.reset();
+    m_error.clear();
+    m_preambleRead = false;
+    m_incompatible = false;
   }
 
-  // 8 is the size of the integer (that contains content size)
-  if (received_data.isNull() || received_data.size() < 8) {
-    return;
+private:
+  QByteArray m_buffer;
+  int m_cursor = 0;
+  int m_maxSize = FRAME_MAX_SIZE;
+  Inflater m_inflater;
+  QByteArray m_inflated; // Decompressed payload, reused across frames
+  CompressionStats *m_stats = nullptr;
+  FrameStats *m_frameStats = nullptr;
+  QString m_error;
+  bool m_preambleRead = false;
+  bool m_incompatible = false;
+
+  bool fail(const char *error) {
+    m_error = QLatin1String(error);
+    m_buffer.resize(0);
+    m_cursor = 0;
+    return false;
   }
 
-  if (expected_json_size == 0) {
-    // Update m_received_data and m_exptected_json_size
-    extract_content_size(socket, received_data, expected_json_size);
+  void compact() {
+    if (m_cursor == 0) {
+      return;
+    }
+    int remaining = m_buffer.size() - m_cursor;
+    if (remaining > 0) {
+      memmove(m_buffer.data(), m_buffer.constData() + m_cursor, remaining);
+    }
+    m_buffer.resize(remaining);
+    m_cursor = 0;
   }
 
-  // If data completely received
-  if (expected_json_size > 0 &&
-      received_data.size() >= expected_json_size + 8) {
-    if (parseJson(received_data, buffer, obj)) {
-      expected_json_size = 0;
-      onReadyRead_helper(socket, received_data, expected_json_size, buffer,
-                         obj);
+  // JSON is parsed straight from a view over the buffer; payloads handed to
+  // other threads or queued slots are copied out exactly once
+  bool dispatch(FrameType type, const char *payload, int size,
+                ByteReader &obj) {
+    switch (type) {
+    case FRAME_OPCODE:
+      emit obj.opcodeReceived(QByteArray(payload, size));
+      return true;
+    case FRAME_BULK:
+      if (m_frameStats != nullptr)
+        m_frameStats->unparsedBytes.fetchAndAddRelaxed(size);
+      emit obj.byteArrayReceived(QByteArray(payload, size));
+      return true;
+    case FRAME_JSON:
+      break;
+    default:
+      return fail("Invalid frame received.");
     }
+
+    QByteArray view = QByteArray::fromRawData(payload, size);
+    QJsonParseError parseError;
+    QJsonDocument jsonDoc = QJsonDocument::fromJson(view, &parseError);
+    if (parseError.error != QJsonParseError::NoError || !jsonDoc.isObject()) {
+      return fail("Invalid json received.");
+    }
+    emit obj.jsonReceived(jsonDoc.object());
+    return true;
   }
-}
+};
 
 #endif // BYTEREADER_H
@@ -1,6 +1,14 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-typedef enum { INSERT_SYMBOL, DELETE_SYMBOL, CHANGE, ALIGN, PASTE, CURSOR } OperationType;
+typedef enum {
+  INSERT_SYMBOL,
+  DELETE_SYMBOL,
+  CHANGE,
+  ALIGN,
+  PASTE,
+  CURSOR,
+  DELETE_RANGE
+} OperationType;
 
 #endif // SERIALIZESIZE_H
@@ -0,0 +1,118 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QtGlobal>
+#include <cstring>
+#include <stdexcept>
+#ifdef Q_OS_WIN
+#include <QtZlib/zlib.h>
+#else
+#include <zlib.h>
+#endif
+
+// Version of the frame compression, negotiated at login
+#define COMPRESSION_VERSION 1
+// Frames with smaller payloads are not worth compressing
+#define COMPRESSION_THRESHOLD 1024
+// Frame flag (see frame.h) set on compressed payloads
+#define FLAG_COMPRESSED 0x01
+
+// Counters shared by the connections, possibly on different threads
+struct CompressionStats {
+  QAtomicInteger<qint64> frames;
+  QAtomicInteger<qint64> bytesIn; // Uncompressed
+  QAtomicInteger<qint64> bytesOut;
+  QAtomicInteger<qint64> deflateNsecs;
+  QAtomicInteger<qint64> inflated;
+  QAtomicInteger<qint64> inflateNsecs;
+};
+
+/*
+ * Raw deflate stream kept for the whole connection: each frame is flushed
+ * with Z_SYNC_FLUSH, so the receiver can decode it entirely, while the
+ * dictionary built by the previous frames (font names, colors, JSON keys)
+ * keeps compressing the following ones.
+ */
+class Deflater {
+public:
+  Deflater() {
+    memset(&m_stream, 0, sizeof(m_stream));
+    if (deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("Unable to initialize compression.");
+  }
+  ~Deflater() { deflateEnd(&m_stream); }
+
+  QByteArray compress(const QByteArray &data) {
+    QByteArray out;
+    out.resize(static_cast<int>(deflateBound(&m_stream, data.size())) + 16);
+    m_stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+    m_stream.avail_in = data.size();
+
+    int produced = 0;
+    do {
+      if (produced == out.size())
+        out.resize(out.size() * 2);
+      m_stream.next_out = reinterpret_cast<Bytef *>(out.data() + produced);
+      m_stream.avail_out = out.size() - produced;
+      if (deflate(&m_stream, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+        throw std::runtime_error("Compression error.");
+      produced = out.size() - m_stream.avail_out;
+    } while (m_stream.avail_out == 0);
+
+    out.resize(produced);
+    return out;
+  }
+
+private:
+  Q_DISABLE_COPY(Deflater)
+  z_stream m_stream;
+};
+
+class Inflater {
+public:
+  Inflater() {
+    memset(&m_stream, 0, sizeof(m_stream));
+    if (inflateInit2(&m_stream, -MAX_WBITS) != Z_OK)
+      throw std::runtime_error("Unable to initialize decompression.");
+  }
+  ~Inflater() { inflateEnd(&m_stream); }
+
+  // Restarts the stream, when the connection is reset
+  void reset() { inflateReset(&m_stream); }
+
+  // Returns false on corrupted input or if out would exceed maxSize
+  bool decompress(const char *data, int size, QByteArray &out, int maxSize) {
+    out.resize(static_cast<int>(
+        qMin<qint64>(qMax<qint64>(4LL * size, 1024), maxSize)));
+    m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_stream.avail_in = size;
+
+    int produced = 0;
+    do {
+      if (produced == out.size()) {
+        if (out.size() >= maxSize)
+          return false;
+        out.resize(static_cast<int>(qMin<qint64>(2LL * out.size(), maxSize)));
+      }
+      m_stream.next_out = reinterpret_cast<Bytef *>(out.data() + produced);
+      m_stream.avail_out = out.size() - produced;
+      int ret = inflate(&m_stream, Z_SYNC_FLUSH);
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return false;
+      produced = out.size() - m_stream.avail_out;
+    } while (m_stream.avail_out == 0);
+
+    out.resize(produced);
+    return m_stream.avail_in == 0;
+  }
+
+private:
+  Q_DISABLE_COPY(Inflater)
+  z_stream m_stream;
+};
+
+#endif // COMPRESSION_H
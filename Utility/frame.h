@@ -0,0 +1,140 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "compression.h"
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QScopedPointer>
+#include <QtEndian>
+#include <cstring>
+
+/*
+ * Every message exchanged between client and server is a frame made of a
+ * fixed 8-byte header followed by the payload:
+ *   quint32 payload length (big-endian)
+ *   quint8  frame type
+ *   quint8  flags
+ *   quint16 reserved
+ */
+#define FRAME_HEADER_SIZE 8
+
+/*
+ * Before any frame, each side sends a preamble with the version of the
+ * framing: FRAME_PREAMBLE_MAGIC followed by the quint32 version (big-endian).
+ * A peer with a different version, or one framing messages as a QDataStream
+ * of a quint64 size and a QByteArray (which starts with zeros), is rejected
+ * at its first bytes. Anything else is negotiated at login.
+ */
+#define FRAME_PREAMBLE_MAGIC "SHED"
+#define FRAME_PREAMBLE_SIZE 8
+#define FRAME_PROTOCOL_VERSION 1
+
+/*
+ * The frame type tells the receiver how to decode the payload without
+ * inspecting it. Type 0 was used for both JSON messages and bulk payloads,
+ * told apart by parsing: it is no longer accepted.
+ */
+typedef enum {
+  FRAME_OPCODE = 1, // Binary operations (see opcodes.h)
+  FRAME_JSON,       // JSON message
+  FRAME_BULK        // JSON header followed by binary content: images, symbols
+} FrameType;
+
+// Capacity of the per-connection buffer in which frames are assembled:
+// larger payloads are written directly after the header
+#define FRAME_WRITER_CAPACITY (16 * 1024)
+
+static inline void writeFrameHeader(char *dst, quint32 length, FrameType type,
+                                    quint8 flags) {
+  qToBigEndian(length, reinterpret_cast<uchar *>(dst));
+  dst[4] = static_cast<char>(type);
+  dst[5] = static_cast<char>(flags);
+  dst[6] = dst[7] = 0;
+}
+
+static inline void writeFramePreamble(QIODevice *device) {
+  char preamble[FRAME_PREAMBLE_SIZE];
+  memcpy(preamble, FRAME_PREAMBLE_MAGIC, 4);
+  qToBigEndian<quint32>(FRAME_PROTOCOL_VERSION,
+                        reinterpret_cast<uchar *>(preamble + 4));
+  device->write(preamble, FRAME_PREAMBLE_SIZE);
+}
+
+static inline bool isFramePreamble(const char *data) {
+  return memcmp(data, FRAME_PREAMBLE_MAGIC, 4) == 0 &&
+         qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(data + 4)) ==
+             FRAME_PROTOCOL_VERSION;
+}
+
+class FrameWriter {
+public:
+  FrameWriter() { m_buffer.reserve(FRAME_WRITER_CAPACITY); }
+
+  // Compresses payloads of at least COMPRESSION_THRESHOLD bytes from now on,
+  // once the peer has agreed at login
+  void enableCompression(CompressionStats *stats) {
+    m_deflater.reset(new Deflater);
+    m_stats = stats;
+  }
+  void disableCompression() { m_deflater.reset(); }
+
+  // Writes the header and the payload to device in a single pass
+  void write(QIODevice *device, FrameType type, const QByteArray &payload,
+             quint8 flags = 0) {
+    if (m_deflater && payload.size() >= COMPRESSION_THRESHOLD) {
+      QElapsedTimer timer;
+      timer.start();
+      QByteArray compressed = m_deflater->compress(payload);
+      if (m_stats != nullptr) {
+        m_stats->frames.fetchAndAddRelaxed(1);
+        m_stats->bytesIn.fetchAndAddRelaxed(payload.size());
+        m_stats->bytesOut.fetchAndAddRelaxed(compressed.size());
+        m_stats->deflateNsecs.fetchAndAddRelaxed(timer.nsecsElapsed());
+      }
+      writeFrame(device, type, compressed, flags | FLAG_COMPRESSED);
+    } else {
+      writeFrame(device, type, payload, flags);
+    }
+  }
+
+private:
+  QByteArray m_buffer;
+  QScopedPointer<Deflater> m_deflater;
+  CompressionStats *m_stats = nullptr;
+
+  void writeFrame(QIODevice *device, FrameType type, const QByteArray &payload,
+                  quint8 flags) {
+    if (payload.size() > FRAME_WRITER_CAPACITY - FRAME_HEADER_SIZE) {
+      char header[FRAME_HEADER_SIZE];
+      writeFrameHeader(header, payload.size(), type, flags);
+      device->write(header, FRAME_HEADER_SIZE);
+      device->write(payload);
+      return;
+    }
+
+    m_buffer.resize(FRAME_HEADER_SIZE);
+    writeFrameHeader(m_buffer.data(), payload.size(), type, flags);
+    m_buffer.append(payload);
+    device->write(m_buffer);
+  }
+};
+
+// Payload of bulk operations: JSON header (preceded by its size, in host
+// byte order) followed by the binary content up to the end of the frame
+static inline QByteArray createBulkPayload(const QJsonObject &message,
+                                           const QByteArray &content) {
+  QByteArray json = QJsonDocument(message).toJson(QJsonDocument::Compact);
+  quint32 size_json = json.size();
+
+  QByteArray ba;
+  ba.reserve(sizeof(size_json) + json.size() + content.size());
+  ba.append((const char *)&size_json, sizeof(size_json));
+  ba.append(json);
+  ba.append(content);
+  return ba;
+}
+
+#endif // FRAME_H
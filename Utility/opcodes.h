@@ -0,0 +1,386 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include "common.h"
+#include "symbol.h"
+#include "symbol_codec.h"
+#include "varint.h"
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <stdexcept>
+
+// Version of the binary operation protocol, negotiated at login
+#define OPCODE_VERSION 5
+
+// Opcode defining a format, referenced by its id in the following symbols
+#define OP_FORMAT 0x10
+// Operation flag: existing symbols referenced by OpId instead of position
+#define OP_FLAG_BY_ID 0x01
+
+/*
+ * Payload of a FRAME_OPCODE frame: one or more operations, each with a
+ * fixed two-byte header (opcode, flags) and a varint-encoded body:
+ *   editorId, [count], symbols...
+ * where count is present only for bulk operations (PASTE, CHANGE,
+ * DELETE_SYMBOL) and each symbol carries only the fields its opcode needs.
+ * In bulk operations each position is written relative to the previous one
+ * of the same operation (see writePositionDelta), after its depth.
+ * DELETE_SYMBOL, CHANGE and CURSOR may instead reference the symbols by OpId
+ * (OP_FLAG_BY_ID): site and counter, each as the signed difference from the
+ * previous symbol of the operation, followed by the format id for CHANGE.
+ * Senders do so only for ids unique in their copy of the document.
+ * DELETE_RANGE carries the first and the last symbol removed, positions
+ * only, then the count and the ids of the last symbol of each site in the
+ * range, i.e. with the highest counter: symbols between the two with a
+ * higher counter, or of a site not listed, were inserted concurrently and
+ * are kept.
+ * Formats are sent once per connection as OP_FORMAT definitions and then
+ * referenced by their id, a varint: the index of the format in the sender's
+ * FormatTable, so distinct formats never share an id. A definition replaces
+ * any previous one with the same id.
+ */
+
+class Operation {
+public:
+  OperationType type;
+  int editorId;
+  // With byId, symbols carry only the format (CHANGE) of the symbols with
+  // the given ids, as received; when sending, ids are taken from symbols.
+  // DELETE_RANGE: the first and the last symbol, and in ids the last
+  // symbol of each site seen by the sender in the range
+  QVector<Symbol> symbols;
+  bool byId = false;
+  QVector<OpId> ids;
+
+  Operation() {}
+  Operation(OperationType type, int editorId, QVector<Symbol> symbols)
+      : type(type), editorId(editorId), symbols(std::move(symbols)) {}
+
+  static bool isBulk(OperationType type) {
+    return type == PASTE || type == CHANGE || type == DELETE_SYMBOL;
+  }
+  static bool hasValue(OperationType type) {
+    return type != CURSOR && type != DELETE_RANGE;
+  }
+  // Positions written relative to the previous one of the operation
+  static bool hasDeltaPositions(OperationType type) {
+    return isBulk(type) || type == DELETE_RANGE;
+  }
+  static bool hasFormat(OperationType type) {
+    return type == INSERT_SYMBOL || type == ALIGN || type == PASTE ||
+           type == CHANGE;
+  }
+  // Operations on existing symbols, which may be referenced by OpId
+  static bool canUseIds(OperationType type) {
+    return type == DELETE_SYMBOL || type == CHANGE || type == CURSOR;
+  }
+
+  // Distinct formats referenced by the symbols, by id
+  QHash<quint32, SymbolFormat> formats() const {
+    QHash<quint32, SymbolFormat> result;
+    if (hasFormat(type)) {
+      for (const Symbol &s : symbols) {
+        quint32 id = s.getFormatId();
+        if (!result.contains(id))
+          result.insert(id, s.getFormat());
+      }
+    }
+    return result;
+  }
+};
+
+class OpWriter {
+public:
+  // Ids of the formats already defined on the connection: the writer emits a
+  // definition
+  // for every other format it references and adds it to the set. Without a
+  // set no definition is emitted, so that the same operations can be sent on
+  // several connections after their definitions (see define)
+  explicit OpWriter(QSet<quint32> *knownFormats)
+      : m_knownFormats(knownFormats) {}
+
+  void append(const Operation &op) {
+    if (m_knownFormats != nullptr && Operation::hasFormat(op.type)) {
+      for (const Symbol &s : op.symbols) {
+        if (!m_knownFormats->contains(s.getFormatId()))
+          define(s.getFormatId(), s.getFormat());
+      }
+    }
+
+    bool byId = op.byId && Operation::canUseIds(op.type);
+    m_data.append(static_cast<char>(op.type));
+    m_data.append(static_cast<char>(byId ? OP_FLAG_BY_ID : 0));
+    writeSignedVarint(m_data, op.editorId);
+    if (Operation::isBulk(op.type)) {
+      writeVarint(m_data, op.symbols.size());
+    } else if (op.type == DELETE_RANGE) {
+      if (op.symbols.size() != 2)
+        throw std::runtime_error("Range bounds expected.");
+    } else if (op.symbols.size() != 1) {
+      throw std::runtime_error("Single-symbol operation expected.");
+    }
+    if (byId) {
+      writeIds(op);
+      m_ops++;
+      return;
+    }
+    const Position *previous = nullptr;
+    for (const Symbol &s : op.symbols) {
+      writeSymbol(op.type, s, previous);
+      previous = &s.getPositionRef();
+    }
+    if (op.type == DELETE_RANGE) {
+      writeVarint(m_data, op.ids.size());
+      int site = 0, counter = 0;
+      for (OpId id : op.ids)
+        writeId(id, site, counter);
+    }
+    m_ops++;
+  }
+
+  // Emits the definition of format, unless already known on the connection
+  void define(quint32 id, const SymbolFormat &format) {
+    if (m_knownFormats->contains(id)) {
+      return;
+    }
+    m_knownFormats->insert(id);
+
+    m_data.append(static_cast<char>(OP_FORMAT));
+    m_data.append(static_cast<char>(0));
+    writeVarint(m_data, id);
+    writeSymbolFormat(m_data, format);
+  }
+
+  QByteArray data() const { return m_data; }
+  int size() const { return m_data.size(); }
+  int operations() const { return m_ops; }
+  bool isEmpty() const { return m_data.isEmpty(); }
+
+  void clear() {
+    m_data.clear();
+    m_ops = 0;
+  }
+
+private:
+  QSet<quint32> *m_knownFormats;
+  QByteArray m_data;
+  int m_ops = 0;
+
+  // previous is the position of the preceding symbol of a bulk operation,
+  // if any
+  void writeSymbol(OperationType type, const Symbol &s,
+                   const Position *previous) {
+    if (Operation::hasValue(type)) {
+      writeVarint(m_data, s.getValue());
+      writeSignedVarint(m_data, s.getCounter());
+    }
+    const Position &position = s.getPositionRef();
+    writeVarint(m_data, position.size());
+    if (Operation::hasDeltaPositions(type)) {
+      writePositionDelta(m_data, previous ? previous->data() : nullptr,
+                         previous ? previous->size() : 0, position.data(),
+                         position.size());
+    } else {
+      for (const Identifier &id : position) {
+        writeSignedVarint(m_data, id.digit);
+        writeSignedVarint(m_data, id.site);
+      }
+    }
+    if (Operation::hasFormat(type)) {
+      writeVarint(m_data, s.getFormatId());
+    }
+  }
+
+  void writeIds(const Operation &op) {
+    int site = 0, counter = 0;
+    for (const Symbol &s : op.symbols) {
+      writeId(s.opId(), site, counter);
+      if (Operation::hasFormat(op.type))
+        writeVarint(m_data, s.getFormatId());
+    }
+  }
+
+  // site and counter are those of the previous id, updated
+  void writeId(OpId id, int &site, int &counter) {
+    writeSignedVarint(m_data, qint64(opIdSite(id)) - site);
+    writeSignedVarint(m_data, qint64(opIdCounter(id)) - counter);
+    site = opIdSite(id);
+    counter = opIdCounter(id);
+  }
+};
+
+class OpReader {
+public:
+  // Format definitions found in the frame are stored in formats, which must
+  // persist for the whole connection
+  OpReader(const QByteArray &data, QHash<quint32, SymbolFormat> *formats)
+      : m_data(data), m_formats(formats) {
+    m_p = m_data.constData();
+    m_end = m_p + m_data.size();
+  }
+
+  // Returns false at the end of the frame or on malformed input
+  bool next(Operation &op) {
+    while (!m_error && m_p < m_end) {
+      if (m_end - m_p < 2) {
+        m_error = true;
+        return false;
+      }
+      quint8 opcode = static_cast<quint8>(*m_p++);
+      quint8 flags = static_cast<quint8>(*m_p++);
+
+      if (opcode == OP_FORMAT) {
+        readFormat();
+        continue;
+      }
+      if (opcode > DELETE_RANGE) {
+        m_error = true;
+        return false;
+      }
+
+      op.type = static_cast<OperationType>(opcode);
+      op.symbols.clear();
+      op.ids.clear();
+      op.byId = (flags & OP_FLAG_BY_ID) && Operation::canUseIds(op.type);
+      qint64 editorId;
+      quint64 count = op.type == DELETE_RANGE ? 2 : 1;
+      if (!readSignedVarint(m_p, m_end, editorId) ||
+          (Operation::isBulk(op.type) && !readVarint(m_p, m_end, count)) ||
+          count > static_cast<quint64>(m_end - m_p)) {
+        m_error = true;
+        return false;
+      }
+      op.editorId = static_cast<int>(editorId);
+      op.symbols.reserve(static_cast<int>(count));
+      m_position.clear();
+      if (op.byId) {
+        op.ids.reserve(static_cast<int>(count));
+        m_site = m_counter = 0;
+      }
+      for (quint64 i = 0; i < count; i++) {
+        Symbol s;
+        if (op.byId ? !readId(op, s) : !readSymbol(op.type, s)) {
+          m_error = true;
+          return false;
+        }
+        op.symbols.append(s);
+      }
+      if (op.type == DELETE_RANGE && !readRangeIds(op)) {
+        m_error = true;
+        return false;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  bool hasError() const { return m_error; }
+
+private:
+  QByteArray m_data;
+  QHash<quint32, SymbolFormat> *m_formats;
+  QHash<quint32, quint32> m_formatIds; // Sender's id to FormatTable index
+  Position m_position; // Of the last symbol read in the operation
+  qint64 m_site = 0;    // Of the last id read in the operation
+  qint64 m_counter = 0;
+  const char *m_p;
+  const char *m_end;
+  bool m_error = false;
+
+  bool readSymbol(OperationType type, Symbol &s) {
+    quint64 value = 0, depth;
+    qint64 counter = 0;
+    if (Operation::hasValue(type) && (!readVarint(m_p, m_end, value) ||
+                                      !readSignedVarint(m_p, m_end, counter)))
+      return false;
+    if (!readVarint(m_p, m_end, depth) || depth > POSITION_MAX_DEPTH)
+      return false;
+
+    if (Operation::hasDeltaPositions(type)) {
+      if (!readPositionDelta(m_p, m_end, static_cast<int>(depth), m_position))
+        return false;
+    } else {
+      m_position.clear();
+      if (!readIdentifiers(m_p, m_end, static_cast<int>(depth), m_position))
+        return false;
+    }
+
+    s = Symbol(static_cast<ushort>(value), m_position,
+               static_cast<int>(counter));
+    return !Operation::hasFormat(type) || readFormatId(s);
+  }
+
+  // Symbol referenced by OpId, appended to op.ids
+  bool readId(Operation &op, Symbol &s) {
+    if (!readIdDelta(op))
+      return false;
+    s = Symbol(0, Position(), static_cast<int>(m_counter));
+    return !Operation::hasFormat(op.type) || readFormatId(s);
+  }
+
+  bool readIdDelta(Operation &op) {
+    qint64 site, counter;
+    if (!readSignedVarint(m_p, m_end, site) ||
+        !readSignedVarint(m_p, m_end, counter))
+      return false;
+    m_site += site;
+    m_counter += counter;
+    op.ids.append(
+        makeOpId(static_cast<int>(m_site), static_cast<int>(m_counter)));
+    return true;
+  }
+
+  bool readRangeIds(Operation &op) {
+    quint64 count;
+    if (!readVarint(m_p, m_end, count) ||
+        count > static_cast<quint64>(m_end - m_p))
+      return false;
+    op.ids.reserve(static_cast<int>(count));
+    m_site = m_counter = 0;
+    for (quint64 i = 0; i < count; i++) {
+      if (!readIdDelta(op))
+        return false;
+    }
+    return true;
+  }
+
+  bool readFormatId(Symbol &s) {
+    quint32 sent;
+    if (!readUint32(sent))
+      return false;
+    // Interned once per frame
+    auto id = m_formatIds.constFind(sent);
+    if (id == m_formatIds.constEnd()) {
+      quint32 interned;
+      if (!m_formats->contains(sent) ||
+          !FormatTable::instance().intern(m_formats->value(sent), interned))
+        return false;
+      id = m_formatIds.insert(sent, interned);
+    }
+    s.setFormatId(id.value());
+    return true;
+  }
+
+  void readFormat() {
+    quint32 sent;
+    SymbolFormat format;
+    if (!readUint32(sent) || !readSymbolFormat(m_p, m_end, format)) {
+      m_error = true;
+      return;
+    }
+    m_formats->insert(sent, format);
+    m_formatIds.remove(sent);
+  }
+
+  bool readUint32(quint32 &n) {
+    quint64 value;
+    if (!readVarint(m_p, m_end, value) || value > 0xFFFFFFFFu)
+      return false;
+    n = static_cast<quint32>(value);
+    return true;
+  }
+};
+
+#endif // OPCODES_H
@@ -0,0 +1,281 @@
+#ifndef POSITION_H
+#define POSITION_H
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QJsonObject>
+#include <QString>
+#include <QVector>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+
+// Identifiers are compared two at a time with SSE2 where available, unless
+// POSITION_NO_SIMD is defined
+#if !defined(POSITION_NO_SIMD) &&                                              \
+    (defined(__SSE2__) || defined(_M_X64) ||                                   \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define POSITION_SSE2
+#include <emmintrin.h>
+#endif
+
+class Identifier {
+public:
+  int digit;
+  int site;
+
+public:
+  Identifier() {} // Empty constructor needed, otherwise compile error
+  Identifier(int digit, int site) : digit(digit), site(site) {}
+
+  static int compare(const Identifier &i1, const Identifier &i2) {
+    if (i1.digit < i2.digit) {
+      return -1;
+    } else if (i1.digit > i2.digit) {
+      return 1;
+    } else {
+      if (i1.site < i2.site) {
+        return -1;
+      } else if (i1.site > i2.site) {
+        return 1;
+      } else {
+        return 0;
+      }
+    }
+  }
+
+  QString to_string() const {
+    return QString::number(digit) + "_" + QString::number(site);
+  }
+
+  QJsonObject toJson() const {
+    QJsonObject json;
+    json["digit"] = digit;
+    json["site"] = site;
+    return json;
+  }
+
+  friend QDataStream &operator<<(QDataStream &out, const Identifier &id) {
+    out << id.digit << id.site;
+    return out;
+  }
+
+  friend QDataStream &operator>>(QDataStream &in, Identifier &id) {
+    id = Identifier();
+    in >> id.digit >> id.site;
+    return in;
+  }
+};
+
+// Depth of the positions stored without a heap allocation
+#define POSITION_INLINE_DEPTH 3
+#define POSITION_MAX_DEPTH 0xFFFF
+// Bytes per level in the keys of the positions (see Position::toKey)
+#define POSITION_KEY_LEVEL 8
+
+/*
+ * Position of a symbol in the CRDT: a sequence of identifiers, most of the
+ * time one to three levels deep. Those are stored inline in the object, so a
+ * symbol costs no separate allocation; deeper positions spill to the heap.
+ * Serialized exactly as a QVector<Identifier>.
+ */
+class Position {
+public:
+  Position() : m_size(0), m_capacity(POSITION_INLINE_DEPTH) {}
+  Position(const Identifier *ids, int size) : Position() { assign(ids, size); }
+  Position(const QVector<Identifier> &ids) : Position() {
+    assign(ids.constData(), ids.size());
+  }
+  Position(std::initializer_list<Identifier> ids) : Position() {
+    assign(ids.begin(), static_cast<int>(ids.size()));
+  }
+  Position(const Position &other) : Position() {
+    assign(other.data(), other.m_size);
+  }
+  Position(Position &&other) noexcept : Position() { swap(other); }
+  ~Position() {
+    if (isHeap())
+      delete[] m_heap;
+  }
+
+  Position &operator=(const Position &other) {
+    if (this != &other)
+      assign(other.data(), other.m_size);
+    return *this;
+  }
+  Position &operator=(Position &&other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(Position &other) noexcept {
+    std::swap(m_size, other.m_size);
+    std::swap(m_capacity, other.m_capacity);
+    char tmp[sizeof(m_inline)];
+    memcpy(tmp, m_inline, sizeof(m_inline));
+    memcpy(m_inline, other.m_inline, sizeof(m_inline));
+    memcpy(other.m_inline, tmp, sizeof(m_inline));
+  }
+
+  int size() const { return m_size; }
+  bool isEmpty() const { return m_size == 0; }
+  const Identifier *data() const { return isHeap() ? m_heap : m_inline; }
+  const Identifier *begin() const { return data(); }
+  const Identifier *end() const { return data() + m_size; }
+  const Identifier &operator[](int i) const { return data()[i]; }
+  const Identifier &last() const { return data()[m_size - 1]; }
+
+  void append(const Identifier &id) {
+    reserve(m_size + 1);
+    mutableData()[m_size++] = id;
+  }
+  void clear() { m_size = 0; }
+  // Keeps the first size identifiers
+  void truncate(int size) { m_size = std::min<int>(m_size, std::max(size, 0)); }
+
+  void reserve(int size) {
+    if (size <= m_capacity)
+      return;
+    if (size > POSITION_MAX_DEPTH)
+      throw std::runtime_error("Position too deep.");
+    int capacity = std::min(std::max(size, 2 * m_capacity), POSITION_MAX_DEPTH);
+    Identifier *heap = new Identifier[capacity];
+    std::copy(data(), data() + m_size, heap);
+    if (isHeap())
+      delete[] m_heap;
+    m_heap = heap;
+    m_capacity = capacity;
+  }
+
+  // Same order as comparing the identifiers one level at a time, a
+  // position being smaller than the ones it is a prefix of
+  static int compare(const Position &p1, const Position &p2) {
+    return compare(p1.data(), p1.size(), p2.data(), p2.size());
+  }
+
+  // Positions stored elsewhere, as n1 and n2 identifiers
+  static int compare(const Identifier *p1, int n1, const Identifier *p2,
+                     int n2) {
+    int n = std::min(n1, n2);
+    int i = firstMismatch(p1, p2, n);
+    if (i < n)
+      return Identifier::compare(p1[i], p2[i]);
+    return n1 < n2 ? -1 : (n1 > n2 ? 1 : 0);
+  }
+
+  // Number of leading identifiers the two positions have in common
+  static int commonPrefix(const Identifier *p1, int n1, const Identifier *p2,
+                          int n2) {
+    return firstMismatch(p1, p2, std::min(n1, n2));
+  }
+
+  /*
+   * Order-preserving binary form: comparing two keys byte by byte, the
+   * shorter first when one is a prefix of the other (as QByteArray does),
+   * gives the same order as compare. Each level takes 8 bytes, digit then
+   * site, big-endian with the sign bit flipped, so keys can also be radix
+   * sorted one byte at a time.
+   */
+  QByteArray toKey() const {
+    QByteArray key(m_size * POSITION_KEY_LEVEL, Qt::Uninitialized);
+    uchar *p = reinterpret_cast<uchar *>(key.data());
+    for (const Identifier &id : *this) {
+      qToBigEndian(static_cast<quint32>(id.digit) ^ 0x80000000u, p);
+      qToBigEndian(static_cast<quint32>(id.site) ^ 0x80000000u, p + 4);
+      p += POSITION_KEY_LEVEL;
+    }
+    return key;
+  }
+
+  // Returns false if key is not a valid position key
+  static bool fromKey(const QByteArray &key, Position &pos) {
+    pos.clear();
+    if (key.size() % POSITION_KEY_LEVEL != 0 ||
+        key.size() / POSITION_KEY_LEVEL > POSITION_MAX_DEPTH)
+      return false;
+    const uchar *p = reinterpret_cast<const uchar *>(key.constData());
+    pos.reserve(key.size() / POSITION_KEY_LEVEL);
+    for (int i = 0; i < key.size(); i += POSITION_KEY_LEVEL) {
+      quint32 digit = qFromBigEndian<quint32>(p + i) ^ 0x80000000u;
+      quint32 site = qFromBigEndian<quint32>(p + i + 4) ^ 0x80000000u;
+      pos.append(Identifier(static_cast<int>(digit), static_cast<int>(site)));
+    }
+    return true;
+  }
+
+  QVector<Identifier> toVector() const {
+    QVector<Identifier> v;
+    v.reserve(m_size);
+    for (const Identifier &id : *this)
+      v.append(id);
+    return v;
+  }
+
+  friend QDataStream &operator<<(QDataStream &out, const Position &pos) {
+    out << static_cast<quint32>(pos.m_size);
+    for (const Identifier &id : pos)
+      out << id;
+    return out;
+  }
+
+  // Grows as identifiers are read, so a corrupted size can't make it
+  // allocate more than the stream contains. Deeper than any position can
+  // be, it is rejected as corrupted
+  friend QDataStream &operator>>(QDataStream &in, Position &pos) {
+    pos.clear();
+    quint32 n;
+    in >> n;
+    if (n > POSITION_MAX_DEPTH)
+      in.setStatus(QDataStream::ReadCorruptData);
+    for (quint32 i = 0; i < n && in.status() == QDataStream::Ok; i++) {
+      Identifier id;
+      in >> id;
+      pos.append(id);
+    }
+    if (in.status() != QDataStream::Ok)
+      pos.clear();
+    return in;
+  }
+
+private:
+  union {
+    Identifier m_inline[POSITION_INLINE_DEPTH];
+    Identifier *m_heap;
+  };
+  quint16 m_size;
+  quint16 m_capacity;
+
+  bool isHeap() const { return m_capacity > POSITION_INLINE_DEPTH; }
+
+  // Index of the first of the n levels at which a and b differ, n if none:
+  // identifiers are packed (digit, site) pairs, so equality is bitwise
+  static int firstMismatch(const Identifier *a, const Identifier *b, int n) {
+    int i = 0;
+#ifdef POSITION_SSE2
+    for (; i + 2 <= n; i += 2) {
+      __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+      __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+      int equal = _mm_movemask_epi8(_mm_cmpeq_epi32(va, vb));
+      if (equal != 0xFFFF)
+        return (equal & 0xFF) == 0xFF ? i + 1 : i;
+    }
+#endif
+    for (; i < n; i++) {
+      if (a[i].digit != b[i].digit || a[i].site != b[i].site)
+        return i;
+    }
+    return n;
+  }
+  Identifier *mutableData() { return isHeap() ? m_heap : m_inline; }
+
+  void assign(const Identifier *ids, int size) {
+    m_size = 0;
+    reserve(size);
+    std::copy(ids, ids + size, mutableData());
+    m_size = size;
+  }
+};
+
+#endif // POSITION_H
@@ -0,0 +1,114 @@
+#ifndef POSITION_TRIE_H
+#define POSITION_TRIE_H
+
+#include "position.h"
+#include <QVarLengthArray>
+#include <QVector>
+
+/*
+ * Positions stored as paths in a trie: neighbouring symbols, whose
+ * positions share all but the last few identifiers, share the nodes of the
+ * common prefix, so a deep position costs one node instead of one
+ * identifier per level. A position is referenced by the id of its last
+ * node; nodes are reference counted and recycled.
+ */
+class PositionTrie {
+public:
+  PositionTrie() { m_nodes.append(Node{Identifier(0, 0), 0, 0, 0, 0, 0}); }
+
+  // Adds a reference to the position, creating the missing nodes
+  quint32 intern(const Identifier *ids, int depth) {
+    quint32 node = 0; // Root: the empty position
+    for (int level = 0; level < depth; level++) {
+      quint32 child = m_nodes.at(node).firstChild;
+      while (child != 0 && !sameId(m_nodes.at(child).id, ids[level]))
+        child = m_nodes.at(child).nextSibling;
+      if (child == 0)
+        child = addChild(node, ids[level], level + 1);
+      node = child;
+    }
+    m_nodes[node].uses++;
+    return node;
+  }
+
+  // Drops a reference, freeing the nodes no longer used
+  void release(quint32 node) {
+    m_nodes[node].uses--;
+    while (node != 0 && m_nodes.at(node).uses == 0 &&
+           m_nodes.at(node).firstChild == 0) {
+      quint32 parent = m_nodes.at(node).parent;
+      unlink(parent, node);
+      m_free.append(node);
+      node = parent;
+    }
+  }
+
+  int depth(quint32 node) const { return m_nodes.at(node).depth; }
+
+  // Identifiers of the position, from the root
+  void path(quint32 node, Identifier *out) const {
+    for (int level = m_nodes.at(node).depth; level > 0; level--) {
+      out[level - 1] = m_nodes.at(node).id;
+      node = m_nodes.at(node).parent;
+    }
+  }
+
+  int compare(quint32 node, const Identifier *ids, int depth) const {
+    QVarLengthArray<Identifier, 32> buffer(m_nodes.at(node).depth);
+    path(node, buffer.data());
+    return Position::compare(buffer.constData(), buffer.size(), ids, depth);
+  }
+
+  qint64 memoryUsage() const {
+    return m_nodes.capacity() * sizeof(Node) +
+           m_free.capacity() * sizeof(quint32);
+  }
+
+  int nodes() const { return m_nodes.size() - m_free.size(); }
+
+private:
+  struct Node {
+    Identifier id;
+    quint32 parent;
+    quint32 firstChild; // 0 if none
+    quint32 nextSibling;
+    quint32 uses; // Positions ending at this node
+    quint32 depth;
+  };
+
+  QVector<Node> m_nodes; // 0 is the root
+  QVector<quint32> m_free;
+
+  static bool sameId(const Identifier &i1, const Identifier &i2) {
+    return i1.digit == i2.digit && i1.site == i2.site;
+  }
+
+  quint32 addChild(quint32 parent, const Identifier &id, int depth) {
+    Node node{id, parent, 0, m_nodes.at(parent).firstChild, 0,
+              static_cast<quint32>(depth)};
+    quint32 child;
+    if (m_free.isEmpty()) {
+      child = m_nodes.size();
+      m_nodes.append(node);
+    } else {
+      child = m_free.takeLast();
+      m_nodes[child] = node;
+    }
+    m_nodes[parent].firstChild = child;
+    return child;
+  }
+
+  void unlink(quint32 parent, quint32 node) {
+    quint32 next = m_nodes.at(node).nextSibling;
+    if (m_nodes.at(parent).firstChild == node) {
+      m_nodes[parent].firstChild = next;
+      return;
+    }
+    quint32 sibling = m_nodes.at(parent).firstChild;
+    while (m_nodes.at(sibling).nextSibling != node)
+      sibling = m_nodes.at(sibling).nextSibling;
+    m_nodes[sibling].nextSibling = next;
+  }
+};
+
+#endif // POSITION_TRIE_H
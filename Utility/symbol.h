@@ -1,63 +1,21 @@
 #ifndef SYMBOL_H
 #define SYMBOL_H
 
+#include "position.h"
+#include <QAtomicInteger>
+#include <QAtomicPointer>
 #include <QDebug>
 #include <QFont>
 #include <QJsonArray>
 #include <QJsonObject>
+#include <QMultiHash>
+#include <QReadWriteLock>
 #include <QTextCharFormat>
 #include <QVector>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-class Identifier {
-public:
-  int digit;
-  int site;
-
-public:
-  Identifier() {} // Empty constructor needed, otherwise compile error
-  Identifier(int digit, int site) : digit(digit), site(site) {}
-
-  static int compare(const Identifier &i1, const Identifier &i2) {
-    if (i1.digit < i2.digit) {
-      return -1;
-    } else if (i1.digit > i2.digit) {
-      return 1;
-    } else {
-      if (i1.site < i2.site) {
-        return -1;
-      } else if (i1.site > i2.site) {
-        return 1;
-      } else {
-        return 0;
-      }
-    }
-  }
-
-  QString to_string() {
-    return QString::number(digit) + "_" + QString::number(site);
-  }
-
-  QJsonObject toJson() {
-    QJsonObject json;
-    json["digit"] = digit;
-    json["site"] = site;
-    return json;
-  }
-
-  friend QDataStream &operator<<(QDataStream &out, const Identifier &id) {
-    out << id.digit << id.site;
-    return out;
-  }
-
-  friend QDataStream &operator>>(QDataStream &in, Identifier &id) {
-    id = Identifier();
-    in >> id.digit >> id.site;
-    return in;
-  }
-};
-
 class SymbolFormat {
 public:
   enum Alignment { ALIGN_LEFT, ALIGN_RIGHT, ALIGN_CENTER } align;
@@ -66,9 +24,11 @@ public:
   int size;
   QString color;
 
-  SymbolFormat() {}
+  SymbolFormat()
+      : align(ALIGN_LEFT), italic(false), bold(false), underline(false),
+        size(0) {}
 
-  QJsonObject toJson() {
+  QJsonObject toJson() const {
     QJsonObject json;
     json["italic"] = italic;
     json["bold"] = bold;
@@ -80,7 +40,7 @@ public:
     return json;
   }
 
-  static SymbolFormat fromJson(QJsonObject json) {
+  static SymbolFormat fromJson(const QJsonObject &json) {
     SymbolFormat format;
     format.italic = json["italic"].toBool();
     format.bold = json["bold"].toBool();
@@ -92,6 +52,36 @@ public:
     return format;
   }
 
+  // Content hash, used to look formats up in FormatTable
+  quint32 key() const {
+    quint32 h = 2166136261u; // FNV-1a
+    auto mix = [&h](quint32 v) {
+      for (int i = 0; i < 4; i++) {
+        h ^= (v >> (8 * i)) & 0xFF;
+        h *= 16777619u;
+      }
+    };
+    mix(align);
+    mix(italic | (bold << 1) | (underline << 2));
+    mix(size);
+    for (QChar c : font) {
+      mix(c.unicode());
+    }
+    mix(0);
+    for (QChar c : color) {
+      mix(c.unicode());
+    }
+    return h;
+  }
+
+  bool operator==(const SymbolFormat &other) const {
+    return align == other.align && italic == other.italic &&
+           bold == other.bold && underline == other.underline &&
+           size == other.size && font == other.font && color == other.color;
+  }
+
+  bool operator!=(const SymbolFormat &other) const { return !(*this == other); }
+
   QTextCharFormat getQTextCharFormat() const {
     QTextCharFormat format;
     QFont font;
@@ -139,75 +129,258 @@ public:
   }
 };
 
+// Entries per chunk of FormatTable, and the most chunks it can allocate
+#define FORMAT_TABLE_CHUNK 256
+#define FORMAT_TABLE_CHUNKS 4096
+
+/*
+ * Formats are shared by most symbols of a document: each distinct format is
+ * stored once per process, with the QTextCharFormat built from it, and
+ * symbols keep only its index.
+ *
+ * Entries live in chunks that are allocated once and never moved or freed,
+ * so reading an entry takes no lock: only interning and eviction do.
+ *
+ * Documents kept in memory (SymbolStore) hold a reference to each format
+ * they use. collect() evicts the formats nobody holds and their indexes are
+ * reused, so it must run where no other symbol refers to them: between the
+ * events of the thread handling the documents.
+ */
+class FormatTable {
+public:
+  static FormatTable &instance() {
+    static FormatTable table;
+    return table;
+  }
+
+  // False if the table is full: formats received must then be rejected
+  bool intern(const SymbolFormat &format, quint32 &result) {
+    quint32 key = format.key();
+    {
+      QReadLocker locker(&m_lock);
+      int id = find(format, key);
+      if (id >= 0) {
+        result = id;
+        return true;
+      }
+    }
+    QWriteLocker locker(&m_lock);
+    int id = find(format, key);
+    if (id >= 0) {
+      result = id;
+      return true;
+    }
+    if (!m_free.isEmpty()) {
+      id = m_free.takeLast();
+    } else {
+      if (m_next / FORMAT_TABLE_CHUNK >= FORMAT_TABLE_CHUNKS)
+        return false;
+      id = m_next++;
+      if (id % FORMAT_TABLE_CHUNK == 0)
+        m_chunks[id / FORMAT_TABLE_CHUNK].storeRelease(
+            new Entry[FORMAT_TABLE_CHUNK]);
+    }
+    Entry &entry = at(id);
+    entry.format = format;
+    entry.key = key;
+    entry.live = true;
+    m_byKey.insert(key, id);
+    m_live++;
+    result = id;
+    return true;
+  }
+
+  // For formats made locally: the default one if the table is full
+  quint32 intern(const SymbolFormat &format) {
+    quint32 id = 0;
+    intern(format, id);
+    return id;
+  }
+
+  const SymbolFormat &format(quint32 id) const { return at(id).format; }
+
+  // Built on first use, since the server never needs it
+  QTextCharFormat charFormat(quint32 id) {
+    Entry &entry = at(id);
+    if (!entry.hasCharFormat.loadAcquire()) {
+      QWriteLocker locker(&m_lock);
+      if (!entry.hasCharFormat.loadAcquire()) {
+        entry.charFormat = entry.format.getQTextCharFormat();
+        entry.hasCharFormat.storeRelease(1);
+      }
+    }
+    return entry.charFormat;
+  }
+
+  void retain(quint32 id) { at(id).refs.ref(); }
+  void release(quint32 id) { at(id).refs.deref(); }
+
+  // Evicts the formats without references, except the default one, and
+  // returns their ids
+  QVector<quint32> collect() {
+    QWriteLocker locker(&m_lock);
+    QVector<quint32> evicted;
+    for (quint32 id = 1; id < m_next; id++) {
+      Entry &entry = at(id);
+      if (!entry.live || entry.refs.load() != 0)
+        continue;
+      m_byKey.remove(entry.key, id);
+      entry.format = SymbolFormat();
+      entry.charFormat = QTextCharFormat();
+      entry.hasCharFormat.storeRelease(0);
+      entry.live = false;
+      m_free.append(id);
+      evicted.append(id);
+    }
+    m_live -= evicted.size();
+    return evicted;
+  }
+
+  int size() {
+    QReadLocker locker(&m_lock);
+    return m_live;
+  }
+
+private:
+  struct Entry {
+    SymbolFormat format;
+    quint32 key = 0;
+    QTextCharFormat charFormat;
+    QAtomicInt hasCharFormat;
+    QAtomicInt refs; // Held by documents
+    bool live = false;
+  };
+
+  QReadWriteLock m_lock; // For interning and eviction
+  QAtomicPointer<Entry> m_chunks[FORMAT_TABLE_CHUNKS];
+  quint32 m_next = 0; // Entries used so far, index 0 is the default format
+  QVector<quint32> m_free;
+  int m_live = 0;
+  QMultiHash<quint32, int> m_byKey;
+
+  FormatTable() { intern(SymbolFormat()); }
+  ~FormatTable() {
+    for (int c = 0; c < FORMAT_TABLE_CHUNKS; c++)
+      delete[] m_chunks[c].load();
+  }
+  Q_DISABLE_COPY(FormatTable)
+
+  Entry &at(quint32 id) const {
+    return m_chunks[id / FORMAT_TABLE_CHUNK]
+        .loadAcquire()[id % FORMAT_TABLE_CHUNK];
+  }
+
+  int find(const SymbolFormat &format, quint32 key) const {
+    for (auto it = m_byKey.find(key); it != m_byKey.end() && it.key() == key;
+         ++it) {
+      if (at(it.value()).format == format)
+        return it.value();
+    }
+    return -1;
+  }
+};
+
+// Identifier of the operation that inserted a symbol: site of the inserting
+// editor, which is the site of the last level of the position, and its
+// counter at the time
+typedef quint64 OpId;
+
+static inline OpId makeOpId(int site, int counter) {
+  return (static_cast<quint64>(static_cast<quint32>(site)) << 32) |
+         static_cast<quint32>(counter);
+}
+static inline int opIdSite(OpId id) { return static_cast<int>(id >> 32); }
+static inline int opIdCounter(OpId id) { return static_cast<int>(id); }
+
+// Counters grow with each site: the id with the highest counter of each
+// site tells which of its symbols were known, e.g. to the sender of a range
+static inline void addLastOpId(QVector<OpId> &last, OpId id) {
+  for (OpId &other : last) {
+    if (opIdSite(other) == opIdSite(id)) {
+      if (opIdCounter(id) > opIdCounter(other))
+        other = id;
+      return;
+    }
+  }
+  last.append(id);
+}
+static inline bool isKnownOpId(const QVector<OpId> &last, OpId id) {
+  for (OpId other : last) {
+    if (opIdSite(other) == opIdSite(id))
+      return opIdCounter(id) <= opIdCounter(other);
+  }
+  return false;
+}
+
 class Symbol {
 private:
   ushort value;
-  QVector<Identifier> position;
-  int counter; // Not used
-  SymbolFormat format;
+  Position position;
+  int counter;          // Per site, see OpId
+  quint32 formatId = 0; // Index in FormatTable
 
 public:
   Symbol() {} // Empty constructor needed, otherwise compile error
-  Symbol(ushort value, QVector<Identifier> position, int counter)
-      : value(value), position(position), counter(counter) {}
-  Symbol(ushort value, QVector<Identifier> position, int counter, QFont font,
-         QColor color)
-      : value(value), position(position), counter(counter) {
-    format.italic = font.italic();
-    format.bold = font.bold();
-    format.underline = font.underline();
-    format.size = font.pointSize();
-    format.font = font.family();
-    format.color = color.name();
+  // Positions are taken by value: callers done with theirs move them in
+  Symbol(ushort value, Position position, int counter)
+      : value(value), position(std::move(position)), counter(counter) {}
+  Symbol(ushort value, Position position, int counter, const QFont &font,
+         const QColor &color)
+      : value(value), position(std::move(position)), counter(counter) {
+    setFormat(font, color);
   }
 
-  Symbol(ushort value, QVector<Identifier> position, int counter,
-         SymbolFormat format)
-      : value(value), position(position), counter(counter), format(format) {}
+  Symbol(ushort value, Position position, int counter,
+         const SymbolFormat &format)
+      : value(value), position(std::move(position)), counter(counter),
+        formatId(FormatTable::instance().intern(format)) {}
 
   ushort getValue() const { return value; }
-  QVector<Identifier> getPosition() const { return position; }
+  QVector<Identifier> getPosition() const { return position.toVector(); }
+  // Without copying the identifiers
+  const Position &getPositionRef() const { return position; }
   int getCounter() const { return counter; }
+  OpId opId() const {
+    return makeOpId(position.isEmpty() ? 0 : position.last().site, counter);
+  }
+  const SymbolFormat &getFormat() const {
+    return FormatTable::instance().format(formatId);
+  }
+  quint32 getFormatId() const { return formatId; }
+  void setFormatId(quint32 id) { formatId = id; }
 
-  void setFormat(QFont font, QColor color) {
+  void setFormat(const QFont &font, const QColor &color) {
+    SymbolFormat format = getFormat();
     format.italic = font.italic();
     format.bold = font.bold();
     format.underline = font.underline();
     format.size = font.pointSize();
     format.font = font.family();
     format.color = color.name();
+    formatId = FormatTable::instance().intern(format);
   }
 
-  void setAlignment(SymbolFormat::Alignment a) { format.align = a; }
+  void setAlignment(SymbolFormat::Alignment a) {
+    if (getAlignment() == a)
+      return;
+    SymbolFormat format = getFormat();
+    format.align = a;
+    formatId = FormatTable::instance().intern(format);
+  }
 
-  int getUsername() { return this->position[this->position.size() - 1].site; }
+  int getUsername() const { return this->position.last().site; }
 
-  SymbolFormat::Alignment getAlignment() const { return format.align; }
+  SymbolFormat::Alignment getAlignment() const { return getFormat().align; }
 
   QTextCharFormat getQTextCharFormat() const {
-    return format.getQTextCharFormat();
+    return FormatTable::instance().charFormat(formatId);
   }
 
   static int compare(const Symbol &s1, const Symbol &s2) {
-    QVector<Identifier> p1 = s1.getPosition();
-    QVector<Identifier> p2 = s2.getPosition();
-
-    for (int i = 0; i < std::min(p1.size(), p2.size()); i++) {
-      int comp = Identifier::compare(p1[i], p2[i]);
-      if (comp != 0) {
-        return comp;
-      }
-    }
-    if (p1.size() < p2.size()) {
-      return -1;
-    } else if (p1.size() > p2.size()) {
-      return 1;
-    } else {
-      return 0;
-    }
+    return Position::compare(s1.position, s2.position);
   }
 
-  QString to_string() {
+  QString to_string() const {
     QString value_string;
     if (value == '\n')
       value_string = "NL";
@@ -219,7 +392,7 @@ public:
     QString result = value_string + "[";
     bool first = true;
 
-    for (Identifier i : position) {
+    for (const Identifier &i : position) {
       if (first) {
         first = false;
       } else {
@@ -231,11 +404,14 @@ public:
     return result;
   }
 
-  QString positionString() {
+  // Orders as compare, see Position::toKey
+  QByteArray positionKey() const { return position.toKey(); }
+
+  QString positionString() const {
     QString result = "[";
     bool first = true;
 
-    for (Identifier i : position) {
+    for (const Identifier &i : position) {
       if (first) {
         first = false;
       } else {
@@ -247,47 +423,50 @@ public:
     return result;
   }
 
-  QJsonObject toJson() {
+  QJsonObject toJson() const {
     QJsonObject json;
 
     json["value"] = QString(1, value);
     QJsonArray jsonArray;
-    for (Identifier i : position) {
+    for (const Identifier &i : position) {
       jsonArray.append(i.toJson());
     }
     json["position"] = jsonArray;
     json["counter"] = counter;
-    json["format"] = format.toJson();
+    json["format"] = getFormat().toJson();
 
     return json;
   }
 
-  static Symbol fromJson(QJsonObject json) {
+  static Symbol fromJson(const QJsonObject &json) {
     ushort value = json["value"].toString().at(0).unicode();
     int counter = json["counter"].toInt();
 
-    QVector<Identifier> position;
+    Position position;
     QJsonArray positionJson = json["position"].toArray();
     for (int i = 0; i < positionJson.size(); i++) {
       QJsonObject identifier = positionJson[i].toObject();
       int digit = identifier["digit"].toInt();
       int site = identifier["site"].toInt();
-      position.push_back(Identifier(digit, site));
+      position.append(Identifier(digit, site));
     }
 
     SymbolFormat format = SymbolFormat::fromJson(json["format"].toObject());
-    Symbol s(value, position, counter, format);
-    return s;
+    return Symbol(value, std::move(position), counter, format);
   }
 
   friend QDataStream &operator<<(QDataStream &out, const Symbol &symbol) {
-    out << symbol.value << symbol.position << symbol.counter << symbol.format;
+    out << symbol.value << symbol.position << symbol.counter
+        << symbol.getFormat();
     return out;
   }
 
   friend QDataStream &operator>>(QDataStream &in, Symbol &symbol) {
     symbol = Symbol();
-    in >> symbol.value >> symbol.position >> symbol.counter >> symbol.format;
+    SymbolFormat format;
+    in >> symbol.value >> symbol.position >> symbol.counter >> format;
+    if (!FormatTable::instance().intern(format, symbol.formatId))
+      in.setStatus(QDataStream::ReadCorruptData);
     return in;
   }
 };
@@ -0,0 +1,265 @@
+#ifndef SYMBOL_CODEC_H
+#define SYMBOL_CODEC_H
+
+#include "symbol.h"
+#include "varint.h"
+#include <QByteArray>
+#include <QDataStream>
+#include <QHash>
+#include <QVector>
+#include <QtEndian>
+
+/*
+ * Binary encoding of a vector of symbols, used for file snapshots and file
+ * chunks instead of QDataStream:
+ *   "SYM", quint8 version
+ *   varint count
+ *   varint number of formats, then the formats (see writeSymbolFormat)
+ *   count fixed-width records (little-endian):
+ *     quint16 value, quint16 depth, quint32 format index, qint32 counter
+ *   the positions of all the symbols, in order, each one relative to the
+ *   previous (see writePositionDelta)
+ * Records are decoded in bulk, each format is interned once per payload and
+ * positions up to POSITION_INLINE_DEPTH levels deep need no allocation.
+ * Version 1 payloads list every identifier of every position instead, as
+ * varint digit and varint site; payloads without the magic are decoded with
+ * QDataStream, as stored before the codec existed.
+ */
+#define SYMBOL_CODEC_MAGIC "SYM"
+#define SYMBOL_CODEC_VERSION 2
+#define SYMBOL_CODEC_HEADER 4
+#define SYMBOL_CODEC_RECORD 12
+
+static inline void writeCodecString(QByteArray &out, const QString &str) {
+  QByteArray utf8 = str.toUtf8();
+  writeVarint(out, utf8.size());
+  out.append(utf8);
+}
+
+static inline bool readCodecString(const char *&p, const char *end,
+                                   QString &str) {
+  quint64 len;
+  if (!readVarint(p, end, len) || len > static_cast<quint64>(end - p))
+    return false;
+  str = QString::fromUtf8(p, static_cast<int>(len));
+  p += len;
+  return true;
+}
+
+// Alignment, style bits, size, font and color
+static inline void writeSymbolFormat(QByteArray &out,
+                                     const SymbolFormat &format) {
+  out.append(static_cast<char>(format.align));
+  out.append(static_cast<char>(format.italic | (format.bold << 1) |
+                               (format.underline << 2)));
+  writeSignedVarint(out, format.size);
+  writeCodecString(out, format.font);
+  writeCodecString(out, format.color);
+}
+
+static inline bool readSymbolFormat(const char *&p, const char *end,
+                                    SymbolFormat &format) {
+  if (end - p < 2)
+    return false;
+  format.align = static_cast<SymbolFormat::Alignment>(*p++);
+  quint8 style = static_cast<quint8>(*p++);
+  format.italic = style & 1;
+  format.bold = style & 2;
+  format.underline = style & 4;
+  qint64 size;
+  if (!readSignedVarint(p, end, size) ||
+      !readCodecString(p, end, format.font) ||
+      !readCodecString(p, end, format.color))
+    return false;
+  format.size = static_cast<int>(size);
+  return true;
+}
+
+/*
+ * Position written relative to the previous one: varint length of the prefix
+ * they share, then the remaining identifiers (varint digit, varint site).
+ * Neighbouring symbols usually differ only in the last level, so most
+ * positions take a few bytes whatever their depth. Returns the prefix length.
+ */
+static inline int writePositionDelta(QByteArray &out, const Identifier *prev,
+                                     int prevDepth, const Identifier *ids,
+                                     int depth) {
+  int prefix = Position::commonPrefix(prev, prevDepth, ids, depth);
+  writeVarint(out, prefix);
+  for (int i = prefix; i < depth; i++) {
+    writeSignedVarint(out, ids[i].digit);
+    writeSignedVarint(out, ids[i].site);
+  }
+  return prefix;
+}
+
+// Appends identifiers to position until it is depth levels deep
+static inline bool readIdentifiers(const char *&p, const char *end, int depth,
+                                   Position &position) {
+  if (depth - position.size() > end - p)
+    return false;
+  position.reserve(depth);
+  while (position.size() < depth) {
+    qint64 digit, site;
+    if (!readSignedVarint(p, end, digit) || !readSignedVarint(p, end, site))
+      return false;
+    position.append(
+        Identifier(static_cast<int>(digit), static_cast<int>(site)));
+  }
+  return true;
+}
+
+// Turns position, holding the previous one, into the next one of depth levels
+static inline bool readPositionDelta(const char *&p, const char *end,
+                                     int depth, Position &position) {
+  quint64 prefix;
+  if (!readVarint(p, end, prefix) ||
+      prefix > static_cast<quint64>(qMin(position.size(), depth)))
+    return false;
+  position.truncate(static_cast<int>(prefix));
+  return readIdentifiers(p, end, depth, position);
+}
+
+class SymbolEncoder {
+public:
+  explicit SymbolEncoder(int capacity = 0) {
+    m_records.reserve(capacity * SYMBOL_CODEC_RECORD);
+    m_identifiers.reserve(capacity * 4);
+  }
+
+  void append(const Symbol &s) {
+    const Position &position = s.getPositionRef();
+    append(s.getValue(), s.getFormatId(), s.getCounter(), position.data(),
+           position.size());
+  }
+
+  // Symbol given field by field, formatId being its FormatTable index
+  void append(ushort value, quint32 formatId, qint32 counter,
+              const Identifier *position, int depth) {
+    auto index = m_indexes.constFind(formatId);
+    if (index == m_indexes.constEnd()) {
+      index = m_indexes.insert(formatId, m_indexes.size());
+      writeSymbolFormat(m_formats, FormatTable::instance().format(formatId));
+    }
+
+    uchar record[SYMBOL_CODEC_RECORD];
+    qToLittleEndian<quint16>(value, record);
+    qToLittleEndian<quint16>(static_cast<quint16>(depth), record + 2);
+    qToLittleEndian<quint32>(index.value(), record + 4);
+    qToLittleEndian<qint32>(counter, record + 8);
+    m_records.append(reinterpret_cast<const char *>(record),
+                     SYMBOL_CODEC_RECORD);
+
+    int prefix = writePositionDelta(m_identifiers, m_previous.data(),
+                                    m_previous.size(), position, depth);
+    m_previous.truncate(prefix);
+    for (int i = prefix; i < depth; i++)
+      m_previous.append(position[i]);
+    m_count++;
+  }
+
+  QByteArray data() const {
+    QByteArray out(SYMBOL_CODEC_MAGIC);
+    out.append(static_cast<char>(SYMBOL_CODEC_VERSION));
+    writeVarint(out, m_count);
+    writeVarint(out, m_indexes.size());
+    out.reserve(out.size() + m_formats.size() + m_records.size() +
+                m_identifiers.size());
+    out.append(m_formats);
+    out.append(m_records);
+    out.append(m_identifiers);
+    return out;
+  }
+
+private:
+  QHash<quint32, quint32> m_indexes; // FormatTable id to index in the payload
+  QByteArray m_formats;
+  QByteArray m_records;
+  QByteArray m_identifiers;
+  Position m_previous; // Of the last symbol appended
+  int m_count = 0;
+};
+
+// Container is any sequence of symbols (QVector, QList, or the values of a
+// QMap)
+template <typename Container>
+static inline QByteArray encodeSymbols(const Container &symbols) {
+  SymbolEncoder encoder(symbols.size());
+  for (const Symbol &s : symbols) {
+    encoder.append(s);
+  }
+  return encoder.data();
+}
+
+// Returns false on malformed input, leaving symbols empty
+static inline bool decodeSymbols(const QByteArray &data,
+                                 QVector<Symbol> &symbols) {
+  symbols.clear();
+  if (!data.startsWith(SYMBOL_CODEC_MAGIC)) {
+    QDataStream in(data);
+    in >> symbols;
+    if (in.status() != QDataStream::Ok) {
+      symbols.clear();
+      return false;
+    }
+    return true;
+  }
+  if (data.size() < SYMBOL_CODEC_HEADER)
+    return false;
+  quint8 version = static_cast<quint8>(data.at(3));
+  if (version != 1 && version != SYMBOL_CODEC_VERSION)
+    return false;
+
+  const char *p = data.constData() + SYMBOL_CODEC_HEADER;
+  const char *end = data.constData() + data.size();
+  quint64 count, nformats;
+  if (!readVarint(p, end, count) || !readVarint(p, end, nformats) ||
+      nformats > static_cast<quint64>(end - p))
+    return false;
+
+  QVector<quint32> formatIds;
+  formatIds.reserve(static_cast<int>(nformats));
+  for (quint64 i = 0; i < nformats; i++) {
+    SymbolFormat format;
+    quint32 id;
+    if (!readSymbolFormat(p, end, format) ||
+        !FormatTable::instance().intern(format, id))
+      return false;
+    formatIds.append(id);
+  }
+
+  if (count > static_cast<quint64>(end - p) / SYMBOL_CODEC_RECORD)
+    return false;
+  const uchar *record = reinterpret_cast<const uchar *>(p);
+  p += count * SYMBOL_CODEC_RECORD;
+
+  symbols.resize(static_cast<int>(count));
+  Position position;
+  for (int i = 0; i < symbols.size(); i++, record += SYMBOL_CODEC_RECORD) {
+    quint16 depth = qFromLittleEndian<quint16>(record + 2);
+    quint32 format = qFromLittleEndian<quint32>(record + 4);
+    if (format >= nformats) {
+      symbols.clear();
+      return false;
+    }
+    bool valid;
+    if (version == 1) {
+      position.clear(); // Every identifier is listed
+      valid = readIdentifiers(p, end, depth, position);
+    } else {
+      valid = readPositionDelta(p, end, depth, position);
+    }
+    if (!valid) {
+      symbols.clear();
+      return false;
+    }
+
+    Symbol &s = symbols[i];
+    s = Symbol(qFromLittleEndian<quint16>(record), position,
+               qFromLittleEndian<qint32>(record + 8));
+    s.setFormatId(formatIds.at(format));
+  }
+  return true;
+}
+
+#endif // SYMBOL_CODEC_H
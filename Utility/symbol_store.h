@@ -0,0 +1,466 @@
+#ifndef SYMBOL_STORE_H
+#define SYMBOL_STORE_H
+
+#include "position_trie.h"
+#include "symbol.h"
+#include "symbol_codec.h"
+#include <QByteArray>
+#include <QHash>
+#include <QVarLengthArray>
+#include <QVector>
+
+// Symbols per block of a SymbolStore: an insertion or a removal moves at
+// most this many entries
+#define SYMBOL_STORE_BLOCK 1024
+
+/*
+ * Symbols of a document in CRDT order, stored as a structure of arrays:
+ * values, format ids, counters and positions are kept in separate
+ * contiguous arrays, split in blocks of at most SYMBOL_STORE_BLOCK entries,
+ * and the identifiers of all the positions live in a single arena,
+ * referenced by offset and depth. Searches touch only the positions, scans
+ * and encoding only the fields they need. The arena is compacted, in
+ * document order, once most of it belongs to removed symbols.
+ *
+ * With shared prefixes the positions are kept in a PositionTrie instead of
+ * the arena, and offsets are trie nodes: deep positions, whose neighbours
+ * differ only in the last identifiers, take one node each instead of one
+ * identifier per level, at the cost of rebuilding them to compare.
+ *
+ * Symbols are indexed by OpId, pointing to their position in the arena or
+ * the trie, for the operations referencing them by id.
+ */
+class SymbolStore {
+public:
+  explicit SymbolStore(bool sharedPrefixes = false)
+      : m_shared(sharedPrefixes) {}
+  ~SymbolStore() { releaseFormats(); }
+
+  bool sharedPrefixes() const { return m_shared; }
+  int size() const { return m_size; }
+  bool isEmpty() const { return m_size == 0; }
+
+  // Inserts s, or replaces the symbol at the same position
+  void insert(const Symbol &s) {
+    const Position &position = s.getPositionRef();
+    int b, i;
+    if (locate(position.data(), position.size(), b, i)) {
+      Block &block = m_blocks[b];
+      block.values[i] = s.getValue();
+      FormatTable::instance().retain(s.getFormatId());
+      FormatTable::instance().release(block.formats.at(i));
+      block.formats[i] = s.getFormatId();
+      if (block.counters.at(i) != s.getCounter()) {
+        OpId old = makeOpId(siteOf(position), block.counters.at(i));
+        block.counters[i] = s.getCounter();
+        removeId(old);
+        addId(s.opId(), reference(block, i));
+      }
+      return;
+    }
+
+    if (m_blocks.isEmpty())
+      m_blocks.append(Block());
+    Block &block = m_blocks[b];
+    block.values.insert(i, s.getValue());
+    block.formats.insert(i, s.getFormatId());
+    FormatTable::instance().retain(s.getFormatId());
+    block.counters.insert(i, s.getCounter());
+    block.offsets.insert(i, storePosition(position.data(), position.size()));
+    block.depths.insert(i, static_cast<quint16>(position.size()));
+    addId(s.opId(), reference(block, i));
+    m_size++;
+    if (block.size() > SYMBOL_STORE_BLOCK)
+      split(b);
+  }
+
+  // Appends s, which must follow all the symbols already stored
+  void append(const Symbol &s) {
+    if (m_blocks.isEmpty() || m_blocks.last().size() >= SYMBOL_STORE_BLOCK)
+      m_blocks.append(Block());
+    const Position &position = s.getPositionRef();
+    Block &block = m_blocks.last();
+    block.values.append(s.getValue());
+    block.formats.append(s.getFormatId());
+    FormatTable::instance().retain(s.getFormatId());
+    block.counters.append(s.getCounter());
+    block.offsets.append(storePosition(position.data(), position.size()));
+    block.depths.append(static_cast<quint16>(position.size()));
+    addId(s.opId(), reference(block, block.size() - 1));
+    m_size++;
+  }
+
+  bool remove(const Position &position) {
+    int b, i;
+    if (!locate(position.data(), position.size(), b, i))
+      return false;
+
+    Block &block = m_blocks[b];
+    OpId id = makeOpId(siteOf(position), block.counters.at(i));
+    if (m_shared)
+      m_trie.release(block.offsets.at(i));
+    else
+      m_garbage += block.depths.at(i);
+    FormatTable::instance().release(block.formats.at(i));
+    block.values.remove(i);
+    block.formats.remove(i);
+    block.counters.remove(i);
+    block.offsets.remove(i);
+    block.depths.remove(i);
+    m_size--;
+    if (block.size() == 0)
+      m_blocks.remove(b);
+    removeId(id);
+    if (m_garbage > SYMBOL_STORE_BLOCK && m_garbage > m_arena.size() / 2)
+      compact();
+    return true;
+  }
+
+  // Removes the symbols from first to last, both included, seen by the
+  // sender of a DELETE_RANGE: of a site in seen, with a counter not above
+  // its own. The others were inserted concurrently and are kept. Appends
+  // the symbols removed to removed, if not null, and returns their number
+  int removeRange(const Position &first, const Position &last,
+                  const QVector<OpId> &seen, QVector<Symbol> *removed) {
+    int b, i;
+    locate(first.data(), first.size(), b, i);
+    QVector<OpId> ids;
+    bool end = false;
+    while (!end && b < m_blocks.size()) {
+      Block &block = m_blocks[b];
+      int kept = i; // Entries are moved back over the removed ones
+      for (; i < block.size(); i++) {
+        if (compareAt(block, i, last.data(), last.size()) > 0) {
+          end = true;
+          break;
+        }
+        OpId id = makeOpId(lastSite(block, i), block.counters.at(i));
+        if (!isKnownOpId(seen, id)) {
+          moveEntry(block, i, kept++);
+          continue;
+        }
+        if (removed != nullptr)
+          removed->append(symbolAt(block, i));
+        if (m_shared)
+          m_trie.release(block.offsets.at(i));
+        else
+          m_garbage += block.depths.at(i);
+        FormatTable::instance().release(block.formats.at(i));
+        ids.append(id);
+      }
+      int size = kept + block.size() - i;
+      for (; i < block.size(); i++)
+        moveEntry(block, i, kept++);
+      block.values.resize(size);
+      block.formats.resize(size);
+      block.counters.resize(size);
+      block.offsets.resize(size);
+      block.depths.resize(size);
+      if (size == 0)
+        m_blocks.remove(b);
+      else
+        b++;
+      i = 0;
+    }
+
+    m_size -= ids.size();
+    for (OpId id : ids)
+      removeId(id);
+    if (m_garbage > SYMBOL_STORE_BLOCK && m_garbage > m_arena.size() / 2)
+      compact();
+    return ids.size();
+  }
+
+  bool contains(const Position &position) const {
+    int b, i;
+    return locate(position.data(), position.size(), b, i);
+  }
+
+  // The symbol with the given id, false if none or more than one
+  bool findById(OpId id, Symbol &s) const {
+    if (m_duplicates.contains(id))
+      return false;
+    auto it = m_ids.constFind(id);
+    if (it == m_ids.constEnd())
+      return false;
+    int depth = static_cast<int>(it.value() >> 32);
+    quint32 offset = static_cast<quint32>(it.value());
+    QVarLengthArray<Identifier, 32> path(depth);
+    const Identifier *ids = m_arena.constData() + offset;
+    if (m_shared) {
+      m_trie.path(offset, path.data());
+      ids = path.constData();
+    }
+    int b, i;
+    if (!locate(ids, depth, b, i))
+      return false;
+    s = symbolAt(m_blocks.at(b), i);
+    return true;
+  }
+
+  // Whether more than one symbol holds the id
+  bool isAmbiguous(OpId id) const { return m_duplicates.contains(id); }
+
+  void clear() {
+    releaseFormats();
+    m_blocks.clear();
+    m_arena.clear();
+    m_ids.clear();
+    m_duplicates.clear();
+    m_trie = PositionTrie();
+    m_size = 0;
+    m_garbage = 0;
+  }
+
+  // Calls f(value, formatId, counter, identifiers, depth) for every symbol,
+  // in document order
+  template <typename F> void forEach(F f) const {
+    const Identifier *arena = m_arena.constData();
+    QVarLengthArray<Identifier, 32> path;
+    for (const Block &block : m_blocks) {
+      for (int i = 0; i < block.size(); i++) {
+        int depth = block.depths.at(i);
+        const Identifier *ids = arena + block.offsets.at(i);
+        if (m_shared) {
+          path.resize(depth);
+          m_trie.path(block.offsets.at(i), path.data());
+          ids = path.constData();
+        }
+        f(block.values.at(i), block.formats.at(i), block.counters.at(i), ids,
+          depth);
+      }
+    }
+  }
+
+  QVector<Symbol> toVector() const {
+    QVector<Symbol> symbols;
+    symbols.reserve(m_size);
+    forEach([&symbols](ushort value, quint32 formatId, qint32 counter,
+                       const Identifier *ids, int depth) {
+      symbols.append(Symbol(value, Position(ids, depth), counter));
+      symbols.last().setFormatId(formatId);
+    });
+    return symbols;
+  }
+
+  // Same payload as encodeSymbols(toVector()), without the symbols
+  QByteArray encode() const {
+    SymbolEncoder encoder(m_size);
+    forEach([&encoder](ushort value, quint32 formatId, qint32 counter,
+                       const Identifier *ids, int depth) {
+      encoder.append(value, formatId, counter, ids, depth);
+    });
+    return encoder.data();
+  }
+
+  // Bytes allocated for the symbols
+  qint64 memoryUsage() const {
+    qint64 bytes = m_blocks.capacity() * sizeof(Block) +
+                   m_arena.capacity() * sizeof(Identifier) +
+                   (m_shared ? m_trie.memoryUsage() : 0) +
+                   // Approximately, for the hash nodes
+                   m_ids.capacity() * (sizeof(OpId) + sizeof(quint64) +
+                                       2 * sizeof(void *));
+    for (const Block &block : m_blocks) {
+      bytes += block.values.capacity() * sizeof(ushort) +
+               block.formats.capacity() * sizeof(quint32) +
+               block.counters.capacity() * sizeof(qint32) +
+               block.offsets.capacity() * sizeof(quint32) +
+               block.depths.capacity() * sizeof(quint16);
+    }
+    return bytes;
+  }
+
+private:
+  Q_DISABLE_COPY(SymbolStore)
+
+  struct Block {
+    QVector<ushort> values;
+    QVector<quint32> formats; // FormatTable ids
+    QVector<qint32> counters;
+    QVector<quint32> offsets; // Of the positions in the arena
+    QVector<quint16> depths;
+
+    int size() const { return values.size(); }
+  };
+
+  QVector<Block> m_blocks; // Never empty
+  QVector<Identifier> m_arena;
+  PositionTrie m_trie; // Used instead of the arena with shared prefixes
+  bool m_shared;
+  int m_size = 0;
+  int m_garbage = 0; // Identifiers of removed symbols, still in the arena
+  QHash<OpId, quint64> m_ids;    // Depth << 32 | offset of each symbol
+  QHash<OpId, int> m_duplicates; // Symbols beyond the first, by id
+
+  quint64 reference(const Block &block, int i) const {
+    return static_cast<quint64>(block.depths.at(i)) << 32 | block.offsets.at(i);
+  }
+
+  void addId(OpId id, quint64 ref) {
+    if (m_ids.contains(id))
+      m_duplicates[id]++;
+    else
+      m_ids.insert(id, ref);
+  }
+
+  // After removing the symbol
+  void removeId(OpId id) {
+    auto it = m_duplicates.find(id);
+    if (it == m_duplicates.end()) {
+      m_ids.remove(id);
+      return;
+    }
+    if (--it.value() > 0)
+      return;
+    // The position of the one left is not known: rare enough to search it
+    m_duplicates.erase(it);
+    for (const Block &block : m_blocks) {
+      for (int i = 0; i < block.size(); i++) {
+        if (block.counters.at(i) == opIdCounter(id) &&
+            lastSite(block, i) == opIdSite(id)) {
+          m_ids.insert(id, reference(block, i));
+          return;
+        }
+      }
+    }
+  }
+
+  Symbol symbolAt(const Block &block, int i) const {
+    QVarLengthArray<Identifier, 32> path(block.depths.at(i));
+    const Identifier *ids = m_arena.constData() + block.offsets.at(i);
+    if (m_shared) {
+      m_trie.path(block.offsets.at(i), path.data());
+      ids = path.constData();
+    }
+    Symbol s(block.values.at(i), Position(ids, block.depths.at(i)),
+             block.counters.at(i));
+    s.setFormatId(block.formats.at(i));
+    return s;
+  }
+
+  // The references held on the formats used
+  void releaseFormats() {
+    for (const Block &block : m_blocks) {
+      for (quint32 id : block.formats)
+        FormatTable::instance().release(id);
+    }
+  }
+
+  static void moveEntry(Block &block, int from, int to) {
+    if (from == to)
+      return;
+    block.values[to] = block.values.at(from);
+    block.formats[to] = block.formats.at(from);
+    block.counters[to] = block.counters.at(from);
+    block.offsets[to] = block.offsets.at(from);
+    block.depths[to] = block.depths.at(from);
+  }
+
+  static int siteOf(const Position &position) {
+    return position.isEmpty() ? 0 : position.last().site;
+  }
+
+  int lastSite(const Block &block, int i) const {
+    int depth = block.depths.at(i);
+    if (depth == 0)
+      return 0;
+    if (!m_shared)
+      return m_arena.at(block.offsets.at(i) + depth - 1).site;
+    QVarLengthArray<Identifier, 32> path(depth);
+    m_trie.path(block.offsets.at(i), path.data());
+    return path.last().site;
+  }
+
+  int compareAt(const Block &block, int i, const Identifier *ids,
+                int depth) const {
+    if (m_shared)
+      return m_trie.compare(block.offsets.at(i), ids, depth);
+    return Position::compare(m_arena.constData() + block.offsets.at(i),
+                             block.depths.at(i), ids, depth);
+  }
+
+  // Finds the block b and the index i in it of the symbol at the given
+  // position, or where it should be inserted
+  bool locate(const Identifier *ids, int depth, int &b, int &i) const {
+    b = i = 0;
+    if (m_blocks.isEmpty())
+      return false;
+
+    int lo = 0, hi = m_blocks.size() - 1;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      const Block &block = m_blocks.at(mid);
+      if (compareAt(block, block.size() - 1, ids, depth) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    b = lo;
+
+    const Block &block = m_blocks.at(b);
+    lo = 0;
+    hi = block.size();
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (compareAt(block, mid, ids, depth) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    i = lo;
+    return i < block.size() && compareAt(block, i, ids, depth) == 0;
+  }
+
+  quint32 storePosition(const Identifier *ids, int depth) {
+    if (m_shared)
+      return m_trie.intern(ids, depth);
+    quint32 offset = m_arena.size();
+    for (int i = 0; i < depth; i++)
+      m_arena.append(ids[i]);
+    return offset;
+  }
+
+  void split(int b) {
+    Block &block = m_blocks[b];
+    int half = block.size() / 2;
+    Block tail;
+    tail.values = block.values.mid(half);
+    tail.formats = block.formats.mid(half);
+    tail.counters = block.counters.mid(half);
+    tail.offsets = block.offsets.mid(half);
+    tail.depths = block.depths.mid(half);
+    block.values.resize(half);
+    block.formats.resize(half);
+    block.counters.resize(half);
+    block.offsets.resize(half);
+    block.depths.resize(half);
+    m_blocks.insert(b + 1, tail);
+  }
+
+  void compact() {
+    QVector<Identifier> arena;
+    arena.reserve(m_arena.size() - m_garbage);
+    for (Block &block : m_blocks) {
+      for (int i = 0; i < block.size(); i++) {
+        const Identifier *ids = m_arena.constData() + block.offsets.at(i);
+        block.offsets[i] = arena.size();
+        for (int level = 0; level < block.depths.at(i); level++)
+          arena.append(ids[level]);
+      }
+    }
+    m_arena.swap(arena);
+    m_garbage = 0;
+
+    // Offsets changed
+    m_ids.clear();
+    m_duplicates.clear();
+    for (const Block &block : m_blocks) {
+      for (int i = 0; i < block.size(); i++)
+        addId(makeOpId(lastSite(block, i), block.counters.at(i)),
+              reference(block, i));
+    }
+  }
+};
+
+#endif // SYMBOL_STORE_H
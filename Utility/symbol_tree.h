@@ -0,0 +1,525 @@
+#ifndef SYMBOL_TREE_H
+#define SYMBOL_TREE_H
+
+#include "symbol.h"
+#include <QHash>
+#include <QVarLengthArray>
+#include <QVector>
+
+// Symbols per leaf and children per inner node of a SymbolTree, at most
+#define SYMBOL_TREE_LEAF 64
+#define SYMBOL_TREE_FANOUT 32
+
+/*
+ * Symbols of a document in CRDT order, as a B+tree counting in every node
+ * the symbols and the '\n' below it: symbols are addressed by their index
+ * in the document, lines by the newlines preceding them, and insertions,
+ * removals, (line, index) conversions and CRDT order searches all take
+ * O(log n), whatever the length of the lines. Splitting or joining a line
+ * is just inserting or removing its '\n'.
+ *
+ * Symbols are also indexed by OpId, pointing to their leaf: an id is
+ * turned into an index by scanning the leaf and adding up the counts of the
+ * nodes on the left of the path to the root, without comparing positions.
+ * Ids held by more than one symbol (e.g. inserted by the same user from two
+ * sessions) are counted as duplicates, and not resolved.
+ */
+class SymbolTree {
+public:
+  SymbolTree() : m_root(new Node(true)) {}
+  ~SymbolTree() { destroy(m_root); }
+
+  int size() const { return m_root->count; }
+  // Lines are terminated by '\n', the last one by the end of the document
+  int lineCount() const { return m_root->newlines + 1; }
+
+  const Symbol &at(int i) const { return leafAt(i, i)->symbols.at(i); }
+  // The value and the id of the symbol must not change: use replace for that
+  Symbol &at(int i) {
+    Node *leaf = leafAt(i, i);
+    return leaf->symbols[i];
+  }
+
+  void insert(int i, const Symbol &s) { insert(i, &s, 1); }
+
+  // Inserts the n symbols of run before the symbol at index i, in a single
+  // descent: the leaf takes them all, then is split in as many leaves as
+  // needed, and so are its ancestors
+  void insert(int i, const Symbol *run, int n) {
+    if (n <= 0)
+      return;
+    int newlines = 0;
+    for (int k = 0; k < n; k++) {
+      if (isNewline(run[k]))
+        newlines++;
+    }
+    QVector<Node *> siblings;
+    insert(m_root, i, run, n, newlines, siblings);
+    while (!siblings.isEmpty()) {
+      Node *root = new Node(false);
+      root->children.append(m_root);
+      root->children.append(siblings);
+      for (Node *child : root->children)
+        child->parent = root;
+      recount(root);
+      m_root = root;
+      siblings.clear();
+      split(root, siblings);
+    }
+  }
+
+  void remove(int i) { remove(i, 1); }
+
+  // Removes the n symbols from index i, dropping the subtrees entirely in
+  // the range without visiting their leaves but to unindex them
+  void remove(int i, int n) {
+    if (n <= 0)
+      return;
+    remove(m_root, i, n);
+    if (m_root->count == 0) {
+      destroy(m_root);
+      m_root = new Node(true);
+    }
+    while (!m_root->leaf && m_root->children.size() == 1) {
+      Node *child = m_root->children.first();
+      m_root->children.clear();
+      delete m_root;
+      m_root = child;
+      m_root->parent = nullptr;
+    }
+  }
+
+  void replace(int i, const Symbol &s) {
+    const Symbol &old = at(i);
+    if (isNewline(old) == isNewline(s) && old.opId() == s.opId()) {
+      at(i) = s;
+    } else {
+      remove(i);
+      insert(i, s);
+    }
+  }
+
+  void clear() {
+    destroy(m_root);
+    m_root = new Node(true);
+    m_ids.clear();
+    m_duplicates.clear();
+  }
+
+  // Index of the first symbol of line, size() past the last line
+  int lineStart(int line) const {
+    if (line <= 0)
+      return 0;
+    if (line > m_root->newlines)
+      return size();
+    int k = line - 1; // Newlines to skip
+    int offset = 0;
+    const Node *node = m_root;
+    while (!node->leaf) {
+      for (const Node *child : node->children) {
+        if (k < child->newlines) {
+          node = child;
+          break;
+        }
+        k -= child->newlines;
+        offset += child->count;
+      }
+    }
+    for (int i = 0;; i++) {
+      if (isNewline(node->symbols.at(i)) && k-- == 0)
+        return offset + i + 1;
+    }
+  }
+
+  int lineSize(int line) const { return lineStart(line + 1) - lineStart(line); }
+
+  // Line of the symbol at index i, i.e. newlines preceding it
+  int lineOf(int i) const {
+    int newlines = 0;
+    const Node *node = m_root;
+    while (!node->leaf) {
+      for (const Node *child : node->children) {
+        if (i < child->count || child == node->children.last()) {
+          node = child;
+          break;
+        }
+        i -= child->count;
+        newlines += child->newlines;
+      }
+    }
+    for (int j = 0; j < i && j < node->symbols.size(); j++) {
+      if (isNewline(node->symbols.at(j)))
+        newlines++;
+    }
+    return newlines;
+  }
+
+  // Index of the first symbol not preceding s in CRDT order
+  int lowerBound(const Symbol &s) const {
+    int offset = 0;
+    const Node *node = m_root;
+    while (!node->leaf) {
+      const QVector<Node *> &children = node->children;
+      int lo = 0, hi = children.size() - 1;
+      while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (Symbol::compare(last(children.at(mid)), s) < 0)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      for (int c = 0; c < lo; c++)
+        offset += children.at(c)->count;
+      node = children.at(lo);
+    }
+    const QVector<Symbol> &symbols = node->symbols;
+    int lo = 0, hi = symbols.size();
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (Symbol::compare(symbols.at(mid), s) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return offset + lo;
+  }
+
+  // Index of the symbol with the given id, -1 if none or more than one
+  int indexOf(OpId id) const {
+    if (m_duplicates.contains(id))
+      return -1;
+    const Node *node = m_ids.value(id);
+    if (node == nullptr)
+      return -1;
+    int offset = 0;
+    while (node->symbols.at(offset).opId() != id)
+      offset++;
+    for (; node->parent != nullptr; node = node->parent) {
+      for (const Node *child : node->parent->children) {
+        if (child == node)
+          break;
+        offset += child->count;
+      }
+    }
+    return offset;
+  }
+
+  bool hasDuplicates() const { return !m_duplicates.isEmpty(); }
+
+  // Whether exactly one symbol has the given id
+  bool isUnique(OpId id) const {
+    return m_ids.contains(id) && !m_duplicates.contains(id);
+  }
+
+  // Calls f(symbol) for every symbol, in document order
+  template <typename F> void forEach(F f) const { forEach(m_root, f); }
+
+  // Calls f(symbol) for the symbols from index i on, while it returns true
+  template <typename F> void forEachFrom(int i, F f) const {
+    forEachFrom(m_root, i, f);
+  }
+
+private:
+  struct Node {
+    explicit Node(bool leaf) : leaf(leaf) {}
+    bool leaf;
+    int count = 0;    // Symbols in the subtree
+    int newlines = 0; // '\n' in the subtree
+    Node *parent = nullptr;
+    QVector<Symbol> symbols; // Leaves only
+    QVector<Node *> children; // Inner nodes only
+  };
+
+  Node *m_root;
+  QHash<OpId, Node *> m_ids;     // Leaf of each symbol
+  QHash<OpId, int> m_duplicates; // Symbols beyond the first, by id
+
+  Q_DISABLE_COPY(SymbolTree)
+
+  static bool isNewline(const Symbol &s) { return s.getValue() == '\n'; }
+
+  static void destroy(Node *node) {
+    for (Node *child : node->children)
+      destroy(child);
+    delete node;
+  }
+
+  // Leaf holding the symbol at index i, i becoming its index in the leaf
+  Node *leafAt(int i, int &index) const {
+    Node *node = m_root;
+    while (!node->leaf) {
+      for (Node *child : node->children) {
+        if (i < child->count) {
+          node = child;
+          break;
+        }
+        i -= child->count;
+      }
+    }
+    index = i;
+    return node;
+  }
+
+  void addId(OpId id, Node *leaf) {
+    if (m_ids.contains(id))
+      m_duplicates[id]++;
+    else
+      m_ids.insert(id, leaf);
+  }
+
+  // After removing the symbol from its leaf
+  void removeId(OpId id) {
+    auto it = m_duplicates.find(id);
+    if (it == m_duplicates.end()) {
+      m_ids.remove(id);
+    } else if (--it.value() == 0) {
+      // The leaf of the one left is not known: rare enough to search it
+      m_duplicates.erase(it);
+      m_ids.insert(id, findLeaf(m_root, id));
+    }
+  }
+
+  // The symbols moved from one leaf to another
+  void moved(const QVector<Symbol> &symbols, const Node *from, Node *to) {
+    for (const Symbol &s : symbols) {
+      auto it = m_ids.find(s.opId());
+      if (it != m_ids.end() && it.value() == from)
+        it.value() = to;
+    }
+  }
+
+  static Node *findLeaf(Node *node, OpId id) {
+    if (node->leaf) {
+      for (const Symbol &s : node->symbols) {
+        if (s.opId() == id)
+          return node;
+      }
+      return nullptr;
+    }
+    for (Node *child : node->children) {
+      if (Node *leaf = findLeaf(child, id))
+        return leaf;
+    }
+    return nullptr;
+  }
+
+  static const Symbol &last(const Node *node) {
+    while (!node->leaf)
+      node = node->children.last();
+    return node->symbols.last();
+  }
+
+  static void recount(Node *node) {
+    node->count = node->newlines = 0;
+    if (node->leaf) {
+      node->count = node->symbols.size();
+      for (const Symbol &s : node->symbols) {
+        if (isNewline(s))
+          node->newlines++;
+      }
+    } else {
+      for (const Node *child : node->children) {
+        node->count += child->count;
+        node->newlines += child->newlines;
+      }
+    }
+  }
+
+  // Appends to siblings the new right siblings of node, if it overflowed
+  void insert(Node *node, int i, const Symbol *run, int n, int newlines,
+              QVector<Node *> &siblings) {
+    node->count += n;
+    node->newlines += newlines;
+
+    if (node->leaf) {
+      QVector<Symbol> &symbols = node->symbols;
+      if (n == 1) {
+        symbols.insert(i, run[0]);
+      } else {
+        QVector<Symbol> spliced;
+        spliced.reserve(symbols.size() + n);
+        for (int k = 0; k < i; k++)
+          spliced.append(symbols.at(k));
+        for (int k = 0; k < n; k++)
+          spliced.append(run[k]);
+        for (int k = i; k < symbols.size(); k++)
+          spliced.append(symbols.at(k));
+        symbols.swap(spliced);
+      }
+      for (int k = 0; k < n; k++)
+        addId(run[k].opId(), node);
+      split(node, siblings);
+      return;
+    }
+
+    int c = 0;
+    while (c < node->children.size() - 1 && i > node->children.at(c)->count) {
+      i -= node->children.at(c)->count;
+      c++;
+    }
+    QVector<Node *> added;
+    insert(node->children.at(c), i, run, n, newlines, added);
+    if (added.isEmpty())
+      return;
+    for (Node *child : added)
+      child->parent = node;
+    if (added.size() == 1) {
+      node->children.insert(c + 1, added.first());
+    } else {
+      QVector<Node *> children = node->children.mid(0, c + 1);
+      children.append(added);
+      children.append(node->children.mid(c + 1));
+      node->children.swap(children);
+    }
+    split(node, siblings);
+  }
+
+  // Splits node, if too big, in nodes at least half full: node keeps the
+  // first part, the others are appended to siblings
+  void split(Node *node, QVector<Node *> &siblings) {
+    int size = node->leaf ? node->symbols.size() : node->children.size();
+    int max = node->leaf ? SYMBOL_TREE_LEAF : SYMBOL_TREE_FANOUT;
+    if (size <= max)
+      return;
+    int parts = (size + max - 1) / max;
+    for (int p = 1; p < parts; p++) {
+      int from = static_cast<int>(qint64(size) * p / parts);
+      int to = static_cast<int>(qint64(size) * (p + 1) / parts);
+      Node *sibling = new Node(node->leaf);
+      if (node->leaf) {
+        sibling->symbols = node->symbols.mid(from, to - from);
+        moved(sibling->symbols, node, sibling);
+      } else {
+        sibling->children = node->children.mid(from, to - from);
+        for (Node *child : sibling->children)
+          child->parent = sibling;
+      }
+      recount(sibling);
+      siblings.append(sibling);
+    }
+    int first = size / parts;
+    if (node->leaf)
+      node->symbols.resize(first);
+    else
+      node->children.resize(first);
+    recount(node);
+  }
+
+  void remove(Node *node, int i, int n) {
+    node->count -= n;
+    if (node->leaf) {
+      QVarLengthArray<OpId, SYMBOL_TREE_LEAF> ids;
+      for (int k = i; k < i + n; k++) {
+        const Symbol &s = node->symbols.at(k);
+        if (isNewline(s))
+          node->newlines--;
+        ids.append(s.opId());
+      }
+      node->symbols.remove(i, n);
+      for (OpId id : ids)
+        removeId(id);
+      return;
+    }
+
+    int c = 0;
+    while (i >= node->children.at(c)->count) {
+      i -= node->children.at(c)->count;
+      c++;
+    }
+    int first = c;
+    while (n > 0) {
+      Node *child = node->children.at(c);
+      int k = qMin(n, child->count - i);
+      node->newlines -= child->newlines;
+      if (k == child->count) {
+        // Emptied children are dropped
+        node->children.remove(c);
+        removeIds(child);
+        destroy(child);
+      } else {
+        remove(child, i, k);
+        node->newlines += child->newlines;
+        c++;
+      }
+      n -= k;
+      i = 0;
+    }
+
+    // Small children left at the ends of the range merged with a neighbour
+    for (int m = qMax(first - 1, 0);
+         m <= first + 1 && m + 1 < node->children.size();) {
+      int children = node->children.size();
+      merge(node, m);
+      if (node->children.size() == children)
+        m++;
+    }
+  }
+
+  // After detaching node from the tree
+  void removeIds(const Node *node) {
+    if (node->leaf) {
+      for (const Symbol &s : node->symbols)
+        removeId(s.opId());
+      return;
+    }
+    for (const Node *child : node->children)
+      removeIds(child);
+  }
+
+  // Merges the children c and c + 1 of node if they fit in one
+  void merge(Node *node, int c) {
+    Node *left = node->children.at(c);
+    Node *right = node->children.at(c + 1);
+    if (left->leaf) {
+      if (left->symbols.size() + right->symbols.size() > SYMBOL_TREE_LEAF / 2)
+        return;
+      moved(right->symbols, right, left);
+      left->symbols.append(right->symbols);
+    } else {
+      if (left->children.size() + right->children.size() >
+          SYMBOL_TREE_FANOUT / 2)
+        return;
+      for (Node *child : right->children)
+        child->parent = left;
+      left->children.append(right->children);
+      right->children.clear();
+    }
+    left->count += right->count;
+    left->newlines += right->newlines;
+    delete right;
+    node->children.remove(c + 1);
+  }
+
+  template <typename F>
+  static bool forEachFrom(const Node *node, int i, F &f) {
+    if (node->leaf) {
+      for (int k = i; k < node->symbols.size(); k++) {
+        if (!f(node->symbols.at(k)))
+          return false;
+      }
+      return true;
+    }
+    for (const Node *child : node->children) {
+      if (i >= child->count) {
+        i -= child->count;
+        continue;
+      }
+      if (!forEachFrom(child, i, f))
+        return false;
+      i = 0;
+    }
+    return true;
+  }
+
+  template <typename F> static void forEach(const Node *node, F &f) {
+    if (node->leaf) {
+      for (const Symbol &s : node->symbols)
+        f(s);
+      return;
+    }
+    for (const Node *child : node->children)
+      forEach(child, f);
+  }
+};
+
+#endif // SYMBOL_TREE_H
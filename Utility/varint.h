@@ -0,0 +1,57 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+// LEB128 variable-length integers: 7 bits per byte, high bit set when more
+// bytes follow. Signed values are zigzag-encoded first so that small negative
+// numbers stay short.
+
+static inline quint64 zigzagEncode(qint64 v) {
+  return (static_cast<quint64>(v) << 1) ^ static_cast<quint64>(v >> 63);
+}
+
+static inline qint64 zigzagDecode(quint64 v) {
+  return static_cast<qint64>(v >> 1) ^ -static_cast<qint64>(v & 1);
+}
+
+static inline void writeVarint(QByteArray &out, quint64 v) {
+  char buf[10];
+  int n = 0;
+  while (v >= 0x80) {
+    buf[n++] = static_cast<char>((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = static_cast<char>(v);
+  out.append(buf, n);
+}
+
+static inline void writeSignedVarint(QByteArray &out, qint64 v) {
+  writeVarint(out, zigzagEncode(v));
+}
+
+// Returns false if the input ends before the varint is complete
+static inline bool readVarint(const char *&p, const char *end, quint64 &v) {
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    quint8 byte = static_cast<quint8>(*p++);
+    v |= static_cast<quint64>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline bool readSignedVarint(const char *&p, const char *end,
+                                    qint64 &v) {
+  quint64 u;
+  if (!readVarint(p, end, u)) {
+    return false;
+  }
+  v = zigzagDecode(u);
+  return true;
+}
+
+#endif // VARINT_H
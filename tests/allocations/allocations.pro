@@ -0,0 +1,10 @@
+TARGET = tst_allocations
+
+include(../tests.pri)
+include(../client.pri)
+
+# Fail on the operations going over their allocation budget
+DEFINES += ALLOC_COUNTER
+
+SOURCES += \
+    tst_allocations.cpp
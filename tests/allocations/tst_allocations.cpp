@@ -0,0 +1,165 @@
+#define ALLOC_COUNTER_IMPLEMENTATION
+#include "../../Client/CRDT.h"
+#include "../../Utility/alloc_counter.h"
+#include "../test_client.h"
+#include <QScopedPointer>
+#include <QtTest>
+
+// Characters typed before measuring, so that the containers have grown
+#define WARMUP_SYMBOLS 2000
+// Operations measured per test
+#define MEASURED_OPS 500
+
+/*
+ * Runs the editing paths checked by ALLOC_BUDGET on a client using binary
+ * operations, and fails as soon as one goes over its budget. Each test
+ * edits a document shared by two editors: the local one, whose operations
+ * are measured or applied remotely on the other.
+ */
+class TestAllocations : public QObject {
+  Q_OBJECT
+
+private slots:
+  void init();
+  void cleanup();
+  void localInsert();
+  void localErase();
+  void remoteInsert();
+  void remoteErase();
+  void remoteEraseIds();
+  void remoteEraseRange();
+
+private:
+  QScopedPointer<Client> m_client;
+  QScopedPointer<CRDT> m_crdt;
+  QScopedPointer<Client> m_remoteClient;
+  QScopedPointer<CRDT> m_remote;
+  QFont m_font;
+  QColor m_color;
+
+  void type(CRDT &crdt, int count, QVector<Symbol> *typed = nullptr);
+  void applyRemotely(const QVector<Symbol> &symbols);
+};
+
+void TestAllocations::init() {
+  m_client.reset(new Client(nullptr, QStringLiteral("127.0.0.1"), 1));
+  m_crdt.reset(new CRDT(m_client.data()));
+  m_remoteClient.reset(new Client(nullptr, QStringLiteral("127.0.0.1"), 1));
+  m_remote.reset(new CRDT(m_remoteClient.data()));
+  QVERIFY(loginBinary(*m_client, QStringLiteral("local")));
+  QVERIFY(loginBinary(*m_remoteClient, QStringLiteral("remote")));
+  m_crdt->setId(1);
+  m_remote->setId(2);
+
+  // Both start from the same terminator, as after opening a file
+  m_crdt->localInsert(0, 0, '\0', m_font, m_color, Qt::AlignLeft);
+  emit m_remoteClient->remoteInsert(m_crdt->getSymbol(0, 0));
+  allocationOverruns().store(0);
+}
+
+void TestAllocations::cleanup() {
+  m_remote.reset();
+  m_remoteClient.reset();
+  m_crdt.reset();
+  m_client.reset();
+}
+
+// Types count characters at the end of crdt, a line every 64
+void TestAllocations::type(CRDT &crdt, int count, QVector<Symbol> *typed) {
+  for (int n = 0; n < count; n++) {
+    int line = crdt.getSize() / 65;
+    int index = crdt.getSize() % 65;
+    ushort value = index == 64 ? '\n' : static_cast<ushort>('a' + n % 26);
+    crdt.localInsert(line, index, value, m_font, m_color, Qt::AlignLeft);
+    if (typed != nullptr)
+      typed->append(crdt.getSymbol(line, index));
+  }
+}
+
+void TestAllocations::applyRemotely(const QVector<Symbol> &symbols) {
+  for (const Symbol &s : symbols)
+    emit m_remoteClient->remoteInsert(s);
+}
+
+void TestAllocations::localInsert() {
+  type(*m_crdt, WARMUP_SYMBOLS);
+  allocationOverruns().store(0);
+
+  type(*m_crdt, MEASURED_OPS);
+  QCOMPARE(allocationOverruns().load(), 0);
+}
+
+void TestAllocations::localErase() {
+  type(*m_crdt, WARMUP_SYMBOLS + 2 * MEASURED_OPS);
+  allocationOverruns().store(0);
+
+  // Single characters, then a selection of 16 at a time
+  for (int n = 0; n < MEASURED_OPS; n++) {
+    int line = 1, index = 10;
+    m_crdt->localErase(line, index, 1);
+  }
+  for (int n = 0; n < MEASURED_OPS / 16; n++) {
+    int line = 2, index = 0;
+    m_crdt->localErase(line, index, 16);
+  }
+  QCOMPARE(allocationOverruns().load(), 0);
+}
+
+void TestAllocations::remoteInsert() {
+  QVector<Symbol> typed;
+  type(*m_crdt, WARMUP_SYMBOLS + MEASURED_OPS, &typed);
+  applyRemotely(typed.mid(0, WARMUP_SYMBOLS));
+  allocationOverruns().store(0);
+
+  applyRemotely(typed.mid(WARMUP_SYMBOLS));
+  QCOMPARE(allocationOverruns().load(), 0);
+  QCOMPARE(m_remote->to_string(), m_crdt->to_string());
+}
+
+void TestAllocations::remoteErase() {
+  QVector<Symbol> typed;
+  type(*m_crdt, WARMUP_SYMBOLS, &typed);
+  applyRemotely(typed);
+  allocationOverruns().store(0);
+
+  // One symbol, then runs of 4, as sent by DELETE_SYMBOL
+  for (int n = 0; n < MEASURED_OPS; n++)
+    emit m_remoteClient->remoteErase(QVector<Symbol>{typed.at(n)});
+  for (int n = MEASURED_OPS; n < WARMUP_SYMBOLS; n += 4)
+    emit m_remoteClient->remoteErase(typed.mid(n, 4));
+  QCOMPARE(allocationOverruns().load(), 0);
+  QCOMPARE(m_remote->getSize(), 0);
+}
+
+void TestAllocations::remoteEraseIds() {
+  QVector<Symbol> typed;
+  type(*m_crdt, WARMUP_SYMBOLS, &typed);
+  applyRemotely(typed);
+  allocationOverruns().store(0);
+
+  for (int n = 0; n < WARMUP_SYMBOLS; n++)
+    emit m_remoteClient->remoteEraseIds(QVector<OpId>{typed.at(n).opId()});
+  QCOMPARE(allocationOverruns().load(), 0);
+  QCOMPARE(m_remote->getSize(), 0);
+}
+
+void TestAllocations::remoteEraseRange() {
+  QVector<Symbol> typed;
+  type(*m_crdt, WARMUP_SYMBOLS, &typed);
+  applyRemotely(typed);
+  allocationOverruns().store(0);
+
+  // Ranges of 16 symbols, as sent by DELETE_RANGE
+  for (int n = 0; n + 16 <= WARMUP_SYMBOLS; n += 16) {
+    QVector<OpId> seen;
+    for (int i = n; i < n + 16; i++)
+      addLastOpId(seen, typed.at(i).opId());
+    emit m_remoteClient->remoteEraseRange(typed.at(n), typed.at(n + 15),
+                                          seen);
+  }
+  QCOMPARE(allocationOverruns().load(), 0);
+  QCOMPARE(m_remote->getSize(), 0);
+}
+
+QTEST_MAIN(TestAllocations)
+#include "tst_allocations.moc"
@@ -0,0 +1,14 @@
+# Targets built with the client's CRDT and connection, never connected: the
+# widgets are only needed to link them
+
+QT       += network widgets
+
+INCLUDEPATH += $$PWD/../Client
+
+SOURCES += \
+    $$PWD/../Client/CRDT.cpp \
+    $$PWD/../Client/client.cpp
+
+HEADERS += \
+    $$PWD/../Client/CRDT.h \
+    $$PWD/../Client/client.h
@@ -0,0 +1,6 @@
+TARGET = tst_codec
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_codec.cpp
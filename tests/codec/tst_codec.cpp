@@ -0,0 +1,186 @@
+#include "../../Utility/symbol_codec.h"
+#include "../test_symbols.h"
+#include <QtTest>
+
+// Symbols of the benchmark document
+#define BENCHMARK_SYMBOLS 100000
+
+class TestCodec : public QObject {
+  Q_OBJECT
+
+private slots:
+  void roundTrip_data();
+  void roundTrip();
+  void version1();
+  void dataStreamFallback();
+  void truncated();
+  void unknownVersion();
+  void encode_data();
+  void encode();
+  void decode_data();
+  void decode();
+};
+
+// As written before positions were stored relative to the previous one
+static QByteArray encodeVersion1(const QVector<Symbol> &symbols) {
+  QHash<quint32, quint32> indexes;
+  QByteArray formats, records, identifiers;
+  for (const Symbol &s : symbols) {
+    auto index = indexes.constFind(s.getFormatId());
+    if (index == indexes.constEnd()) {
+      index = indexes.insert(s.getFormatId(), indexes.size());
+      writeSymbolFormat(formats, s.getFormat());
+    }
+    uchar record[SYMBOL_CODEC_RECORD];
+    qToLittleEndian<quint16>(s.getValue(), record);
+    qToLittleEndian<quint16>(s.getPositionRef().size(), record + 2);
+    qToLittleEndian<quint32>(index.value(), record + 4);
+    qToLittleEndian<qint32>(s.getCounter(), record + 8);
+    records.append(reinterpret_cast<const char *>(record),
+                   SYMBOL_CODEC_RECORD);
+    for (const Identifier &id : s.getPositionRef()) {
+      writeSignedVarint(identifiers, id.digit);
+      writeSignedVarint(identifiers, id.site);
+    }
+  }
+
+  QByteArray out(SYMBOL_CODEC_MAGIC);
+  out.append(static_cast<char>(1));
+  writeVarint(out, symbols.size());
+  writeVarint(out, indexes.size());
+  return out + formats + records + identifiers;
+}
+
+static QByteArray encodeDataStream(const QVector<Symbol> &symbols) {
+  QByteArray data;
+  QDataStream out(&data, QIODevice::WriteOnly);
+  out << symbols;
+  return data;
+}
+
+static void compareSymbols(const QVector<Symbol> &actual,
+                           const QVector<Symbol> &expected) {
+  QCOMPARE(actual.size(), expected.size());
+  for (int i = 0; i < expected.size(); i++) {
+    QVERIFY2(sameSymbol(actual.at(i), expected.at(i)),
+             qPrintable(QStringLiteral("%1: %2 instead of %3")
+                            .arg(i)
+                            .arg(actual.at(i).to_string())
+                            .arg(expected.at(i).to_string())));
+  }
+}
+
+void TestCodec::roundTrip_data() {
+  QTest::addColumn<QVector<Symbol>>("symbols");
+
+  QRandomGenerator rng(1);
+  QTest::newRow("empty") << QVector<Symbol>();
+  QTest::newRow("one") << randomSymbols(rng, 1);
+  QTest::newRow("document") << randomSymbols(rng, 10000, 40);
+
+  // Positions only partly shared with the previous one, any order
+  QVector<Symbol> shuffled = randomSymbols(rng, 2000);
+  std::shuffle(shuffled.begin(), shuffled.end(), rng);
+  QTest::newRow("unordered") << shuffled;
+
+  // Positions on the heap, each one level deeper than the previous
+  QVector<Symbol> deep;
+  Position position;
+  for (int n = 0; n < 100; n++) {
+    position.append(Identifier(n % 31 + 1, n % 2 == 0 ? 1 : -2));
+    deep.append(Symbol('x', position, n + 1, testFormat(n)));
+  }
+  QTest::newRow("deep") << deep;
+}
+
+void TestCodec::roundTrip() {
+  QFETCH(QVector<Symbol>, symbols);
+  QByteArray data = encodeSymbols(symbols);
+  QVERIFY(data.startsWith(SYMBOL_CODEC_MAGIC));
+  QCOMPARE(static_cast<int>(data.at(3)), SYMBOL_CODEC_VERSION);
+
+  QVector<Symbol> decoded;
+  QVERIFY(decodeSymbols(data, decoded));
+  compareSymbols(decoded, symbols);
+}
+
+void TestCodec::version1() {
+  QRandomGenerator rng(2);
+  QVector<Symbol> symbols = randomSymbols(rng, 5000, 20);
+  QVector<Symbol> decoded;
+  QVERIFY(decodeSymbols(encodeVersion1(symbols), decoded));
+  compareSymbols(decoded, symbols);
+}
+
+// Snapshots stored before the codec existed
+void TestCodec::dataStreamFallback() {
+  QRandomGenerator rng(3);
+  QVector<Symbol> symbols = randomSymbols(rng, 5000, 20);
+  QByteArray data = encodeDataStream(symbols);
+  QVERIFY(!data.startsWith(SYMBOL_CODEC_MAGIC));
+  QVector<Symbol> decoded;
+  QVERIFY(decodeSymbols(data, decoded));
+  compareSymbols(decoded, symbols);
+
+  QVERIFY(decodeSymbols(encodeDataStream(QVector<Symbol>()), decoded));
+  QVERIFY(decoded.isEmpty());
+}
+
+// Every prefix of a payload is rejected, leaving no symbols
+void TestCodec::truncated() {
+  QRandomGenerator rng(4);
+  QVector<Symbol> symbols = randomSymbols(rng, 50, 4);
+  const QByteArray payloads[] = {encodeSymbols(symbols),
+                                 encodeVersion1(symbols),
+                                 encodeDataStream(symbols)};
+  for (const QByteArray &data : payloads) {
+    for (int size = 0; size < data.size(); size++) {
+      QVector<Symbol> decoded = symbols;
+      QVERIFY2(!decodeSymbols(data.left(size), decoded),
+               qPrintable(QStringLiteral("%1 bytes").arg(size)));
+      QVERIFY(decoded.isEmpty());
+    }
+  }
+}
+
+void TestCodec::unknownVersion() {
+  QRandomGenerator rng(5);
+  QByteArray data = encodeSymbols(randomSymbols(rng, 10));
+  data[3] = static_cast<char>(SYMBOL_CODEC_VERSION + 1);
+  QVector<Symbol> decoded;
+  QVERIFY(!decodeSymbols(data, decoded));
+  QVERIFY(decoded.isEmpty());
+}
+
+void TestCodec::encode_data() {
+  QTest::addColumn<bool>("codec");
+  QTest::newRow("codec") << true;
+  QTest::newRow("QDataStream") << false;
+}
+
+void TestCodec::encode() {
+  QFETCH(bool, codec);
+  QRandomGenerator rng(6);
+  QVector<Symbol> symbols = randomSymbols(rng, BENCHMARK_SYMBOLS);
+  QByteArray data;
+  QBENCHMARK {
+    data = codec ? encodeSymbols(symbols) : encodeDataStream(symbols);
+  }
+  qDebug().nospace() << data.size() << " bytes, "
+                     << double(data.size()) / symbols.size() << " per symbol";
+}
+
+void TestCodec::decode_data() { encode_data(); }
+
+void TestCodec::decode() {
+  QFETCH(bool, codec);
+  QRandomGenerator rng(6);
+  QVector<Symbol> symbols = randomSymbols(rng, BENCHMARK_SYMBOLS);
+  QByteArray data = codec ? encodeSymbols(symbols) : encodeDataStream(symbols);
+  QVector<Symbol> decoded;
+  QBENCHMARK { QVERIFY(decodeSymbols(data, decoded)); }
+  QCOMPARE(decoded.size(), symbols.size());
+}
+
+QTEST_APPLESS_MAIN(TestCodec)
+#include "tst_codec.moc"
@@ -0,0 +1,7 @@
+TARGET = tst_crdt
+
+include(../tests.pri)
+include(../client.pri)
+
+SOURCES += \
+    tst_crdt.cpp
@@ -0,0 +1,182 @@
+#include "../../Client/CRDT.h"
+#include "../test_client.h"
+#include <QScopedPointer>
+#include <QtTest>
+
+// Characters of the pastes, a line every 60
+#define PASTE_SIZE 10000
+// Characters typed one at a time at the same spot, to nest positions
+#define NESTED_TYPED 2000
+// Levels of the pasted positions, at most: allocated one character at a
+// time, they went past a thousand
+#define PASTE_MAX_DEPTH 8
+#define PASTE_EXTRA_DEPTH 4
+
+/*
+ * Multi-character inserts on a client using binary operations: positions
+ * allocated in bulk must stay shallow, follow document order, and give the
+ * same document when the paste is applied by another editor.
+ */
+class TestCrdt : public QObject {
+  Q_OBJECT
+
+private slots:
+  void init();
+  void cleanup();
+  void pasteIntoEmpty();
+  void pasteBetweenNested();
+  void pasteTwice();
+  void paste();
+
+private:
+  QScopedPointer<Client> m_client;
+  QScopedPointer<CRDT> m_crdt;
+  QScopedPointer<Client> m_remoteClient;
+  QScopedPointer<CRDT> m_remote;
+  QFont m_font;
+  QColor m_color;
+
+  QVector<Symbol> symbols(CRDT &crdt);
+  void checkPaste(int first, const QString &text);
+};
+
+static QString pasteText(int size) {
+  QString text;
+  for (int n = 0; n < size; n++)
+    text.append(n % 60 == 59 ? QChar('\n') : QChar('a' + n % 26));
+  return text;
+}
+
+void TestCrdt::init() {
+  m_client.reset(new Client(nullptr, QStringLiteral("127.0.0.1"), 1));
+  m_crdt.reset(new CRDT(m_client.data()));
+  m_remoteClient.reset(new Client(nullptr, QStringLiteral("127.0.0.1"), 1));
+  m_remote.reset(new CRDT(m_remoteClient.data()));
+  QVERIFY(loginBinary(*m_client, QStringLiteral("local")));
+  QVERIFY(loginBinary(*m_remoteClient, QStringLiteral("remote")));
+  m_crdt->setId(1);
+  m_remote->setId(2);
+
+  // Both start from the same terminator, as after opening a file
+  m_crdt->localInsert(0, 0, '\0', m_font, m_color, Qt::AlignLeft);
+  emit m_remoteClient->remoteInsert(m_crdt->getSymbol(0, 0));
+}
+
+void TestCrdt::cleanup() {
+  m_remote.reset();
+  m_remoteClient.reset();
+  m_crdt.reset();
+  m_client.reset();
+}
+
+// The symbols of crdt in document order, the terminator last
+QVector<Symbol> TestCrdt::symbols(CRDT &crdt) {
+  QVector<Symbol> result;
+  for (int line = 0; crdt.lineSize(line) > 0; line++) {
+    for (int index = 0; index < crdt.lineSize(line); index++)
+      result.append(crdt.getSymbol(line, index));
+  }
+  return result;
+}
+
+/*
+ * Checks the text pasted from index first of the document: positions
+ * strictly increasing across the document, depths logged, and the same
+ * document on the other editor once it receives the paste.
+ */
+void TestCrdt::checkPaste(int first, const QString &text) {
+  QVector<Symbol> document = symbols(*m_crdt);
+  QCOMPARE(document.size(), m_crdt->getSize() + 1);
+  for (int i = 1; i < document.size(); i++) {
+    if (Symbol::compare(document.at(i - 1), document.at(i)) >= 0)
+      QFAIL(qPrintable(QStringLiteral("symbols %1 and %2 out of order")
+                           .arg(i - 1)
+                           .arg(i)));
+  }
+
+  QVector<Symbol> pasted = document.mid(first, text.size());
+  qint64 levels = 0;
+  int maxDepth = 0;
+  for (int n = 0; n < text.size(); n++) {
+    QCOMPARE(pasted.at(n).getValue(), text.at(n).unicode());
+    int depth = pasted.at(n).getPositionRef().size();
+    levels += depth;
+    maxDepth = qMax(maxDepth, depth);
+  }
+  int neighbours = 0;
+  if (first > 0)
+    neighbours = document.at(first - 1).getPositionRef().size();
+  if (first + text.size() < document.size())
+    neighbours = qMax(
+        neighbours, document.at(first + text.size()).getPositionRef().size());
+  qDebug().nospace() << "depth of " << text.size()
+                     << " pasted characters: mean "
+                     << double(levels) / text.size() << ", max " << maxDepth
+                     << ", neighbours " << neighbours;
+  QVERIFY(maxDepth <= qMax(PASTE_MAX_DEPTH, neighbours + PASTE_EXTRA_DEPTH));
+
+  emit m_remoteClient->remotePaste(pasted);
+  QCOMPARE(m_remote->to_string(), m_crdt->to_string());
+}
+
+void TestCrdt::pasteIntoEmpty() {
+  QString text = pasteText(PASTE_SIZE);
+  int line = 0, index = 0;
+  m_crdt->localInsertGroup(line, index, text, m_font, m_color, Qt::AlignLeft);
+  QCOMPARE(line, PASTE_SIZE / 60);
+  QCOMPARE(index, PASTE_SIZE % 60);
+  QCOMPARE(m_crdt->getSize(), PASTE_SIZE);
+  checkPaste(0, text);
+}
+
+// Between two neighbours many levels deep, from typing at the same spot
+void TestCrdt::pasteBetweenNested() {
+  m_crdt->localInsert(0, 0, 'x', m_font, m_color, Qt::AlignLeft);
+  for (int n = 0; n < NESTED_TYPED; n++)
+    m_crdt->localInsert(0, 1, 'y', m_font, m_color, Qt::AlignLeft);
+
+  // The deepest neighbours, typed on the other editor too
+  QVector<Symbol> document = symbols(*m_crdt);
+  for (int i = 0; i + 1 < document.size(); i++)
+    emit m_remoteClient->remoteInsert(document.at(i));
+  int deepest = 1;
+  for (int i = 1; i < document.size(); i++) {
+    if (document.at(i).getPositionRef().size() >
+        document.at(deepest).getPositionRef().size())
+      deepest = i;
+  }
+  qDebug() << "typed depth" << document.at(deepest).getPositionRef().size();
+  QVERIFY(document.at(deepest).getPositionRef().size() > PASTE_MAX_DEPTH);
+
+  QString text = pasteText(PASTE_SIZE);
+  int line = 0, index = deepest;
+  m_crdt->localInsertGroup(line, index, text, m_font, m_color, Qt::AlignLeft);
+  checkPaste(deepest, text);
+}
+
+// A second paste right after the first, at its end
+void TestCrdt::pasteTwice() {
+  QString text = pasteText(PASTE_SIZE);
+  int line = 0, index = 0;
+  m_crdt->localInsertGroup(line, index, text, m_font, m_color, Qt::AlignLeft);
+  checkPaste(0, text);
+  m_crdt->localInsertGroup(line, index, text, m_font, m_color, Qt::AlignLeft);
+  checkPaste(PASTE_SIZE, text);
+}
+
+void TestCrdt::paste() {
+  QString text = pasteText(PASTE_SIZE);
+  int size = 0;
+  QBENCHMARK {
+    CRDT crdt(m_client.data());
+    crdt.setId(1);
+    crdt.localInsert(0, 0, '\0', m_font, m_color, Qt::AlignLeft);
+    int line = 0, index = 0;
+    crdt.localInsertGroup(line, index, text, m_font, m_color, Qt::AlignLeft);
+    size = crdt.getSize();
+  }
+  QCOMPARE(size, PASTE_SIZE);
+}
+
+QTEST_MAIN(TestCrdt)
+#include "tst_crdt.moc"
@@ -0,0 +1,6 @@
+TARGET = tst_format_table
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_format_table.cpp
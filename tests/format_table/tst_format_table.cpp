@@ -0,0 +1,183 @@
+#include "../../Utility/symbol_store.h"
+#include "../test_symbols.h"
+#include <QThread>
+#include <QtTest>
+
+// Formats interned while another thread reads, several chunks of the table
+#define CONCURRENT_FORMATS (8 * FORMAT_TABLE_CHUNK)
+// Lookups per benchmark iteration
+#define BENCHMARK_LOOKUPS 100000
+
+class TestFormatTable : public QObject {
+  Q_OBJECT
+
+private slots:
+  void intern();
+  void collect();
+  void reuseIds();
+  void storeReferences();
+  void concurrentReads();
+  void lookup_data();
+  void lookup();
+};
+
+static FormatTable &table() { return FormatTable::instance(); }
+
+// A symbol of format n, the only one at its position
+static Symbol symbolOf(int n) {
+  return Symbol('a', Position{Identifier(n + 1, 1)}, n + 1, testFormat(n));
+}
+
+void TestFormatTable::intern() {
+  QVERIFY(table().format(0) == SymbolFormat());
+  QCOMPARE(table().intern(SymbolFormat()), 0u);
+
+  int size = table().size();
+  quint32 id = table().intern(testFormat(1));
+  QCOMPARE(table().size(), size + 1);
+  QCOMPARE(table().intern(testFormat(1)), id);
+  QVERIFY(table().intern(testFormat(2)) != id);
+  QCOMPARE(table().size(), size + 2);
+  QVERIFY(table().format(id) == testFormat(1));
+}
+
+// Only formats without references are evicted, never the default one
+void TestFormatTable::collect() {
+  QVector<quint32> ids;
+  for (int n = 10; n < 20; n++)
+    ids.append(table().intern(testFormat(n)));
+  for (int i = 0; i < ids.size(); i += 2)
+    table().retain(ids.at(i));
+  table().retain(0);
+  table().release(0);
+
+  int size = table().size();
+  QVector<quint32> evicted = table().collect();
+  QVERIFY(!evicted.contains(0));
+  QCOMPARE(table().size(), size - evicted.size());
+  for (int i = 0; i < ids.size(); i++) {
+    QCOMPARE(evicted.contains(ids.at(i)), i % 2 != 0);
+    if (i % 2 == 0)
+      QVERIFY(table().format(ids.at(i)) == testFormat(10 + i));
+  }
+  QVERIFY(table().collect().isEmpty());
+
+  for (int i = 0; i < ids.size(); i += 2)
+    table().release(ids.at(i));
+  evicted = table().collect();
+  QCOMPARE(evicted.size(), ids.size() / 2);
+  QCOMPARE(table().size(), 1);
+  QVERIFY(table().format(0) == SymbolFormat());
+}
+
+// Evicted ids are given to new formats before the table grows
+void TestFormatTable::reuseIds() {
+  table().collect();
+  QVector<quint32> ids;
+  for (int n = 30; n < 40; n++)
+    ids.append(table().intern(testFormat(n)));
+  QVector<quint32> evicted = table().collect();
+  QCOMPARE(evicted.size(), ids.size());
+
+  for (int n = 40; n < 50; n++) {
+    quint32 id = table().intern(testFormat(n));
+    QVERIFY(ids.contains(id));
+    QVERIFY(table().format(id) == testFormat(n));
+  }
+  table().collect();
+}
+
+void TestFormatTable::storeReferences() {
+  table().collect();
+  quint32 replaced, kept;
+  {
+    SymbolStore store;
+    for (int n = 60; n < 70; n++)
+      store.insert(symbolOf(n));
+    Symbol s = symbolOf(60);
+    replaced = s.getFormatId();
+    s.setFormatId(table().intern(testFormat(70)));
+    store.insert(s); // Replaces the symbol of format 60
+    kept = symbolOf(61).getFormatId();
+    store.remove(symbolOf(62).getPositionRef());
+    QVERIFY(store.removeRange(symbolOf(63).getPositionRef(),
+                              symbolOf(64).getPositionRef(),
+                              QVector<OpId>{makeOpId(1, 100)}, nullptr) == 2);
+
+    QVector<quint32> evicted = table().collect();
+    QCOMPARE(evicted.size(), 4);
+    QVERIFY(evicted.contains(replaced));
+    QVERIFY(!evicted.contains(kept));
+    QVERIFY(!evicted.contains(s.getFormatId()));
+    QVERIFY(store.toVector().first().getFormat() == testFormat(70));
+
+    SymbolStore other;
+    other.insert(symbolOf(61));
+    store.clear();
+    QVERIFY(!table().collect().contains(kept));
+  }
+  QVERIFY(table().collect().contains(kept));
+  QCOMPARE(table().size(), 1);
+}
+
+// Lookups take no lock while ids are interned, chunks allocated and
+// char formats built on another thread
+void TestFormatTable::concurrentReads() {
+  QVector<quint32> ids;
+  for (int n = 0; n < 64; n++)
+    ids.append(table().intern(testFormat(n)));
+
+  QAtomicInt stop, mismatches, lookups;
+  QScopedPointer<QThread> reader(QThread::create([&] {
+    for (int i = 0; !stop.loadAcquire(); i = (i + 1) % ids.size()) {
+      if (!(table().format(ids.at(i)) == testFormat(i)))
+        mismatches.ref();
+      lookups.ref();
+    }
+  }));
+  reader->start();
+
+  for (int n = 0; n < CONCURRENT_FORMATS; n++) {
+    quint32 id = table().intern(testFormat(1000 + n));
+    table().charFormat(id);
+    table().charFormat(ids.at(n % ids.size()));
+  }
+  stop.storeRelease(1);
+  QVERIFY(reader->wait());
+  qDebug().nospace() << lookups.load() << " lookups during "
+                     << CONCURRENT_FORMATS << " interns";
+  QCOMPARE(mismatches.load(), 0);
+  table().collect();
+}
+
+void TestFormatTable::lookup_data() {
+  QTest::addColumn<bool>("charFormat");
+  QTest::newRow("format") << false;
+  QTest::newRow("charFormat") << true;
+}
+
+// As when painting or encoding symbols of a few formats
+void TestFormatTable::lookup() {
+  QFETCH(bool, charFormat);
+  QVector<quint32> ids;
+  for (int n = 0; n < 40; n++)
+    ids.append(table().intern(testFormat(n)));
+  for (quint32 id : ids)
+    table().charFormat(id);
+
+  int bold = 0;
+  QBENCHMARK {
+    bold = 0;
+    for (int i = 0; i < BENCHMARK_LOOKUPS; i++) {
+      quint32 id = ids.at(i / 16 % ids.size());
+      if (charFormat)
+        bold += table().charFormat(id).fontWeight() == QFont::Bold;
+      else
+        bold += table().format(id).bold;
+    }
+  }
+  QVERIFY(bold > 0);
+}
+
+QTEST_MAIN(TestFormatTable)
+#include "tst_format_table.moc"
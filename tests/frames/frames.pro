@@ -0,0 +1,6 @@
+TARGET = tst_frames
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_frames.cpp
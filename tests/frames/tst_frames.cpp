@@ -0,0 +1,297 @@
+#include "../../Utility/byte_reader.h"
+#include <QBuffer>
+#include <QtTest>
+
+// Frames of the burst test
+#define BURST_FRAMES 10000
+
+class TestFrames : public QObject {
+  Q_OBJECT
+
+private slots:
+  void burst();
+  void splitReads_data();
+  void splitReads();
+  void compressed();
+  void compressedLimit();
+  void oversizedFrame();
+  void loginLimit();
+  void incompatible_data();
+  void incompatible();
+  void invalidFrame_data();
+  void invalidFrame();
+  void readBurst_data();
+  void readBurst();
+};
+
+// Frames dispatched by the reader, JSON ones as compact text
+class Received : public ByteReader {
+public:
+  QVector<FrameType> types;
+  QVector<QByteArray> payloads;
+
+  void jsonReceived(const QJsonObject &jsonDoc) override {
+    types.append(FRAME_JSON);
+    payloads.append(QJsonDocument(jsonDoc).toJson(QJsonDocument::Compact));
+  }
+  void byteArrayReceived(const QByteArray &jsonDoc) override {
+    types.append(FRAME_BULK);
+    payloads.append(jsonDoc);
+  }
+  void opcodeReceived(const QByteArray &ops) override {
+    types.append(FRAME_OPCODE);
+    payloads.append(ops);
+  }
+};
+
+// Bytes sent on a connection: the preamble, then the frames written
+class Stream {
+public:
+  QByteArray data;
+
+  explicit Stream(bool preamble = true) : m_buffer(&data) {
+    m_buffer.open(QIODevice::WriteOnly);
+    if (preamble)
+      writeFramePreamble(&m_buffer);
+  }
+
+  Stream &write(FrameType type, const QByteArray &payload) {
+    m_writer.write(&m_buffer, type, payload);
+    return *this;
+  }
+  Stream &json(int n) {
+    QJsonObject message;
+    message["n"] = n;
+    return write(FRAME_JSON,
+                 QJsonDocument(message).toJson(QJsonDocument::Compact));
+  }
+  // A header announcing size bytes, without the payload
+  Stream &header(quint32 size, int type = FRAME_BULK) {
+    char header[FRAME_HEADER_SIZE];
+    writeFrameHeader(header, size, static_cast<FrameType>(type), 0);
+    m_buffer.write(header, FRAME_HEADER_SIZE);
+    return *this;
+  }
+  Stream &raw(const QByteArray &bytes) {
+    m_buffer.write(bytes);
+    return *this;
+  }
+  FrameWriter &writer() { return m_writer; }
+
+private:
+  QBuffer m_buffer;
+  FrameWriter m_writer;
+};
+
+// Makes data available to reader at once, as a single readyRead
+static bool feed(FrameReader &reader, Received &received,
+                 const QByteArray &data) {
+  QBuffer device;
+  device.setData(data);
+  device.open(QIODevice::ReadOnly);
+  return reader.read(&device, received);
+}
+
+// A typical mix of messages: mostly small JSON, some operations and a
+// bulk payload
+static QByteArray mixedStream(int frames) {
+  Stream stream;
+  for (int n = 0; n < frames; n++) {
+    if (n % 10 == 9)
+      stream.write(FRAME_OPCODE, QByteArray(20 + n % 50, static_cast<char>(n)));
+    else
+      stream.json(n);
+  }
+  stream.write(FRAME_BULK, QByteArray(100000, 'b'));
+  return stream.data;
+}
+
+void TestFrames::burst() {
+  Stream stream;
+  for (int n = 0; n < BURST_FRAMES; n++)
+    stream.json(n);
+
+  FrameReader reader;
+  Received received;
+  QVERIFY(feed(reader, received, stream.data));
+  QCOMPARE(received.payloads.size(), BURST_FRAMES);
+  for (int n = 0; n < BURST_FRAMES; n++) {
+    QCOMPARE(received.types.at(n), FRAME_JSON);
+    QCOMPARE(received.payloads.at(n), QByteArray("{\"n\":") +
+                                          QByteArray::number(n) + "}");
+  }
+}
+
+void TestFrames::splitReads_data() {
+  QTest::addColumn<int>("chunk");
+  QTest::newRow("1 byte") << 1;
+  QTest::newRow("7 bytes") << 7;
+  QTest::newRow("header") << FRAME_HEADER_SIZE;
+  QTest::newRow("1000 bytes") << 1000;
+  QTest::newRow("64 KB") << FRAME_READER_CAPACITY;
+}
+
+// Frames and headers split at every point are dispatched as when read at
+// once
+void TestFrames::splitReads() {
+  QFETCH(int, chunk);
+  QByteArray data = mixedStream(500);
+  FrameReader whole;
+  Received expected;
+  QVERIFY(feed(whole, expected, data));
+
+  FrameReader reader;
+  Received received;
+  for (int i = 0; i < data.size(); i += chunk)
+    QVERIFY(feed(reader, received, data.mid(i, chunk)));
+  QCOMPARE(received.types, expected.types);
+  QCOMPARE(received.payloads, expected.payloads);
+  QCOMPARE(received.payloads.size(), 501);
+}
+
+void TestFrames::compressed() {
+  QByteArray json = "{\"text\":\"" + QByteArray(50000, 'x') + "\"}";
+  QByteArray ops(200000, '\0');
+  for (int i = 0; i < ops.size(); i++)
+    ops[i] = static_cast<char>(i % 251);
+
+  Stream stream;
+  stream.writer().enableCompression(nullptr);
+  stream.write(FRAME_JSON, json).write(FRAME_OPCODE, ops).json(1);
+  stream.write(FRAME_OPCODE, ops);
+  QVERIFY(stream.data.size() < json.size() + ops.size());
+
+  FrameReader reader;
+  Received received;
+  QVERIFY(feed(reader, received, stream.data));
+  QCOMPARE(received.payloads.size(), 4);
+  QCOMPARE(received.payloads.at(0), json);
+  QCOMPARE(received.payloads.at(1), ops);
+  QCOMPARE(received.payloads.at(3), ops);
+}
+
+// A small frame inflating past the limit is rejected
+void TestFrames::compressedLimit() {
+  Stream stream;
+  stream.writer().enableCompression(nullptr);
+  stream.write(FRAME_BULK, QByteArray(FRAME_MAX_LOGIN_SIZE + 1, '\0'));
+  QVERIFY(stream.data.size() < FRAME_MAX_LOGIN_SIZE / 100);
+
+  FrameReader reader;
+  reader.setMaxFrameSize(FRAME_MAX_LOGIN_SIZE);
+  Received received;
+  QVERIFY(!feed(reader, received, stream.data));
+  QVERIFY(!reader.errorString().isEmpty());
+  QVERIFY(received.payloads.isEmpty());
+}
+
+// Rejected from the header alone, and so is everything after it until
+// the reader is cleared for a new connection
+void TestFrames::oversizedFrame() {
+  Stream stream;
+  stream.json(1).header(FRAME_MAX_SIZE + 1);
+
+  FrameReader reader;
+  Received received;
+  QVERIFY(!feed(reader, received, stream.data));
+  QVERIFY(!reader.errorString().isEmpty());
+  QVERIFY(!reader.isIncompatible());
+  QCOMPARE(received.payloads.size(), 1);
+  QVERIFY(!feed(reader, received, Stream(false).json(2).data));
+  QCOMPARE(received.payloads.size(), 1);
+
+  reader.clear();
+  QVERIFY(reader.errorString().isEmpty());
+  QVERIFY(feed(reader, received, Stream().json(3).data));
+  QCOMPARE(received.payloads.size(), 2);
+}
+
+void TestFrames::loginLimit() {
+  FrameReader reader;
+  reader.setMaxFrameSize(FRAME_MAX_LOGIN_SIZE);
+  Received received;
+  QByteArray image(FRAME_MAX_LOGIN_SIZE, 'i');
+  QVERIFY(feed(reader, received, Stream().write(FRAME_BULK, image).data));
+  QCOMPARE(received.payloads.size(), 1);
+  QVERIFY(!feed(reader, received,
+                Stream(false).header(FRAME_MAX_LOGIN_SIZE + 1).data));
+
+  // Logged in
+  reader.clear();
+  reader.setMaxFrameSize(FRAME_MAX_SIZE);
+  image.append('i');
+  QVERIFY(feed(reader, received, Stream().write(FRAME_BULK, image).data));
+  QCOMPARE(received.payloads.size(), 2);
+}
+
+void TestFrames::incompatible_data() {
+  QTest::addColumn<QByteArray>("data");
+
+  QByteArray dataStream;
+  QDataStream out(&dataStream, QIODevice::WriteOnly);
+  out << quint64(0) << QByteArray("{\"type\":\"login\"}");
+  QTest::newRow("QDataStream framing") << dataStream;
+
+  QByteArray version(FRAME_PREAMBLE_MAGIC "\0\0\0\0", FRAME_PREAMBLE_SIZE);
+  version[FRAME_PREAMBLE_SIZE - 1] = FRAME_PROTOCOL_VERSION + 1;
+  QTest::newRow("other version") << version + Stream(false).json(1).data;
+  QTest::newRow("no preamble") << Stream(false).json(1).data;
+}
+
+// Detected at the first bytes, before any frame is dispatched
+void TestFrames::incompatible() {
+  QFETCH(QByteArray, data);
+  FrameReader reader;
+  Received received;
+  QVERIFY(feed(reader, received, data.left(FRAME_PREAMBLE_SIZE - 1)));
+  QVERIFY(!feed(reader, received, data.mid(FRAME_PREAMBLE_SIZE - 1)));
+  QVERIFY(reader.isIncompatible());
+  QVERIFY(received.payloads.isEmpty());
+}
+
+void TestFrames::invalidFrame_data() {
+  QTest::addColumn<int>("type");
+  QTest::addColumn<QByteArray>("payload");
+  QTest::newRow("type 0") << 0 << QByteArray("{}");
+  QTest::newRow("unknown type") << FRAME_BULK + 1 << QByteArray("{}");
+  QTest::newRow("JSON array") << int(FRAME_JSON) << QByteArray("[1]");
+  QTest::newRow("bad JSON") << int(FRAME_JSON) << QByteArray("{\"n\":");
+}
+
+void TestFrames::invalidFrame() {
+  QFETCH(int, type);
+  QFETCH(QByteArray, payload);
+  Stream stream;
+  stream.json(1).header(payload.size(), type).raw(payload).json(2);
+
+  FrameReader reader;
+  Received received;
+  QVERIFY(!feed(reader, received, stream.data));
+  QVERIFY(!reader.errorString().isEmpty());
+  QVERIFY(!reader.isIncompatible());
+  QCOMPARE(received.payloads.size(), 1);
+}
+
+void TestFrames::readBurst_data() {
+  QTest::addColumn<int>("frames");
+  QTest::newRow("1000") << 1000;
+  QTest::newRow("10000") << 10000;
+  QTest::newRow("100000") << 100000;
+}
+
+// Time per frame stays the same as bursts grow
+void TestFrames::readBurst() {
+  QFETCH(int, frames);
+  QByteArray data = mixedStream(frames);
+  int dispatched = 0;
+  QBENCHMARK {
+    FrameReader reader;
+    Received received;
+    feed(reader, received, data);
+    dispatched = received.payloads.size();
+  }
+  QCOMPARE(dispatched, frames + 1);
+}
+
+QTEST_APPLESS_MAIN(TestFrames)
+#include "tst_frames.moc"
@@ -0,0 +1,6 @@
+TARGET = tst_opcodes
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_opcodes.cpp
@@ -0,0 +1,223 @@
+#include "../../Utility/opcodes.h"
+#include "../test_symbols.h"
+#include <QJsonDocument>
+#include <QtTest>
+
+// Operations of the benchmark
+#define BENCHMARK_OPS 10000
+
+class TestOpcodes : public QObject {
+  Q_OBJECT
+
+private slots:
+  void roundTrip_data();
+  void roundTrip();
+  void hashCollision();
+  void redefinition();
+  void undefinedFormat();
+  void encode_data();
+  void encode();
+  void decode();
+};
+
+Q_DECLARE_METATYPE(Operation)
+
+// Formats with the same SymbolFormat::key()
+static SymbolFormat collidingFormat(const char *color) {
+  SymbolFormat format;
+  format.font = QStringLiteral("Arial");
+  format.size = 12;
+  format.color = QString::fromLatin1(color);
+  return format;
+}
+
+// Writes ops in one frame, then reads them back with a new connection
+static QVector<Operation> transfer(const QVector<Operation> &ops) {
+  QSet<quint32> sent;
+  OpWriter writer(&sent);
+  for (const Operation &op : ops)
+    writer.append(op);
+
+  QHash<quint32, SymbolFormat> received;
+  OpReader reader(writer.data(), &received);
+  QVector<Operation> result;
+  Operation op;
+  while (reader.next(op))
+    result.append(op);
+  if (reader.hasError())
+    result.clear();
+  return result;
+}
+
+// Fields carried by the operation
+static bool sameOperation(const Operation &actual, const Operation &expected) {
+  if (actual.type != expected.type || actual.editorId != expected.editorId ||
+      actual.byId != expected.byId ||
+      actual.symbols.size() != expected.symbols.size())
+    return false;
+  for (int i = 0; i < expected.symbols.size(); i++) {
+    const Symbol &s1 = actual.symbols.at(i), &s2 = expected.symbols.at(i);
+    if (expected.byId) {
+      if (actual.ids.at(i) != s2.opId())
+        return false;
+    } else if (Symbol::compare(s1, s2) != 0) {
+      return false;
+    }
+    if (Operation::hasValue(expected.type) && !expected.byId &&
+        (s1.getValue() != s2.getValue() || s1.getCounter() != s2.getCounter()))
+      return false;
+    if (Operation::hasFormat(expected.type) && s1.getFormat() != s2.getFormat())
+      return false;
+  }
+  return expected.type != DELETE_RANGE || actual.ids == expected.ids;
+}
+
+void TestOpcodes::roundTrip_data() {
+  QTest::addColumn<Operation>("op");
+
+  QRandomGenerator rng(1);
+  QVector<Symbol> symbols = randomSymbols(rng, 300, 12);
+  auto single = [&symbols](OperationType type, int i) {
+    return Operation(type, 7, QVector<Symbol>{symbols.at(i)});
+  };
+  QTest::newRow("insert") << single(INSERT_SYMBOL, 10);
+  QTest::newRow("align") << single(ALIGN, 11);
+  QTest::newRow("cursor") << single(CURSOR, 12);
+  QTest::newRow("paste") << Operation(PASTE, 7, symbols.mid(0, 200));
+  QTest::newRow("delete") << Operation(DELETE_SYMBOL, -3, symbols.mid(50, 9));
+  QTest::newRow("change") << Operation(CHANGE, 7, symbols.mid(100, 40));
+
+  Operation byId(DELETE_SYMBOL, 7, symbols.mid(20, 30));
+  byId.byId = true;
+  QTest::newRow("delete by id") << byId;
+  byId.type = CHANGE;
+  QTest::newRow("change by id") << byId;
+  Operation cursor = single(CURSOR, 13);
+  cursor.byId = true;
+  QTest::newRow("cursor by id") << cursor;
+
+  Operation range(DELETE_RANGE, 7,
+                  QVector<Symbol>{symbols.at(100), symbols.at(199)});
+  for (int i = 100; i < 200; i++)
+    addLastOpId(range.ids, symbols.at(i).opId());
+  QTest::newRow("range") << range;
+}
+
+void TestOpcodes::roundTrip() {
+  QFETCH(Operation, op);
+  QVector<Operation> received = transfer(QVector<Operation>{op, op});
+  QCOMPARE(received.size(), 2);
+  QVERIFY(sameOperation(received.at(0), op));
+  QVERIFY(sameOperation(received.at(1), op));
+}
+
+// Formats with the same content hash are still told apart
+void TestOpcodes::hashCollision() {
+  SymbolFormat f1 = collidingFormat("#5d1d7c");
+  SymbolFormat f2 = collidingFormat("#2e9c58");
+  QCOMPARE(f1.key(), f2.key());
+  QVERIFY(f1 != f2);
+
+  Symbol s1('a', Position{Identifier(1, 1)}, 1, f1);
+  Symbol s2('b', Position{Identifier(2, 1)}, 2, f2);
+  QVERIFY(s1.getFormatId() != s2.getFormatId());
+  QVector<Operation> received =
+      transfer({Operation(INSERT_SYMBOL, 1, QVector<Symbol>{s1}),
+                Operation(INSERT_SYMBOL, 1, QVector<Symbol>{s2})});
+  QCOMPARE(received.size(), 2);
+  QVERIFY(received.at(0).symbols.first().getFormat() == f1);
+  QVERIFY(received.at(1).symbols.first().getFormat() == f2);
+}
+
+// An id defined again, after the sender evicted and reused it, refers to
+// the new format in the following frames
+void TestOpcodes::redefinition() {
+  Symbol s('a', Position{Identifier(1, 1)}, 1, testFormat(1));
+  QSet<quint32> sent;
+  QHash<quint32, SymbolFormat> received;
+  Operation op(INSERT_SYMBOL, 1, QVector<Symbol>{s});
+
+  OpWriter first(&sent);
+  first.append(op);
+  OpReader firstReader(first.data(), &received);
+  Operation result;
+  QVERIFY(firstReader.next(result));
+  QVERIFY(result.symbols.first().getFormat() == testFormat(1));
+
+  sent.remove(s.getFormatId());
+  OpWriter second(&sent);
+  second.define(s.getFormatId(), testFormat(2));
+  second.append(op);
+  OpReader secondReader(second.data(), &received);
+  QVERIFY(secondReader.next(result));
+  QVERIFY(result.symbols.first().getFormat() == testFormat(2));
+}
+
+void TestOpcodes::undefinedFormat() {
+  Symbol s('a', Position{Identifier(1, 1)}, 1, testFormat(3));
+  OpWriter writer(nullptr); // No definitions
+  writer.append(Operation(INSERT_SYMBOL, 1, QVector<Symbol>{s}));
+  QHash<quint32, SymbolFormat> received;
+  OpReader reader(writer.data(), &received);
+  Operation op;
+  QVERIFY(!reader.next(op));
+  QVERIFY(reader.hasError());
+}
+
+// Typing: one INSERT_SYMBOL per character, as binary operations and as the
+// JSON messages sent to servers without them
+void TestOpcodes::encode_data() {
+  QTest::addColumn<bool>("binary");
+  QTest::newRow("binary") << true;
+  QTest::newRow("JSON") << false;
+}
+
+void TestOpcodes::encode() {
+  QFETCH(bool, binary);
+  QRandomGenerator rng(2);
+  QVector<Symbol> symbols = randomSymbols(rng, BENCHMARK_OPS);
+  int bytes = 0;
+  QBENCHMARK {
+    bytes = 0;
+    QSet<quint32> sent;
+    OpWriter writer(&sent);
+    for (const Symbol &s : symbols) {
+      Operation op(INSERT_SYMBOL, 1, QVector<Symbol>{s});
+      if (binary) {
+        writer.append(op);
+        continue;
+      }
+      QJsonObject message;
+      message["type"] = QStringLiteral("operation");
+      message["editorId"] = op.editorId;
+      message["operation_type"] = op.type;
+      message["symbol"] = s.toJson();
+      bytes += QJsonDocument(message).toJson(QJsonDocument::Compact).size();
+    }
+    bytes += writer.size();
+  }
+  qDebug().nospace() << double(bytes) / symbols.size() << " bytes/op";
+}
+
+void TestOpcodes::decode() {
+  QRandomGenerator rng(2);
+  QVector<Symbol> symbols = randomSymbols(rng, BENCHMARK_OPS);
+  QSet<quint32> sent;
+  OpWriter writer(&sent);
+  for (const Symbol &s : symbols)
+    writer.append(Operation(INSERT_SYMBOL, 1, QVector<Symbol>{s}));
+  QByteArray data = writer.data();
+
+  int ops = 0;
+  QBENCHMARK {
+    QHash<quint32, SymbolFormat> received;
+    OpReader reader(data, &received);
+    Operation op;
+    for (ops = 0; reader.next(op); ops++) {
+    }
+  }
+  QCOMPARE(ops, symbols.size());
+}
+
+QTEST_APPLESS_MAIN(TestOpcodes)
+#include "tst_opcodes.moc"
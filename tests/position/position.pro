@@ -0,0 +1,6 @@
+TARGET = tst_position
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_position.cpp
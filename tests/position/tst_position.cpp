@@ -0,0 +1,453 @@
+#include "../../Utility/position.h"
+#include <QRandomGenerator>
+#include <QtTest>
+#include <climits>
+#include <cstring>
+
+// Random positions compared with each other
+#define PROPERTY_POSITIONS 4000
+#define PROPERTY_SEED 20191105
+// Positions created or decoded per benchmark iteration
+#define BENCHMARK_POSITIONS 100000
+// Neighbouring positions compared per benchmark iteration
+#define BENCHMARK_COMPARES 10000
+
+class TestPosition : public QObject {
+  Q_OBJECT
+
+private slots:
+  void keyOrderMatchesCompare();
+  void keyRoundTrip();
+  void invalidKey();
+  void inlineStorage();
+  void copyAndMove();
+  void dataStreamFormat();
+  void create_data();
+  void create();
+  void decode_data();
+  void decode();
+  void compareMatchesIdentifiers();
+  void firstDifference();
+  void compare_data();
+  void compare();
+
+private:
+  QVector<Position> randomPositions(QRandomGenerator &rng, int count);
+};
+
+// Digits and sites near the bounds of int, where flipping the sign bit
+// matters, as well as small ones
+static int randomComponent(QRandomGenerator &rng) {
+  static const int edges[] = {INT_MIN, INT_MIN + 1, -1, 0, 1, INT_MAX - 1,
+                              INT_MAX};
+  switch (rng.bounded(4)) {
+  case 0:
+    return edges[rng.bounded(static_cast<int>(sizeof(edges) / sizeof(int)))];
+  case 1:
+    return rng.bounded(-4, 5);
+  default:
+    return static_cast<int>(rng.generate());
+  }
+}
+
+// Sign of the comparison of the keys byte by byte, the shorter first when
+// one is a prefix of the other
+static int compareKeys(const QByteArray &k1, const QByteArray &k2) {
+  int n = qMin(k1.size(), k2.size());
+  int result = n > 0 ? std::memcmp(k1.constData(), k2.constData(), n) : 0;
+  if (result != 0)
+    return result < 0 ? -1 : 1;
+  return k1.size() < k2.size() ? -1 : (k1.size() > k2.size() ? 1 : 0);
+}
+
+static int sign(int n) { return n < 0 ? -1 : (n > 0 ? 1 : 0); }
+
+/*
+ * Mixed depths, inline and on the heap, half of them sharing a prefix with
+ * an earlier one: then they differ only by the digit, only by the site, or
+ * only by being longer.
+ */
+QVector<Position> TestPosition::randomPositions(QRandomGenerator &rng,
+                                                int count) {
+  QVector<Position> positions;
+  positions.reserve(count);
+  for (int n = 0; n < count; n++) {
+    Position position;
+    if (n > 0 && rng.bounded(2) == 0) {
+      const Position &other = positions.at(rng.bounded(n));
+      int prefix = rng.bounded(other.size() + 1);
+      for (int i = 0; i < prefix; i++)
+        position.append(other[i]);
+      if (prefix < other.size() && rng.bounded(2) == 0) {
+        Identifier id = other[prefix];
+        if (rng.bounded(2) == 0)
+          id.site = randomComponent(rng);
+        else
+          id.digit = randomComponent(rng);
+        position.append(id);
+      }
+    }
+    int depth = position.size() + rng.bounded(rng.bounded(4) == 0 ? 12 : 4);
+    while (position.size() < depth)
+      position.append(Identifier(randomComponent(rng), randomComponent(rng)));
+    positions.append(position);
+  }
+  return positions;
+}
+
+void TestPosition::keyOrderMatchesCompare() {
+  QRandomGenerator rng(PROPERTY_SEED);
+  QVector<Position> positions = randomPositions(rng, PROPERTY_POSITIONS);
+  QVector<QByteArray> keys;
+  keys.reserve(positions.size());
+  for (const Position &position : positions)
+    keys.append(position.toKey());
+
+  // Every pair, consecutive ones sharing prefixes most often
+  for (int i = 0; i < positions.size(); i++) {
+    for (int j = i; j < positions.size(); j += 1 + rng.bounded(16)) {
+      int expected = sign(Position::compare(positions.at(i), positions.at(j)));
+      if (compareKeys(keys.at(i), keys.at(j)) != expected ||
+          sign(-Position::compare(positions.at(j), positions.at(i))) !=
+              expected) {
+        QFAIL(qPrintable(QStringLiteral("keys of %1 and %2 disagree")
+                             .arg(i)
+                             .arg(j)));
+      }
+      QCOMPARE(keys.at(i) < keys.at(j), expected < 0);
+    }
+  }
+
+  // Sorting by key sorts by position
+  std::sort(keys.begin(), keys.end());
+  Position previous, current;
+  for (int i = 0; i < keys.size(); i++) {
+    QVERIFY(Position::fromKey(keys.at(i), current));
+    if (i > 0)
+      QVERIFY(Position::compare(previous, current) <= 0);
+    previous = current;
+  }
+}
+
+void TestPosition::keyRoundTrip() {
+  QRandomGenerator rng(PROPERTY_SEED + 1);
+  for (const Position &position : randomPositions(rng, PROPERTY_POSITIONS)) {
+    QByteArray key = position.toKey();
+    QCOMPARE(key.size(), position.size() * POSITION_KEY_LEVEL);
+    Position decoded{Identifier(7, 7)}; // Replaced
+    QVERIFY(Position::fromKey(key, decoded));
+    QCOMPARE(decoded.size(), position.size());
+    for (int i = 0; i < position.size(); i++) {
+      QCOMPARE(decoded[i].digit, position[i].digit);
+      QCOMPARE(decoded[i].site, position[i].site);
+    }
+    QCOMPARE(decoded.toKey(), key);
+  }
+}
+
+void TestPosition::invalidKey() {
+  Position position{Identifier(1, 2)};
+  QByteArray key = position.toKey();
+  QVERIFY(!Position::fromKey(key.left(POSITION_KEY_LEVEL - 1), position));
+  QVERIFY(position.isEmpty());
+  QVERIFY(Position::fromKey(QByteArray(), position));
+  QVERIFY(position.isEmpty());
+}
+
+// Whether the identifiers are stored in the object itself
+static bool isInline(const Position &position) {
+  const char *ids = reinterpret_cast<const char *>(position.data());
+  const char *object = reinterpret_cast<const char *>(&position);
+  return ids >= object && ids < object + sizeof(Position);
+}
+
+// Levels alternating between a positive and a negative site
+static Position positionOfDepth(int depth, int first = 1) {
+  Position position;
+  for (int level = 0; level < depth; level++)
+    position.append(Identifier(first + level, level % 2 == 0 ? 1 : -2));
+  return position;
+}
+
+static bool samePosition(const Position &p1, const QVector<Identifier> &p2) {
+  if (p1.size() != p2.size())
+    return false;
+  for (int i = 0; i < p2.size(); i++) {
+    if (p1[i].digit != p2[i].digit || p1[i].site != p2[i].site)
+      return false;
+  }
+  return true;
+}
+
+void TestPosition::inlineStorage() {
+  for (int depth = 0; depth <= 2 * POSITION_INLINE_DEPTH; depth++) {
+    Position position = positionOfDepth(depth);
+    QCOMPARE(isInline(position), depth <= POSITION_INLINE_DEPTH);
+    QCOMPARE(position.size(), depth);
+    QVERIFY(samePosition(position, positionOfDepth(depth).toVector()));
+  }
+
+  // Back to fewer levels, the identifiers stay on the heap
+  Position position = positionOfDepth(POSITION_INLINE_DEPTH + 1);
+  position.truncate(1);
+  QVERIFY(!isInline(position));
+  position.append(Identifier(5, 5));
+  QCOMPARE(position.last().digit, 5);
+  QCOMPARE(position[0].digit, 1);
+}
+
+// Between inline and heap storage in every combination
+void TestPosition::copyAndMove() {
+  const int depths[] = {0, 2, POSITION_INLINE_DEPTH, POSITION_INLINE_DEPTH + 1,
+                        9};
+  for (int d1 : depths) {
+    for (int d2 : depths) {
+      const QVector<Identifier> v1 = positionOfDepth(d1, 1).toVector();
+      const QVector<Identifier> v2 = positionOfDepth(d2, 100).toVector();
+      Position p1(v1), p2(v2);
+
+      Position copy(p1);
+      QVERIFY(samePosition(copy, v1));
+      copy = p2;
+      QVERIFY(samePosition(copy, v2));
+      QVERIFY(samePosition(p2, v2));
+
+      Position moved(std::move(copy));
+      QVERIFY(samePosition(moved, v2));
+      QVERIFY(copy.isEmpty());
+      moved = std::move(p1);
+      QVERIFY(samePosition(moved, v1));
+      QVERIFY(samePosition(p1, v2));
+      std::swap(moved, p1);
+      QVERIFY(samePosition(moved, v2));
+      QVERIFY(samePosition(p1, v1));
+    }
+  }
+}
+
+// Stored snapshots and file transfers hold QVector<Identifier> streams
+void TestPosition::dataStreamFormat() {
+  for (int depth = 0; depth <= 2 * POSITION_INLINE_DEPTH; depth++) {
+    Position position = positionOfDepth(depth);
+    QByteArray data, vectorData;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out << position;
+    QDataStream vectorOut(&vectorData, QIODevice::WriteOnly);
+    vectorOut << position.toVector();
+    QCOMPARE(data, vectorData);
+
+    Position decoded{Identifier(7, 7)}; // Replaced
+    QDataStream vectorIn(vectorData);
+    vectorIn >> decoded;
+    QVERIFY(samePosition(decoded, position.toVector()));
+
+    // A truncated stream leaves no identifiers
+    if (depth > 0) {
+      QDataStream in(vectorData.left(vectorData.size() - 1));
+      in >> decoded;
+      QVERIFY(in.status() != QDataStream::Ok);
+      QVERIFY(decoded.isEmpty());
+    }
+  }
+
+  // A corrupted count doesn't allocate more than the stream contains
+  QByteArray data;
+  QDataStream out(&data, QIODevice::WriteOnly);
+  out << quint32(0x7FFFFFFF);
+  Position decoded;
+  QDataStream in(data);
+  in >> decoded;
+  QVERIFY(in.status() != QDataStream::Ok);
+  QVERIFY(decoded.isEmpty());
+
+  // Nor does a position deeper than any can be throw
+  QVector<Identifier> deep(POSITION_MAX_DEPTH + 1, Identifier(1, 1));
+  QByteArray deepData;
+  QDataStream deepOut(&deepData, QIODevice::WriteOnly);
+  deepOut << deep;
+  QDataStream deepIn(deepData);
+  deepIn >> decoded;
+  QCOMPARE(deepIn.status(), QDataStream::ReadCorruptData);
+  QVERIFY(decoded.isEmpty());
+}
+
+// Generating positions: the depth, as Position or as QVector<Identifier>
+// like the symbols stored them before
+static void addStorageRows() {
+  QTest::addColumn<int>("depth");
+  QTest::addColumn<bool>("vector");
+  for (int depth : {1, POSITION_INLINE_DEPTH, POSITION_INLINE_DEPTH + 1, 8}) {
+    QTest::newRow(qPrintable(QStringLiteral("Position %1").arg(depth)))
+        << depth << false;
+    QTest::newRow(qPrintable(QStringLiteral("QVector %1").arg(depth)))
+        << depth << true;
+  }
+}
+
+template <typename P>
+static QVector<P> createPositions(const Position &ids, int count) {
+  QVector<P> positions;
+  positions.reserve(count);
+  for (int n = 0; n < count; n++) {
+    P position;
+    position.reserve(ids.size());
+    for (const Identifier &id : ids)
+      position.append(id);
+    positions.append(std::move(position));
+  }
+  return positions;
+}
+
+template <typename P> static int decodePositions(const QByteArray &data) {
+  QVector<P> positions;
+  QDataStream in(data);
+  in >> positions;
+  return positions.size();
+}
+
+void TestPosition::create_data() { addStorageRows(); }
+
+void TestPosition::create() {
+  QFETCH(int, depth);
+  QFETCH(bool, vector);
+  Position ids = positionOfDepth(depth);
+  const int count = BENCHMARK_POSITIONS;
+  int created = 0;
+  QBENCHMARK {
+    if (vector)
+      created = createPositions<QVector<Identifier>>(ids, count).size();
+    else
+      created = createPositions<Position>(ids, count).size();
+  }
+  QCOMPARE(created, BENCHMARK_POSITIONS);
+}
+
+void TestPosition::decode_data() { addStorageRows(); }
+
+void TestPosition::decode() {
+  QFETCH(int, depth);
+  QFETCH(bool, vector);
+  QByteArray data;
+  QDataStream out(&data, QIODevice::WriteOnly);
+  out << createPositions<Position>(positionOfDepth(depth), BENCHMARK_POSITIONS);
+  int decoded = 0;
+  QBENCHMARK {
+    decoded = vector ? decodePositions<QVector<Identifier>>(data)
+                     : decodePositions<Position>(data);
+  }
+  QCOMPARE(decoded, BENCHMARK_POSITIONS);
+}
+
+// Reference order: one identifier at a time, as positions were compared
+// before
+static int compareIdentifiers(const QVector<Identifier> &p1,
+                              const QVector<Identifier> &p2) {
+  for (int i = 0; i < p1.size() && i < p2.size(); i++) {
+    int result = Identifier::compare(p1[i], p2[i]);
+    if (result != 0)
+      return result;
+  }
+  return p1.size() < p2.size() ? -1 : (p1.size() > p2.size() ? 1 : 0);
+}
+
+static int commonIdentifiers(const QVector<Identifier> &p1,
+                             const QVector<Identifier> &p2) {
+  int i = 0;
+  while (i < p1.size() && i < p2.size() && p1[i].digit == p2[i].digit &&
+         p1[i].site == p2[i].site)
+    i++;
+  return i;
+}
+
+void TestPosition::compareMatchesIdentifiers() {
+  QRandomGenerator rng(PROPERTY_SEED + 2);
+  QVector<Position> positions = randomPositions(rng, PROPERTY_POSITIONS);
+  for (int i = 0; i < positions.size(); i++) {
+    const Position &p1 = positions.at(i);
+    for (int j = i; j < positions.size(); j += 1 + rng.bounded(16)) {
+      const Position &p2 = positions.at(j);
+      QVector<Identifier> v1 = p1.toVector(), v2 = p2.toVector();
+      if (sign(Position::compare(p1, p2)) != compareIdentifiers(v1, v2) ||
+          Position::commonPrefix(p1.data(), p1.size(), p2.data(),
+                                 p2.size()) != commonIdentifiers(v1, v2)) {
+        QFAIL(qPrintable(QStringLiteral("positions %1 and %2 disagree")
+                             .arg(i)
+                             .arg(j)));
+      }
+    }
+  }
+}
+
+// Positions differing at a single level, in either lane of a vector
+// comparison or in the scalar tail, by the digit or only by the site
+void TestPosition::firstDifference() {
+  for (int depth = 1; depth <= 9; depth++) {
+    for (int level = 0; level < depth; level++) {
+      for (bool site : {false, true}) {
+        Position p1 = positionOfDepth(depth);
+        Position p2;
+        for (int i = 0; i < depth; i++) {
+          Identifier id = p1[i];
+          if (i == level)
+            (site ? id.site : id.digit) += 1;
+          p2.append(id);
+        }
+        QCOMPARE(Position::compare(p1, p2), -1);
+        QCOMPARE(Position::compare(p2, p1), 1);
+        QCOMPARE(Position::commonPrefix(p1.data(), depth, p2.data(), depth),
+                 level);
+      }
+    }
+    Position prefix = positionOfDepth(depth - 1);
+    Position position = positionOfDepth(depth);
+    QCOMPARE(Position::compare(prefix, position), -1);
+    QCOMPARE(Position::compare(position, position), 0);
+    QCOMPARE(Position::commonPrefix(prefix.data(), depth - 1, position.data(),
+                                    depth),
+             depth - 1);
+  }
+}
+
+void TestPosition::compare_data() {
+  QTest::addColumn<int>("depth");
+  QTest::addColumn<bool>("copies");
+  for (int depth : {1, POSITION_INLINE_DEPTH, 8, 32}) {
+    QTest::newRow(qPrintable(QStringLiteral("Position %1").arg(depth)))
+        << depth << false;
+    QTest::newRow(qPrintable(QStringLiteral("QVector copies %1").arg(depth)))
+        << depth << true;
+  }
+}
+
+/*
+ * Neighbours differing only at the last level, as met by the binary
+ * searches of the CRDT, compared in place or by copying the identifiers
+ * like Symbol::compare did. Build with DEFINES+=POSITION_NO_SIMD, as
+ * tst_position_scalar is, to measure the scalar comparison.
+ */
+void TestPosition::compare() {
+  QFETCH(int, depth);
+  QFETCH(bool, copies);
+  QVector<Position> positions;
+  for (int n = 0; n < BENCHMARK_COMPARES; n++) {
+    Position position = positionOfDepth(depth - 1);
+    position.append(Identifier(n, 1));
+    positions.append(position);
+  }
+
+  int less = 0;
+  QBENCHMARK {
+    less = 0;
+    for (int i = 1; i < positions.size(); i++) {
+      const Position &p1 = positions.at(i - 1), &p2 = positions.at(i);
+      if (copies)
+        less += compareIdentifiers(p1.toVector(), p2.toVector()) < 0;
+      else
+        less += Position::compare(p1, p2) < 0;
+    }
+  }
+  QCOMPARE(less, positions.size() - 1);
+}
+
+QTEST_APPLESS_MAIN(TestPosition)
+#include "tst_position.moc"
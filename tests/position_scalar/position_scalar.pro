@@ -0,0 +1,9 @@
+# tst_position with the scalar comparison of positions
+TARGET = tst_position_scalar
+
+include(../tests.pri)
+
+DEFINES += POSITION_NO_SIMD
+
+SOURCES += \
+    ../position/tst_position.cpp
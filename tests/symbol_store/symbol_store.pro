@@ -0,0 +1,6 @@
+TARGET = tst_symbol_store
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_symbol_store.cpp
@@ -0,0 +1,299 @@
+#include "../../Utility/symbol_store.h"
+#include "../test_symbols.h"
+#include <QMap>
+#include <QtTest>
+
+// Positions edited at random, and edits applied
+#define PROPERTY_SYMBOLS 5000
+#define PROPERTY_EDITS 20000
+#define PROPERTY_SEED 20191112
+// Symbols of the benchmark documents
+#define BENCHMARK_SYMBOLS 100000
+// Levels above the positions of the deep documents
+#define DEEP_PREFIX 8
+
+class TestSymbolStore : public QObject {
+  Q_OBJECT
+
+private slots:
+  void randomEdits_data();
+  void randomEdits();
+  void append_data();
+  void append();
+  void compaction();
+  void trie();
+  void insert_data();
+  void insert();
+  void memory_data();
+  void memory();
+};
+
+// The same document, sorted by position key
+typedef QMap<QByteArray, Symbol> Reference;
+
+static const int sites[] = {1, 2, 3, -5};
+
+static void compareStore(const SymbolStore &store, const Reference &reference) {
+  QCOMPARE(store.size(), reference.size());
+  QVector<Symbol> symbols = store.toVector();
+  QCOMPARE(symbols.size(), reference.size());
+  int i = 0;
+  for (const Symbol &expected : reference) {
+    QVERIFY2(sameSymbol(symbols.at(i), expected),
+             qPrintable(QStringLiteral("%1: %2 instead of %3")
+                            .arg(i)
+                            .arg(symbols.at(i).to_string())
+                            .arg(expected.to_string())));
+    i++;
+  }
+  QCOMPARE(store.encode(), encodeSymbols(symbols));
+}
+
+// The positions with and without shared prefixes, as they are and nested
+// below a common prefix, as when a document is edited in a single spot
+static void addStoreRows() {
+  QTest::addColumn<bool>("shared");
+  QTest::addColumn<int>("prefix");
+  QTest::newRow("arena") << false << 0;
+  QTest::newRow("shared prefixes") << true << 0;
+  QTest::newRow("arena, deep") << false << DEEP_PREFIX;
+  QTest::newRow("shared prefixes, deep") << true << DEEP_PREFIX;
+}
+
+static QVector<Symbol> nested(const QVector<Symbol> &symbols, int levels) {
+  Position prefix;
+  for (int level = 0; level < levels; level++)
+    prefix.append(Identifier(level + 1, 2));
+  QVector<Symbol> result;
+  result.reserve(symbols.size());
+  for (const Symbol &s : symbols) {
+    Position position = prefix;
+    for (const Identifier &id : s.getPositionRef())
+      position.append(id);
+    result.append(Symbol(s.getValue(), position, s.getCounter()));
+    result.last().setFormatId(s.getFormatId());
+  }
+  return result;
+}
+
+void TestSymbolStore::randomEdits_data() { addStoreRows(); }
+
+/*
+ * Inserts, changes, removals and range removals at random positions, on
+ * the store and on a map of the symbols. Ranges remove only the symbols
+ * seen by their sender, the last counter of some of the sites.
+ */
+void TestSymbolStore::randomEdits() {
+  QFETCH(bool, shared);
+  QFETCH(int, prefix);
+  QRandomGenerator rng(PROPERTY_SEED);
+  QVector<Symbol> pool =
+      nested(randomSymbols(rng, PROPERTY_SYMBOLS, 20), prefix);
+  SymbolStore store(shared);
+  QCOMPARE(store.sharedPrefixes(), shared);
+  Reference reference;
+  int counter = PROPERTY_SYMBOLS;
+
+  for (int n = 1; n <= PROPERTY_EDITS; n++) {
+    const Symbol &s = pool.at(rng.bounded(pool.size()));
+    QByteArray key = s.getPositionRef().toKey();
+    Symbol found;
+    int edit = rng.bounded(10);
+    if (edit < 6) {
+      // Inserted, or changed with a new value, format and possibly counter
+      Symbol symbol = s;
+      if (reference.contains(key)) {
+        int symbolCounter =
+            rng.bounded(2) == 0 ? reference.value(key).getCounter() : ++counter;
+        symbol = Symbol('A' + rng.bounded(26), s.getPositionRef(),
+                        symbolCounter, testFormat(rng.bounded(20)));
+        QVERIFY(store.findById(reference.value(key).opId(), found));
+      }
+      store.insert(symbol);
+      reference.insert(key, symbol);
+    } else if (edit < 8) {
+      QCOMPARE(store.remove(s.getPositionRef()), reference.contains(key));
+      if (reference.contains(key)) {
+        OpId id = reference.take(key).opId();
+        QVERIFY(!store.findById(id, found));
+      }
+    } else {
+      QByteArray lastKey =
+          pool.at(rng.bounded(pool.size())).getPositionRef().toKey();
+      if (lastKey < key)
+        std::swap(key, lastKey);
+      Position first, last;
+      QVERIFY(Position::fromKey(key, first));
+      QVERIFY(Position::fromKey(lastKey, last));
+      QVector<OpId> seen;
+      for (int site : sites) {
+        if (rng.bounded(4) != 0)
+          addLastOpId(seen, makeOpId(site, rng.bounded(counter + 1)));
+      }
+
+      QVector<Symbol> expected, removed;
+      for (auto it = reference.lowerBound(key);
+           it != reference.end() && !(lastKey < it.key());) {
+        if (isKnownOpId(seen, it.value().opId())) {
+          expected.append(it.value());
+          it = reference.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      QCOMPARE(store.removeRange(first, last, seen, &removed),
+               expected.size());
+      QCOMPARE(removed.size(), expected.size());
+      for (int i = 0; i < expected.size(); i++) {
+        QVERIFY(sameSymbol(removed.at(i), expected.at(i)));
+        QVERIFY(!store.findById(expected.at(i).opId(), found));
+      }
+    }
+
+    if (n % 1000 == 0) {
+      compareStore(store, reference);
+      for (const Symbol &expected : reference) {
+        QVERIFY(store.contains(expected.getPositionRef()));
+        QVERIFY(store.findById(expected.opId(), found));
+        QVERIFY(sameSymbol(found, expected));
+      }
+    }
+  }
+  QVERIFY(store.size() > 0);
+}
+
+void TestSymbolStore::append_data() { addStoreRows(); }
+
+// Loading a sorted document gives the same store as inserting it
+void TestSymbolStore::append() {
+  QFETCH(bool, shared);
+  QFETCH(int, prefix);
+  QRandomGenerator rng(PROPERTY_SEED + 1);
+  QVector<Symbol> symbols =
+      nested(randomSymbols(rng, 3 * SYMBOL_STORE_BLOCK, 10), prefix);
+  SymbolStore loaded(shared), typed(shared);
+  Reference reference;
+  for (const Symbol &s : symbols) {
+    loaded.append(s);
+    reference.insert(s.getPositionRef().toKey(), s);
+  }
+  std::shuffle(symbols.begin(), symbols.end(), rng);
+  for (const Symbol &s : symbols)
+    typed.insert(s);
+  compareStore(loaded, reference);
+  compareStore(typed, reference);
+}
+
+// The arena is compacted once mostly garbage, and symbols are still found
+// by id afterwards
+void TestSymbolStore::compaction() {
+  QRandomGenerator rng(PROPERTY_SEED + 2);
+  QVector<Symbol> symbols = randomSymbols(rng, 10 * SYMBOL_STORE_BLOCK);
+  SymbolStore store;
+  Reference reference;
+  for (const Symbol &s : symbols) {
+    store.append(s);
+    reference.insert(s.getPositionRef().toKey(), s);
+  }
+  qint64 before = store.memoryUsage();
+
+  for (int i = 0; i < symbols.size(); i++) {
+    if (i % 10 != 0) {
+      QVERIFY(store.remove(symbols.at(i).getPositionRef()));
+      reference.remove(symbols.at(i).getPositionRef().toKey());
+    }
+  }
+  compareStore(store, reference);
+  Symbol found;
+  for (const Symbol &s : reference) {
+    QVERIFY(store.findById(s.opId(), found));
+    QVERIFY(sameSymbol(found, s));
+  }
+  qint64 after = store.memoryUsage();
+  qDebug() << before << "bytes before removing 90% of the symbols," << after
+           << "after";
+  QVERIFY(after < before);
+
+  store.clear();
+  QVERIFY(store.isEmpty());
+  QVERIFY(store.toVector().isEmpty());
+}
+
+// Positions share nodes, which are freed with their last position and
+// recycled
+void TestSymbolStore::trie() {
+  PositionTrie trie;
+  Position p1{Identifier(1, 1), Identifier(2, 1), Identifier(3, 1)};
+  Position p2{Identifier(1, 1), Identifier(2, 1), Identifier(4, 2)};
+  Position prefix{Identifier(1, 1), Identifier(2, 1)};
+  quint32 n1 = trie.intern(p1.data(), p1.size());
+  quint32 n2 = trie.intern(p2.data(), p2.size());
+  QCOMPARE(trie.intern(p1.data(), p1.size()), n1);
+  QCOMPARE(trie.nodes(), 5); // The root and 4 identifiers
+  quint32 n3 = trie.intern(prefix.data(), prefix.size());
+  QCOMPARE(trie.nodes(), 5);
+  QCOMPARE(trie.depth(n3), 2);
+
+  Identifier path[3];
+  trie.path(n2, path);
+  QCOMPARE(Position::compare(path, 3, p2.data(), p2.size()), 0);
+  QVERIFY(trie.compare(n1, p2.data(), p2.size()) < 0);
+  QCOMPARE(trie.compare(n3, prefix.data(), prefix.size()), 0);
+
+  trie.release(n1);
+  QCOMPARE(trie.nodes(), 5);
+  trie.release(n1);
+  QCOMPARE(trie.nodes(), 4);
+  trie.release(n3);
+  trie.release(n2);
+  QCOMPARE(trie.nodes(), 1);
+
+  qint64 bytes = trie.memoryUsage();
+  trie.intern(p2.data(), p2.size());
+  QCOMPARE(trie.nodes(), 4);
+  QCOMPARE(trie.memoryUsage(), bytes);
+}
+
+void TestSymbolStore::insert_data() { addStoreRows(); }
+
+// A document typed at random places
+void TestSymbolStore::insert() {
+  QFETCH(bool, shared);
+  QFETCH(int, prefix);
+  QRandomGenerator rng(PROPERTY_SEED + 3);
+  QVector<Symbol> symbols =
+      nested(randomSymbols(rng, BENCHMARK_SYMBOLS), prefix);
+  std::shuffle(symbols.begin(), symbols.end(), rng);
+  int size = 0;
+  QBENCHMARK {
+    SymbolStore store(shared);
+    for (const Symbol &s : symbols)
+      store.insert(s);
+    size = store.size();
+  }
+  QCOMPARE(size, symbols.size());
+}
+
+void TestSymbolStore::memory_data() { addStoreRows(); }
+
+// Bytes per symbol of a loaded document, as logged by the server
+void TestSymbolStore::memory() {
+  QFETCH(bool, shared);
+  QFETCH(int, prefix);
+  QRandomGenerator rng(PROPERTY_SEED + 4);
+  QVector<Symbol> symbols =
+      nested(randomSymbols(rng, BENCHMARK_SYMBOLS), prefix);
+  SymbolStore store(shared);
+  for (const Symbol &s : symbols)
+    store.append(s);
+  qint64 depth = 0;
+  for (const Symbol &s : symbols)
+    depth += s.getPositionRef().size();
+  qDebug().nospace() << double(store.memoryUsage()) / store.size()
+                     << " bytes/symbol, mean depth "
+                     << double(depth) / symbols.size();
+  QVERIFY(store.memoryUsage() > 0);
+}
+
+QTEST_APPLESS_MAIN(TestSymbolStore)
+#include "tst_symbol_store.moc"
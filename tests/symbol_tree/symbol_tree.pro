@@ -0,0 +1,6 @@
+TARGET = tst_symbol_tree
+
+include(../tests.pri)
+
+SOURCES += \
+    tst_symbol_tree.cpp
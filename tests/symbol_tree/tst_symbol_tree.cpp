@@ -0,0 +1,313 @@
+#include "../../Utility/symbol_tree.h"
+#include "../test_symbols.h"
+#include <QtTest>
+
+// Edits applied at random, checking the tree every PROPERTY_CHECK
+#define PROPERTY_EDITS 50000
+#define PROPERTY_CHECK 1000
+#define PROPERTY_SEED 20191119
+// Lines of the benchmark document, and characters before their '\n'
+#define BENCHMARK_LINES 10000
+#define BENCHMARK_LINE 40
+// Lines split and joined again per benchmark iteration
+#define BENCHMARK_EDITS 1000
+// Symbols of the document pasted into, and of the paste
+#define BENCHMARK_DOCUMENT 100000
+#define BENCHMARK_PASTE 100000
+
+class TestSymbolTree : public QObject {
+  Q_OBJECT
+
+private slots:
+  void randomEdits();
+  void lowerBound();
+  void duplicates();
+  void newlines_data();
+  void newlines();
+  void splice_data();
+  void splice();
+  void paste_data();
+  void paste();
+};
+
+// A symbol with its own id, a line every 8 or so at random
+static Symbol randomSymbol(QRandomGenerator &rng, int counter) {
+  ushort value = rng.bounded(8) == 0 ? '\n' : 'a' + rng.bounded(26);
+  return Symbol(value, Position{Identifier(counter, 1)}, counter);
+}
+
+static void compareTree(const SymbolTree &tree,
+                        const QVector<Symbol> &reference) {
+  QCOMPARE(tree.size(), reference.size());
+  int newlines = 0, i = 0;
+  bool same = true;
+  tree.forEach([&](const Symbol &s) {
+    same = same && i < reference.size() && sameSymbol(s, reference.at(i));
+    i++;
+  });
+  QVERIFY(same);
+  QCOMPARE(i, reference.size());
+
+  QVector<int> lineStarts{0};
+  for (i = 0; i < reference.size(); i++) {
+    QCOMPARE(tree.lineOf(i), newlines);
+    QCOMPARE(tree.at(i).getValue(), reference.at(i).getValue());
+    QCOMPARE(tree.indexOf(reference.at(i).opId()), i);
+    if (reference.at(i).getValue() == '\n') {
+      newlines++;
+      lineStarts.append(i + 1);
+    }
+  }
+  QCOMPARE(tree.lineOf(reference.size()), newlines);
+  QCOMPARE(tree.lineCount(), newlines + 1);
+  for (int line = 0; line < lineStarts.size(); line++)
+    QCOMPARE(tree.lineStart(line), lineStarts.at(line));
+  QCOMPARE(tree.lineStart(lineStarts.size()), reference.size());
+
+  // From the middle, stopping after a few symbols
+  int from = reference.size() / 2, visited = 0;
+  tree.forEachFrom(from, [&](const Symbol &s) {
+    same = same && sameSymbol(s, reference.at(from + visited));
+    return ++visited < 100;
+  });
+  QVERIFY(same);
+  QCOMPARE(visited, qMin(100, reference.size() - from));
+}
+
+/*
+ * Inserts, replacements and removals, single or of ranges spanning whole
+ * subtrees, at random indexes of the tree and of a flat vector.
+ */
+void TestSymbolTree::randomEdits() {
+  QRandomGenerator rng(PROPERTY_SEED);
+  SymbolTree tree;
+  QVector<Symbol> reference;
+  int counter = 0;
+
+  for (int n = 1; n <= PROPERTY_EDITS; n++) {
+    int edit = rng.bounded(20);
+    if (edit < 12 || reference.isEmpty()) {
+      int i = rng.bounded(reference.size() + 1);
+      Symbol s = randomSymbol(rng, ++counter);
+      tree.insert(i, s);
+      reference.insert(i, s);
+    } else if (edit < 14) {
+      int i = rng.bounded(reference.size());
+      Symbol s = rng.bounded(2) == 0 ? randomSymbol(rng, ++counter)
+                                     : reference.at(i);
+      s.setFormatId(FormatTable::instance().intern(testFormat(n % 4)));
+      tree.replace(i, s);
+      reference[i] = s;
+    } else if (edit < 19) {
+      int i = rng.bounded(reference.size());
+      tree.remove(i);
+      reference.remove(i);
+    } else {
+      int i = rng.bounded(reference.size());
+      int count = 1 + rng.bounded(qMin(reference.size() - i, 2000));
+      tree.remove(i, count);
+      reference.remove(i, count);
+    }
+    if (n % PROPERTY_CHECK == 0) {
+      compareTree(tree, reference);
+      if (QTest::currentTestFailed()) {
+        qWarning("After %d edits", n);
+        return;
+      }
+    }
+  }
+
+  tree.remove(0, tree.size());
+  reference.clear();
+  compareTree(tree, reference);
+  QVERIFY(!tree.hasDuplicates());
+}
+
+// Symbols typed in random order land in CRDT order
+void TestSymbolTree::lowerBound() {
+  QRandomGenerator rng(PROPERTY_SEED + 1);
+  QVector<Symbol> sorted = randomSymbols(rng, 10000);
+  QVector<Symbol> typed = sorted;
+  std::shuffle(typed.begin(), typed.end(), rng);
+
+  SymbolTree tree;
+  QVector<Symbol> reference;
+  auto less = [](const Symbol &s1, const Symbol &s2) {
+    return Symbol::compare(s1, s2) < 0;
+  };
+  for (int n = 0; n < typed.size(); n++) {
+    const Symbol &s = typed.at(n);
+    int expected = static_cast<int>(
+        std::lower_bound(reference.begin(), reference.end(), s, less) -
+        reference.begin());
+    int i = tree.lowerBound(s);
+    QCOMPARE(i, expected);
+    tree.insert(i, s);
+    reference.insert(i, s);
+  }
+  compareTree(tree, sorted);
+  for (const Symbol &s : sorted)
+    QCOMPARE(tree.lowerBound(s), tree.indexOf(s.opId()));
+}
+
+// Ids held by two symbols, as from two sessions of a user, resolve once
+// only one is left
+void TestSymbolTree::duplicates() {
+  SymbolTree tree;
+  QVector<Symbol> symbols;
+  for (int n = 1; n <= 3 * SYMBOL_TREE_LEAF; n++)
+    symbols.append(Symbol('a', Position{Identifier(n, 1)}, n));
+  tree.insert(0, symbols.constData(), symbols.size());
+
+  Symbol twin('b', Position{Identifier(500, 1)}, 7);
+  QCOMPARE(twin.opId(), symbols.at(6).opId());
+  tree.insert(tree.size(), twin);
+  QVERIFY(tree.hasDuplicates());
+  QVERIFY(!tree.isUnique(twin.opId()));
+  QCOMPARE(tree.indexOf(twin.opId()), -1);
+
+  tree.remove(6);
+  QVERIFY(!tree.hasDuplicates());
+  QVERIFY(tree.isUnique(twin.opId()));
+  QCOMPARE(tree.indexOf(twin.opId()), tree.size() - 1);
+}
+
+void TestSymbolTree::newlines_data() {
+  QTest::addColumn<bool>("lines");
+  QTest::newRow("SymbolTree") << false;
+  QTest::newRow("vector of lines") << true;
+}
+
+/*
+ * Enter pressed in the middle of a line near the top of a long document,
+ * then undone: on the tree, and on the vector of lines the CRDT used
+ * before, where each line holds its '\n'.
+ */
+void TestSymbolTree::newlines() {
+  QFETCH(bool, lines);
+  int counter = 0;
+  QVector<QVector<Symbol>> vector;
+  QVector<Symbol> document;
+  for (int line = 0; line < BENCHMARK_LINES; line++) {
+    QVector<Symbol> symbols;
+    for (int k = 0; k <= BENCHMARK_LINE; k++) {
+      ushort value = k == BENCHMARK_LINE ? '\n' : 'a' + k % 26;
+      counter++;
+      symbols.append(Symbol(value, Position{Identifier(counter, 1)}, counter));
+    }
+    vector.append(symbols);
+    document.append(symbols);
+  }
+  SymbolTree tree;
+  tree.insert(0, document.constData(), document.size());
+  Symbol enter('\n', Position{Identifier(0, 2)}, 1);
+
+  const int line = 10, index = BENCHMARK_LINE / 2;
+  QBENCHMARK {
+    for (int n = 0; n < BENCHMARK_EDITS; n++) {
+      if (lines) {
+        QVector<Symbol> tail = vector.at(line).mid(index);
+        vector[line].resize(index);
+        vector[line].append(enter);
+        vector.insert(line + 1, tail);
+
+        vector[line].removeLast();
+        vector[line].append(vector.at(line + 1));
+        vector.remove(line + 1);
+      } else {
+        int i = tree.lineStart(line) + index;
+        tree.insert(i, enter);
+        tree.remove(i);
+      }
+    }
+  }
+  QCOMPARE(tree.lineCount(), BENCHMARK_LINES + 1);
+  QCOMPARE(vector.size(), BENCHMARK_LINES);
+  QCOMPARE(vector.at(line).size(), BENCHMARK_LINE + 1);
+}
+
+void TestSymbolTree::splice_data() {
+  QTest::addColumn<int>("size");
+  QTest::addColumn<int>("index");
+  QTest::addColumn<int>("count");
+  QTest::newRow("empty") << 0 << 0 << 1;
+  QTest::newRow("empty, two leaves") << 0 << 0 << SYMBOL_TREE_LEAF + 1;
+  QTest::newRow("start") << 5000 << 0 << 1000;
+  QTest::newRow("middle, leaf") << 5000 << 2500 << SYMBOL_TREE_LEAF;
+  QTest::newRow("middle, new root")
+      << 5000 << 2501 << SYMBOL_TREE_LEAF * SYMBOL_TREE_FANOUT * 3;
+  QTest::newRow("end") << 5000 << 5000 << 100000;
+}
+
+// A run inserted at once, then edited, is as if inserted one at a time
+void TestSymbolTree::splice() {
+  QFETCH(int, size);
+  QFETCH(int, index);
+  QFETCH(int, count);
+  QRandomGenerator rng(PROPERTY_SEED + 2);
+  int counter = 0;
+  QVector<Symbol> reference, run;
+  for (int n = 0; n < size; n++)
+    reference.append(randomSymbol(rng, ++counter));
+  for (int n = 0; n < count; n++)
+    run.append(randomSymbol(rng, ++counter));
+
+  SymbolTree tree;
+  for (int i = 0; i < reference.size(); i++)
+    tree.insert(i, reference.at(i));
+  tree.insert(index, run.constData(), run.size());
+  for (int n = 0; n < count; n++)
+    reference.insert(index + n, run.at(n));
+  compareTree(tree, reference);
+
+  // The leaves and nodes created are usable
+  for (int n = 0; n < 1000; n++) {
+    int i = rng.bounded(reference.size() + 1);
+    Symbol s = randomSymbol(rng, ++counter);
+    tree.insert(i, s);
+    reference.insert(i, s);
+  }
+  tree.remove(index, count);
+  reference.remove(index, count);
+  compareTree(tree, reference);
+}
+
+void TestSymbolTree::paste_data() {
+  QTest::addColumn<bool>("splice");
+  QTest::newRow("splice") << true;
+  QTest::newRow("one by one") << false;
+}
+
+/*
+ * A remote paste in the middle of a document: placed with one lowerBound
+ * and inserted at once, or placed and inserted one symbol at a time as
+ * before. Each iteration also loads the document, the same for both.
+ */
+void TestSymbolTree::paste() {
+  QFETCH(bool, splice);
+  QRandomGenerator rng(PROPERTY_SEED + 3);
+  QVector<Symbol> symbols =
+      randomSymbols(rng, BENCHMARK_DOCUMENT + BENCHMARK_PASTE);
+  int half = BENCHMARK_DOCUMENT / 2;
+  QVector<Symbol> document = symbols.mid(0, half);
+  document.append(symbols.mid(half + BENCHMARK_PASTE));
+  QVector<Symbol> run = symbols.mid(half, BENCHMARK_PASTE);
+
+  int size = 0;
+  QBENCHMARK {
+    SymbolTree tree;
+    tree.insert(0, document.constData(), document.size());
+    if (splice) {
+      tree.insert(tree.lowerBound(run.first()), run.constData(), run.size());
+    } else {
+      for (const Symbol &s : run)
+        tree.insert(tree.lowerBound(s), s);
+    }
+    size = tree.size();
+    QCOMPARE(tree.indexOf(run.last().opId()), half + BENCHMARK_PASTE - 1);
+  }
+  QCOMPARE(size, symbols.size());
+}
+
+QTEST_APPLESS_MAIN(TestSymbolTree)
+#include "tst_symbol_tree.moc"
@@ -0,0 +1,39 @@
+#ifndef TEST_CLIENT_H
+#define TEST_CLIENT_H
+
+#include "../Client/client.h"
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+
+/*
+ * Logs client in with the reply a server using binary operations would
+ * send, without a server: the connection attempt stays pending as long as
+ * the test doesn't run the event loop, so the frames written are only
+ * queued. Returns false if the client didn't switch to binary operations.
+ */
+inline bool loginBinary(Client &client, const QString &username) {
+  client.login(username, QStringLiteral("password"));
+
+  QJsonObject reply;
+  reply["type"] = QStringLiteral("login");
+  reply["req_id"] = 1; // The first request of the client
+  reply["success"] = true;
+  reply["username"] = username;
+  reply["nickname"] = username;
+  reply["binary_ops"] = OPCODE_VERSION;
+  QByteArray json = QJsonDocument(reply).toJson(QJsonDocument::Compact);
+
+  // JSON header, then the profile image: none
+  QByteArray message(4, 0);
+  qToLittleEndian<qint32>(json.size(), message.data());
+  message.append(json);
+  message.append(QByteArray(4, 0));
+  client.on_byteArrayReceived(message);
+
+  // Operations are only flushed by the timer, which never fires
+  client.setOutboxLimits(60000, 60000, 1 << 30);
+  return client.getBinaryOps();
+}
+
+#endif // TEST_CLIENT_H
@@ -0,0 +1,72 @@
+#ifndef TEST_SYMBOLS_H
+#define TEST_SYMBOLS_H
+
+#include "../Utility/symbol.h"
+#include <QRandomGenerator>
+#include <algorithm>
+
+// The n-th of a set of distinct formats, as picked from the editor toolbar
+inline SymbolFormat testFormat(int n) {
+  static const char *fonts[] = {"Arial", "Courier New", "Times New Roman"};
+  SymbolFormat format;
+  format.font = QString::fromLatin1(fonts[n % 3]);
+  format.size = 10 + n / 3 % 8;
+  format.bold = n / 24 % 2 != 0;
+  format.italic = n / 48 % 2 != 0;
+  format.color = QStringLiteral("#%1").arg(n * 2654435761u % 0xFFFFFF, 6, 16,
+                                           QLatin1Char('0'));
+  format.align = static_cast<SymbolFormat::Alignment>(n % 3);
+  return format;
+}
+
+/*
+ * count symbols in document order, as typed by a few sites, one of them
+ * negative: positions 1 to 4 levels deep sharing prefixes, a line every 60
+ * characters or so, and formats distinct formats.
+ */
+inline QVector<Symbol> randomSymbols(QRandomGenerator &rng, int count,
+                                     int formats = 8) {
+  static const int sites[] = {1, 2, 3, -5};
+  QVector<Position> positions;
+  positions.reserve(count);
+  auto less = [](const Position &p1, const Position &p2) {
+    return Position::compare(p1, p2) < 0;
+  };
+  auto equal = [](const Position &p1, const Position &p2) {
+    return Position::compare(p1, p2) == 0;
+  };
+  while (positions.size() < count) {
+    for (int n = positions.size(); n < count; n++) {
+      Position position;
+      int depth = 1 + rng.bounded(rng.bounded(8) == 0 ? 4 : 3);
+      for (int level = 0; level < depth; level++)
+        position.append(Identifier(rng.bounded(1, 32), sites[rng.bounded(4)]));
+      positions.append(position);
+    }
+    std::sort(positions.begin(), positions.end(), less);
+    positions.erase(std::unique(positions.begin(), positions.end(), equal),
+                    positions.end());
+  }
+
+  QVector<quint32> formatIds;
+  for (int n = 0; n < formats; n++)
+    formatIds.append(FormatTable::instance().intern(testFormat(n)));
+
+  QVector<Symbol> symbols;
+  symbols.reserve(count);
+  for (int n = 0; n < count; n++) {
+    ushort value = rng.bounded(60) == 0 ? '\n' : 'a' + rng.bounded(26);
+    Symbol s(value, positions.at(n), n + 1);
+    s.setFormatId(formatIds.at(n / 16 % formats));
+    symbols.append(s);
+  }
+  return symbols;
+}
+
+// Same value, position, counter and format
+inline bool sameSymbol(const Symbol &s1, const Symbol &s2) {
+  return s1.getValue() == s2.getValue() && Symbol::compare(s1, s2) == 0 &&
+         s1.getCounter() == s2.getCounter() && s1.getFormat() == s2.getFormat();
+}
+
+#endif // TEST_SYMBOLS_H
@@ -0,0 +1,17 @@
+# Settings shared by every test target
+
+QT       += core gui testlib
+
+TEMPLATE = app
+
+CONFIG += c++11
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += $$PWD/../Utility
+
+# zlib for frame compression: bundled with Qt on Windows
+win32: QT += zlib-private
+else: LIBS += -lz
@@ -0,0 +1,15 @@
+TEMPLATE = subdirs
+
+# Unit tests and benchmarks, run with "make check": the benchmarks report
+# their figures with -tickcounter or -callgrind, see the QtTest manual
+SUBDIRS = \
+    allocations \
+    codec \
+    crdt \
+    format_table \
+    frames \
+    opcodes \
+    position \
+    position_scalar \
+    symbol_store \
+    symbol_tree